@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+/*
+ * Message Benchmarks
+ * Builds and frees messages from fabricated slices, to measure the cost of
+ * the library bookkeeping without any kernel involvement. No bus1 device is
+ * needed: the peer is backed by a memfd, and the slices live outside of its
+ * pool, so they are never released to the kernel. Handle and fd slots are
+ * filled with BUS1_HANDLE_INVALID and -1, respectively, as real ones would
+ * require a kernel to release them again.
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <c-macro.h>
+#include <errno.h>
+#include <linux/bus1.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "bench.h"
+#include "message.h"
+#include "org.bus1/b1-peer.h"
+
+#define N_ITERATIONS (1000000)
+#define POOL_SIZE (16 * 1024 * 1024)
+
+static void *slice_new(size_t n_bytes, size_t n_handles, size_t n_fds) {
+        size_t offset = c_align_to(n_bytes, 8);
+        uint64_t *handle_ids;
+        uint8_t *slice;
+        int *fds;
+
+        slice = malloc(offset + n_handles * sizeof(*handle_ids) + n_fds * sizeof(*fds) + 1);
+        assert(slice);
+
+        memset(slice, 'x', n_bytes);
+
+        handle_ids = (uint64_t *)(slice + offset);
+        for (size_t i = 0; i < n_handles; i++)
+                handle_ids[i] = BUS1_HANDLE_INVALID;
+
+        fds = (int *)(handle_ids + n_handles);
+        for (size_t i = 0; i < n_fds; i++)
+                fds[i] = -1;
+
+        return slice;
+}
+
+static void bench_message(Bench *bench, B1Peer *peer, size_t n_bytes, size_t n_handles, size_t n_fds) {
+        void *slice;
+        char name[128];
+        int r;
+
+        slice = slice_new(n_bytes, n_handles, n_fds);
+
+        bench_start(bench);
+
+        for (unsigned int i = 0; i < N_ITERATIONS; i++) {
+                B1Message *message;
+
+                r = b1_message_new_from_slice(peer,
+                                              &message,
+                                              slice,
+                                              BUS1_MSG_DATA,
+                                              BUS1_HANDLE_INVALID,
+                                              0, 0, 1, 1,
+                                              n_bytes,
+                                              n_handles,
+                                              n_fds);
+                assert(r >= 0);
+
+                b1_message_unref(message);
+        }
+
+        bench_stop(bench);
+
+        snprintf(name, sizeof(name), "message, %zu bytes, %zu handles, %zu fds", n_bytes, n_handles, n_fds);
+        bench_report(bench, name, N_ITERATIONS);
+
+        free(slice);
+}
+
+int main(int argc, char **argv) {
+        static const size_t sizes[] = { 0, 64, 4096, 65536 };
+        static const size_t counts[][2] = { { 0, 0 }, { 4, 0 }, { 0, 4 }, { 16, 16 } };
+        _c_cleanup_(b1_peer_unrefp) B1Peer *peer = NULL;
+        Bench bench;
+        int r, fd;
+
+        fd = memfd_create("bench-message", MFD_CLOEXEC);
+        assert(fd >= 0);
+        assert(ftruncate(fd, POOL_SIZE) >= 0);
+
+        r = b1_peer_new_from_fd(&peer, fd);
+        assert(r >= 0);
+
+        bench_init(&bench);
+
+        for (size_t i = 0; i < C_ARRAY_SIZE(sizes); i++)
+                for (size_t j = 0; j < C_ARRAY_SIZE(counts); j++)
+                        bench_message(&bench, peer, sizes[i], counts[j][0], counts[j][1]);
+
+        bench_deinit(&bench);
+
+        return 0;
+}
@@ -0,0 +1,269 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+/*
+ * Overload Benchmark
+ * Ramps the load offered by several sending processes to a single receiver,
+ * and reports for each step the achieved throughput, the latency percentiles,
+ * the peak pool occupancy and the number of messages dropped by the kernel or
+ * rejected on send, once with single sends and once with batched sends.
+ *
+ * The pool occupancy is estimated from the backlog, i.e., the number of
+ * messages sent but neither received nor dropped yet, times the slice size.
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <c-macro.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <linux/bus1.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "bench.h"
+#include "org.bus1/b1-peer.h"
+
+#define N_SENDERS (4)
+#define N_BYTES (256)
+#define N_BATCH_MAX (16)
+#define STEP_NS (500ULL * 1000 * 1000)
+#define N_LATENCIES_MAX (4 * 1024 * 1024)
+
+typedef struct Shared Shared;
+
+struct Shared {
+        uint64_t n_sent[N_SENDERS];
+        uint64_t n_failed[N_SENDERS];
+};
+
+static uint64_t now_ns(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b) {
+        uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+        return x < y ? -1 : x > y;
+}
+
+static void sender(B1Peer *peer, B1Handle *handle, uint64_t rate, unsigned int n_batch, uint64_t *n_sentp, uint64_t *n_failedp) {
+        static uint8_t padding[N_BYTES - sizeof(uint64_t)];
+        B1Message *messages[N_BATCH_MAX];
+        B1MessageSend sends[N_BATCH_MAX];
+        uint64_t timestamps[N_BATCH_MAX];
+        uint64_t deadline, next, interval;
+        struct timespec ts;
+        int r;
+
+        for (unsigned int i = 0; i < n_batch; i++) {
+                struct iovec vecs[] = {
+                        { .iov_base = &timestamps[i], .iov_len = sizeof(timestamps[i]) },
+                        { .iov_base = padding, .iov_len = sizeof(padding) },
+                };
+
+                r = b1_message_new(peer, &messages[i]);
+                assert(r >= 0);
+
+                r = b1_message_set_payload(messages[i], vecs, C_ARRAY_SIZE(vecs));
+                assert(r >= 0);
+
+                sends[i] = (B1MessageSend){
+                        .message = messages[i],
+                        .destinations = &handle,
+                        .n_destinations = 1,
+                };
+        }
+
+        /* each sender offers an equal share of @rate, or as much as it can */
+        interval = rate ? 1000000000ULL * N_SENDERS * n_batch / rate : 0;
+        next = now_ns();
+        deadline = next + STEP_NS;
+
+        while (next < deadline) {
+                if (interval) {
+                        ts.tv_sec = next / 1000000000ULL;
+                        ts.tv_nsec = next % 1000000000ULL;
+                        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+                        next += interval;
+                } else {
+                        next = now_ns();
+                }
+
+                for (unsigned int i = 0; i < n_batch; i++)
+                        timestamps[i] = now_ns();
+
+                if (n_batch == 1)
+                        r = b1_message_send(messages[0], &handle, 1);
+                else
+                        r = b1_messages_send(sends, n_batch, NULL);
+
+                if (r < 0)
+                        __atomic_add_fetch(n_failedp, n_batch, __ATOMIC_RELAXED);
+                else
+                        __atomic_add_fetch(n_sentp, n_batch, __ATOMIC_RELAXED);
+        }
+}
+
+static void bench_step(Bench *bench, Shared *shared, uint64_t *latencies, uint64_t rate, unsigned int n_batch) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        B1Peer *srcs[N_SENDERS];
+        B1Handle *handles[N_SENDERS];
+        pid_t pids[N_SENDERS];
+        uint64_t n_received = 0, n_latencies = 0, n_sent, n_failed, backlog, max_backlog = 0, idle_since = 0;
+        unsigned int n_running = N_SENDERS;
+        struct pollfd pfd;
+        char name[128];
+        int r, status;
+
+        memset(shared, 0, sizeof(*shared));
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node);
+        assert(r >= 0);
+
+        for (unsigned int i = 0; i < N_SENDERS; i++) {
+                r = b1_peer_new(&srcs[i]);
+                assert(r >= 0);
+
+                r = b1_handle_transfer(b1_node_get_handle(node), srcs[i], &handles[i]);
+                assert(r >= 0);
+        }
+
+        bench_start(bench);
+
+        for (unsigned int i = 0; i < N_SENDERS; i++) {
+                pids[i] = fork();
+                assert(pids[i] >= 0);
+                if (pids[i] == 0) {
+                        sender(srcs[i], handles[i], rate, n_batch, &shared->n_sent[i], &shared->n_failed[i]);
+                        _exit(0);
+                }
+        }
+
+        pfd.fd = b1_peer_get_fd(dst);
+        pfd.events = POLLIN;
+
+        /* receive until all senders are done and the queue stayed empty for a while */
+        for (;;) {
+                B1Message *message;
+                struct iovec *vecs;
+                size_t n_vecs;
+
+                r = b1_peer_recv(dst, &message);
+                if (r == -EAGAIN) {
+                        while (n_running && waitpid(-1, &status, WNOHANG) > 0)
+                                --n_running;
+
+                        if (!n_running) {
+                                if (!idle_since)
+                                        idle_since = now_ns();
+                                else if (now_ns() - idle_since > 50 * 1000 * 1000)
+                                        break;
+                        }
+
+                        poll(&pfd, 1, 10);
+                        continue;
+                } else if (r == -ENOBUFS) {
+                        continue;
+                }
+                assert(r >= 0);
+
+                idle_since = 0;
+
+                r = b1_message_get_payload(message, &vecs, &n_vecs);
+                assert(r >= 0 && n_vecs == 1 && vecs->iov_len == N_BYTES);
+
+                if (n_latencies < N_LATENCIES_MAX)
+                        latencies[n_latencies++] = now_ns() - *(uint64_t *)vecs->iov_base;
+
+                b1_message_unref(message);
+                ++n_received;
+
+                n_sent = 0;
+                for (unsigned int i = 0; i < N_SENDERS; i++)
+                        n_sent += __atomic_load_n(&shared->n_sent[i], __ATOMIC_RELAXED);
+
+                backlog = n_sent - c_min(n_sent, n_received + b1_peer_get_n_dropped(dst));
+                max_backlog = c_max(max_backlog, backlog);
+        }
+
+        bench_stop(bench);
+
+        n_sent = n_failed = 0;
+        for (unsigned int i = 0; i < N_SENDERS; i++) {
+                n_sent += shared->n_sent[i];
+                n_failed += shared->n_failed[i];
+        }
+
+        qsort(latencies, n_latencies, sizeof(*latencies), compare_u64);
+
+        if (rate)
+                snprintf(name, sizeof(name), "overload, batch %u, offered %" PRIu64 " msgs/s", n_batch, rate);
+        else
+                snprintf(name, sizeof(name), "overload, batch %u, offered unbounded", n_batch);
+
+        bench_report(bench, name, c_max(n_received, 1ULL));
+
+        printf("    throughput %.0f msgs/s, latency p50 %" PRIu64 " ns, p99 %" PRIu64 " ns, p99.9 %" PRIu64 " ns, "
+               "peak pool %" PRIu64 " bytes, sent %" PRIu64 ", received %" PRIu64 ", dropped %" PRIu64 ", failed %" PRIu64 "\n",
+               n_received * 1e9 / STEP_NS,
+               n_latencies ? latencies[n_latencies / 2] : 0,
+               n_latencies ? latencies[n_latencies * 99 / 100] : 0,
+               n_latencies ? latencies[n_latencies * 999 / 1000] : 0,
+               max_backlog * c_align_to(N_BYTES, 8),
+               n_sent, n_received, b1_peer_get_n_dropped(dst), n_failed);
+
+        for (unsigned int i = 0; i < N_SENDERS; i++) {
+                b1_handle_unref(handles[i]);
+                b1_peer_unref(srcs[i]);
+        }
+}
+
+int main(int argc, char **argv) {
+        static const uint64_t rates[] = { 10000, 50000, 100000, 200000, 500000, 1000000, 0 };
+        static const unsigned int batches[] = { 1, N_BATCH_MAX };
+        uint64_t *latencies;
+        Shared *shared;
+        Bench bench;
+
+        if (access("/dev/bus1", F_OK) < 0 && errno == ENOENT)
+                return 77;
+
+        shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        assert(shared != MAP_FAILED);
+
+        latencies = calloc(N_LATENCIES_MAX, sizeof(*latencies));
+        assert(latencies);
+
+        bench_init(&bench);
+
+        for (size_t i = 0; i < C_ARRAY_SIZE(batches); i++)
+                for (size_t j = 0; j < C_ARRAY_SIZE(rates); j++)
+                        bench_step(&bench, shared, latencies, rates[j], batches[i]);
+
+        bench_deinit(&bench);
+
+        free(latencies);
+        munmap(shared, sizeof(*shared));
+
+        return 0;
+}
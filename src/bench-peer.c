@@ -0,0 +1,322 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+/*
+ * Peer Benchmarks
+ * Measures the cost of library features on top of a plain send/recv
+ * round-trip through the kernel.
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <c-macro.h>
+#include <errno.h>
+#include <linux/bus1.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "bench.h"
+#include "org.bus1/b1-peer.h"
+
+#define N_ITERATIONS (100000)
+#define N_NODES (100000)
+#define N_COMPONENTS (8)
+
+static int hook_noop(B1Message *message, B1Handle **destinations, size_t n_destinations, void *userdata) {
+        ++*(uint64_t *)userdata;
+
+        return 0;
+}
+
+static void bench_round_trip(Bench *bench, B1Peer *src, B1Peer *dst, B1Handle *handle) {
+        uint64_t payload = 0;
+        struct iovec vec = {
+                .iov_base = &payload,
+                .iov_len = sizeof(payload),
+        };
+        int r;
+
+        bench_start(bench);
+
+        for (unsigned int i = 0; i < N_ITERATIONS; i++) {
+                _c_cleanup_(b1_message_unrefp) B1Message *message = NULL, *reply = NULL;
+
+                r = b1_message_new(src, &message);
+                assert(r >= 0);
+
+                r = b1_message_set_payload(message, &vec, 1);
+                assert(r >= 0);
+
+                r = b1_message_send(message, &handle, 1);
+                assert(r >= 0);
+
+                r = b1_peer_recv(dst, &reply);
+                assert(r >= 0);
+        }
+
+        bench_stop(bench);
+}
+
+static void bench_hooks(Bench *bench) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL;
+        uint64_t n_calls = 0;
+        char name[64];
+        int r;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
+        assert(r >= 0);
+
+        /* warm up the pools and caches */
+        bench_round_trip(bench, src, dst, handle);
+
+        for (unsigned int n_hooks = 0; n_hooks <= 4; n_hooks++) {
+                if (n_hooks) {
+                        r = b1_peer_add_hook(src, B1_HOOK_SEND, hook_noop, &n_calls);
+                        assert(r >= 0);
+
+                        r = b1_peer_add_hook(dst, B1_HOOK_RECV, hook_noop, &n_calls);
+                        assert(r >= 0);
+                }
+
+                n_calls = 0;
+                bench_round_trip(bench, src, dst, handle);
+                assert(n_calls == 2ULL * n_hooks * N_ITERATIONS);
+
+                snprintf(name, sizeof(name), "round-trip, %u send + %u recv hooks", n_hooks, n_hooks);
+                bench_report(bench, name, N_ITERATIONS);
+        }
+}
+
+static int handler_noop(B1Node *node, B1Message *message, void *userdata) {
+        return 0;
+}
+
+static void bench_dispatch_round_trip(Bench *bench, B1Peer *src, B1Peer *dst, B1Handle *handle) {
+        int r;
+
+        bench_start(bench);
+
+        for (unsigned int i = 0; i < N_ITERATIONS; i++) {
+                _c_cleanup_(b1_message_unrefp) B1Message *message = NULL, *unhandled = NULL;
+
+                r = b1_message_new(src, &message);
+                assert(r >= 0);
+
+                r = b1_message_send(message, &handle, 1);
+                assert(r >= 0);
+
+                r = b1_peer_dispatch(dst, &unhandled);
+                assert(r >= 0 && !unhandled);
+        }
+
+        bench_stop(bench);
+}
+
+static void bench_dispatch(Bench *bench) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL;
+        int r;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
+        assert(r >= 0);
+
+        r = b1_node_set_handler(node, handler_noop, NULL);
+        assert(r >= 0);
+
+        bench_dispatch_round_trip(bench, src, dst, handle);
+        bench_report(bench, "round-trip via dispatch", N_ITERATIONS);
+
+        r = b1_peer_set_profiling(dst, true);
+        assert(r >= 0);
+
+        bench_dispatch_round_trip(bench, src, dst, handle);
+        bench_report(bench, "round-trip via dispatch, profiled", N_ITERATIONS);
+}
+
+static int handler_count(B1Node *node, B1Message *message, void *userdata) {
+        __atomic_add_fetch((uint64_t *)userdata, 1, __ATOMIC_RELEASE);
+
+        return 0;
+}
+
+static void bench_context_peers(Bench *bench, unsigned int n_threads) {
+        _c_cleanup_(b1_context_freep) B1Context *context = NULL;
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        B1Peer *dsts[N_COMPONENTS];
+        B1Node *nodes[N_COMPONENTS];
+        B1Handle *handles[N_COMPONENTS];
+        uint64_t n_handled = 0;
+        char name[64];
+        int r;
+
+        r = b1_context_new(&context, n_threads);
+        assert(r >= 0);
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        for (unsigned int i = 0; i < N_COMPONENTS; i++) {
+                r = b1_peer_new(&dsts[i]);
+                assert(r >= 0);
+
+                r = b1_node_new(dsts[i], &nodes[i]);
+                assert(r >= 0);
+
+                r = b1_handle_transfer(b1_node_get_handle(nodes[i]), src, &handles[i]);
+                assert(r >= 0);
+
+                r = b1_node_set_handler(nodes[i], handler_count, &n_handled);
+                assert(r >= 0);
+
+                r = b1_context_add_peer(context, dsts[i], NULL, NULL);
+                assert(r >= 0);
+        }
+
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        bench_start(bench);
+
+        for (unsigned int i = 0; i < N_ITERATIONS; i++) {
+                r = b1_message_send(message, &handles[i % N_COMPONENTS], 1);
+                assert(r >= 0);
+        }
+
+        while (__atomic_load_n(&n_handled, __ATOMIC_ACQUIRE) < N_ITERATIONS)
+                usleep(100);
+
+        bench_stop(bench);
+
+        snprintf(name, sizeof(name), "dispatch via context, %u peers, %u threads", N_COMPONENTS, n_threads);
+        bench_report(bench, name, N_ITERATIONS);
+
+        for (unsigned int i = 0; i < N_COMPONENTS; i++) {
+                r = b1_context_remove_peer(context, dsts[i]);
+                assert(r >= 0);
+
+                b1_handle_unref(handles[i]);
+                b1_node_free(nodes[i]);
+                b1_peer_unref(dsts[i]);
+        }
+}
+
+static void bench_context(Bench *bench) {
+        bench_context_peers(bench, 1);
+        bench_context_peers(bench, 2);
+        bench_context_peers(bench, N_COMPONENTS);
+}
+
+static int notify_noop(B1Peer *peer, unsigned int type, B1Node *node, B1Handle *handle, void *userdata) {
+        ++*(uint64_t *)userdata;
+
+        return 0;
+}
+
+static void bench_notify_storm(Bench *bench, bool callback) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+        B1Handle **handles;
+        B1Node **nodes;
+        B1Message *message;
+        uint64_t n = 0;
+        int r;
+
+        nodes = calloc(N_NODES, sizeof(*nodes));
+        handles = calloc(N_NODES, sizeof(*handles));
+        assert(nodes && handles);
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        for (unsigned int i = 0; i < N_NODES; i++) {
+                r = b1_node_new(dst, &nodes[i]);
+                assert(r >= 0);
+
+                r = b1_handle_transfer(b1_node_get_handle(nodes[i]), src, &handles[i]);
+                assert(r >= 0);
+        }
+
+        if (callback) {
+                r = b1_peer_set_notify_fn(src, notify_noop, &n);
+                assert(r >= 0);
+        }
+
+        /* queue one destruction notification per node on @src */
+        r = b1_peer_shutdown(dst);
+        assert(r >= 0);
+
+        bench_start(bench);
+
+        while ((r = b1_peer_recv(src, &message)) >= 0) {
+                ++n;
+                b1_message_unref(message);
+        }
+        assert(r == -EAGAIN);
+
+        bench_stop(bench);
+        assert(n == N_NODES);
+
+        for (unsigned int i = 0; i < N_NODES; i++) {
+                b1_handle_unref(handles[i]);
+                b1_node_free(nodes[i]);
+        }
+
+        free(handles);
+        free(nodes);
+}
+
+static void bench_notify(Bench *bench) {
+        bench_notify_storm(bench, false);
+        bench_report(bench, "notification storm, as messages", N_NODES);
+
+        bench_notify_storm(bench, true);
+        bench_report(bench, "notification storm, via callback", N_NODES);
+}
+
+int main(int argc, char **argv) {
+        Bench bench;
+
+        if (access("/dev/bus1", F_OK) < 0 && errno == ENOENT)
+                return 77;
+
+        bench_init(&bench);
+
+        bench_hooks(&bench);
+        bench_dispatch(&bench);
+        bench_notify(&bench);
+        bench_context(&bench);
+
+        bench_deinit(&bench);
+
+        return 0;
+}
@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+/*
+ * Benchmark Harness
+ * Measures wall-clock time and, where the kernel allows it, hardware and
+ * software counters of the calling thread via perf_event_open(2), and reports
+ * both per operation. Counters that cannot be opened (missing PMU, or a
+ * restrictive perf_event_paranoid setting) are silently skipped, so the
+ * harness works anywhere. Kernel-side events are counted too if permitted,
+ * as most of the work of a bus1 operation happens in the kernel.
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "bench.h"
+
+static const struct {
+        const char *name;
+        uint32_t type;
+        uint64_t config;
+} bench_counters[_BENCH_COUNTER_N] = {
+        [BENCH_COUNTER_CYCLES]           = { "cycles",           PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+        [BENCH_COUNTER_INSTRUCTIONS]     = { "instructions",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+        [BENCH_COUNTER_CACHE_MISSES]     = { "cache-misses",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+        [BENCH_COUNTER_BRANCH_MISSES]    = { "branch-misses",    PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+        [BENCH_COUNTER_CONTEXT_SWITCHES] = { "context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+};
+
+static uint64_t bench_now_ns(void) {
+        struct timespec ts;
+
+        assert(clock_gettime(CLOCK_MONOTONIC, &ts) >= 0);
+
+        return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static int bench_open_counter(unsigned int counter) {
+        struct perf_event_attr attr = {
+                .size = sizeof(attr),
+                .type = bench_counters[counter].type,
+                .config = bench_counters[counter].config,
+                .disabled = 1,
+                .exclude_hv = 1,
+                .read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                               PERF_FORMAT_TOTAL_TIME_RUNNING,
+        };
+        int fd;
+
+        fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (fd < 0 && (errno == EACCES || errno == EPERM)) {
+                /* unprivileged, retry with user-space only */
+                attr.exclude_kernel = 1;
+                fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        }
+
+        return fd < 0 ? -1 : fd;
+}
+
+void bench_init(Bench *bench) {
+        memset(bench, 0, sizeof(*bench));
+
+        for (unsigned int i = 0; i < _BENCH_COUNTER_N; i++)
+                bench->fds[i] = bench_open_counter(i);
+}
+
+void bench_deinit(Bench *bench) {
+        for (unsigned int i = 0; i < _BENCH_COUNTER_N; i++) {
+                if (bench->fds[i] >= 0)
+                        close(bench->fds[i]);
+                bench->fds[i] = -1;
+        }
+}
+
+void bench_start(Bench *bench) {
+        for (unsigned int i = 0; i < _BENCH_COUNTER_N; i++) {
+                if (bench->fds[i] < 0)
+                        continue;
+
+                assert(ioctl(bench->fds[i], PERF_EVENT_IOC_RESET, 0) >= 0);
+                assert(ioctl(bench->fds[i], PERF_EVENT_IOC_ENABLE, 0) >= 0);
+        }
+
+        bench->ts = bench_now_ns();
+}
+
+void bench_stop(Bench *bench) {
+        bench->ns = bench_now_ns() - bench->ts;
+
+        for (unsigned int i = 0; i < _BENCH_COUNTER_N; i++) {
+                uint64_t data[3];
+
+                bench->values[i] = 0;
+
+                if (bench->fds[i] < 0)
+                        continue;
+
+                assert(ioctl(bench->fds[i], PERF_EVENT_IOC_DISABLE, 0) >= 0);
+                assert(read(bench->fds[i], data, sizeof(data)) == sizeof(data));
+
+                /* scale up, in case the counter was multiplexed */
+                if (data[2] && data[2] < data[1])
+                        data[0] = (uint64_t)((double)data[0] * data[1] / data[2]);
+
+                bench->values[i] = data[0];
+        }
+}
+
+void bench_report(Bench *bench, const char *name, uint64_t n_ops) {
+        assert(n_ops);
+
+        printf("%s: %" PRIu64 " ns/op, %.0f ops/s",
+               name, bench->ns / n_ops, bench->ns ? n_ops * 1e9 / bench->ns : 0.0);
+
+        for (unsigned int i = 0; i < _BENCH_COUNTER_N; i++)
+                if (bench->fds[i] >= 0)
+                        printf(", %.2f %s/op", (double)bench->values[i] / n_ops, bench_counters[i].name);
+
+        if (bench->fds[BENCH_COUNTER_CYCLES] >= 0 &&
+            bench->fds[BENCH_COUNTER_INSTRUCTIONS] >= 0 &&
+            bench->values[BENCH_COUNTER_CYCLES])
+                printf(", %.2f IPC", (double)bench->values[BENCH_COUNTER_INSTRUCTIONS] /
+                                     bench->values[BENCH_COUNTER_CYCLES]);
+
+        printf("\n");
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum {
+        BENCH_COUNTER_CYCLES,
+        BENCH_COUNTER_INSTRUCTIONS,
+        BENCH_COUNTER_CACHE_MISSES,
+        BENCH_COUNTER_BRANCH_MISSES,
+        BENCH_COUNTER_CONTEXT_SWITCHES,
+        _BENCH_COUNTER_N,
+};
+
+typedef struct Bench Bench;
+
+struct Bench {
+        int fds[_BENCH_COUNTER_N]; /* -1 if not available */
+        uint64_t values[_BENCH_COUNTER_N];
+        uint64_t ts;
+        uint64_t ns;
+};
+
+void bench_init(Bench *bench);
+void bench_deinit(Bench *bench);
+void bench_start(Bench *bench);
+void bench_stop(Bench *bench);
+void bench_report(Bench *bench, const char *name, uint64_t n_ops);
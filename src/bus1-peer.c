@@ -155,9 +155,12 @@ _public_ int bus1_peer_mmap(struct bus1_peer *peer)
 	return 0;
 }
 
-_public_ int bus1_peer_reset(struct bus1_peer *peer)
+_public_ int bus1_peer_reset(struct bus1_peer *peer, uint64_t flags)
 {
-	return bus1_peer_ioctl(peer, BUS1_CMD_PEER_RESET, NULL);
+	static_assert(_IOC_SIZE(BUS1_CMD_PEER_RESET) == sizeof(flags),
+		      "ioctl is called with invalid argument size");
+
+	return bus1_peer_ioctl(peer, BUS1_CMD_PEER_RESET, &flags);
 }
 
 _public_ int bus1_peer_handle_transfer(struct bus1_peer *src,
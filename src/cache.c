@@ -0,0 +1,312 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+/*
+ * Handle Caches
+ *
+ * A handle cache maps caller-chosen keys (e.g., client ids) to handles, and
+ * keeps at most a fixed number of them. Once the bound is exceeded, the least
+ * recently used entries are dropped in a batch, which releases the kernel
+ * reference of each handle not otherwise referenced by the caller. The batch
+ * leaves some headroom below the bound, so a busy cache does not evict on
+ * every insertion.
+ *
+ * On a miss, the refill callback is asked to provide the handle again, for
+ * instance by asking the owner of the node to send it once more. Without a
+ * callback, misses simply fail with -ENOENT.
+ */
+
+#include <assert.h>
+#include <c-macro.h>
+#include <c-rbtree.h>
+#include <errno.h>
+#include "cache.h"
+#include "peer.h"
+#include <stdlib.h>
+
+static int entries_compare(CRBTree *t, void *k, CRBNode *n) {
+        B1HandleCacheEntry *entry = c_container_of(n, B1HandleCacheEntry, rb);
+        uint64_t key = *(uint64_t *)k;
+
+        if (key < entry->key)
+                return -1;
+        else if (key > entry->key)
+                return 1;
+        else
+                return 0;
+}
+
+static void b1_handle_cache_unlink(B1HandleCache *cache, B1HandleCacheEntry *entry) {
+        if (entry->lru_prev)
+                entry->lru_prev->lru_next = entry->lru_next;
+        else
+                cache->lru_first = entry->lru_next;
+
+        if (entry->lru_next)
+                entry->lru_next->lru_prev = entry->lru_prev;
+        else
+                cache->lru_last = entry->lru_prev;
+
+        entry->lru_prev = NULL;
+        entry->lru_next = NULL;
+}
+
+static void b1_handle_cache_link(B1HandleCache *cache, B1HandleCacheEntry *entry) {
+        entry->lru_prev = NULL;
+        entry->lru_next = cache->lru_first;
+
+        if (cache->lru_first)
+                cache->lru_first->lru_prev = entry;
+        else
+                cache->lru_last = entry;
+
+        cache->lru_first = entry;
+}
+
+static void b1_handle_cache_drop(B1HandleCache *cache, B1HandleCacheEntry *entry) {
+        b1_handle_cache_unlink(cache, entry);
+        c_rbtree_remove_init(&cache->entries, &entry->rb);
+        --cache->n_entries;
+
+        b1_handle_unref(entry->handle);
+        b1_peer_uncharge(cache->peer, B1_PEER_LIMIT_BUFFERS, sizeof(*entry));
+        free(entry);
+}
+
+static void b1_handle_cache_evict(B1HandleCache *cache) {
+        size_t target;
+
+        if (cache->n_entries <= cache->max)
+                return;
+
+        /* evict an eighth of the cache at once */
+        target = cache->max - cache->max / 8;
+
+        while (cache->n_entries > target) {
+                b1_handle_cache_drop(cache, cache->lru_last);
+                ++cache->n_evicted;
+        }
+}
+
+static int b1_handle_cache_insert(B1HandleCache *cache, uint64_t key, B1Handle *handle) {
+        B1HandleCacheEntry *entry;
+        CRBNode **slot, *p;
+        int r;
+
+        slot = c_rbtree_find_slot(&cache->entries, entries_compare, &key, &p);
+        if (!slot) {
+                B1Handle *old;
+
+                entry = c_container_of(p, B1HandleCacheEntry, rb);
+
+                /* @handle may only be kept alive by the entry it replaces */
+                old = entry->handle;
+                entry->handle = b1_handle_ref(handle);
+                b1_handle_unref(old);
+
+                b1_handle_cache_unlink(cache, entry);
+                b1_handle_cache_link(cache, entry);
+
+                return 0;
+        }
+
+        r = b1_peer_charge(cache->peer, B1_PEER_LIMIT_BUFFERS, sizeof(*entry));
+        if (r < 0)
+                return r;
+
+        entry = calloc(1, sizeof(*entry));
+        if (!entry) {
+                b1_peer_uncharge(cache->peer, B1_PEER_LIMIT_BUFFERS, sizeof(*entry));
+                return -ENOMEM;
+        }
+
+        entry->key = key;
+        entry->handle = b1_handle_ref(handle);
+
+        c_rbtree_add(&cache->entries, p, slot, &entry->rb);
+        b1_handle_cache_link(cache, entry);
+        ++cache->n_entries;
+
+        b1_handle_cache_evict(cache);
+
+        return 0;
+}
+
+/**
+ * b1_handle_cache_new() - create a new handle cache
+ * @peer:               the peer holding the cached handles
+ * @cachep:             pointer to the new cache
+ * @max:                maximum number of cached handles
+ * @refill_fn:          callback to re-acquire a handle on a miss, or NULL
+ * @userdata:           userdata passed to @refill_fn
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_handle_cache_new(B1Peer *peer,
+                                   B1HandleCache **cachep,
+                                   size_t max,
+                                   B1HandleCacheFn refill_fn,
+                                   void *userdata) {
+        B1HandleCache *cache;
+
+        if (!max)
+                return -EINVAL;
+
+        cache = calloc(1, sizeof(*cache));
+        if (!cache)
+                return -ENOMEM;
+
+        cache->peer = b1_peer_ref(peer);
+        cache->max = max;
+        cache->refill_fn = refill_fn;
+        cache->userdata = userdata;
+
+        *cachep = cache;
+        return 0;
+}
+
+/**
+ * b1_handle_cache_free() - destroy a handle cache
+ * @cache:              the cache to destroy, or NULL
+ *
+ * This drops the references of the cache to all its handles. Handles still
+ * referenced by the caller remain valid.
+ *
+ * Return: NULL is returned.
+ */
+_c_public_ B1HandleCache *b1_handle_cache_free(B1HandleCache *cache) {
+        if (!cache)
+                return NULL;
+
+        while (cache->lru_first)
+                b1_handle_cache_drop(cache, cache->lru_first);
+
+        b1_peer_unref(cache->peer);
+        free(cache);
+
+        return NULL;
+}
+
+/**
+ * b1_handle_cache_put() - add a handle to a cache
+ * @cache:              the cache
+ * @key:                the key to store @handle under
+ * @handle:             the handle to cache
+ *
+ * This stores a reference to @handle under @key, replacing any handle
+ * previously stored under it, and marks it as most recently used. If the cache
+ * exceeds its bound, the least recently used entries are evicted.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_handle_cache_put(B1HandleCache *cache, uint64_t key, B1Handle *handle) {
+        assert(b1_handle_get_peer(handle) == cache->peer);
+
+        return b1_handle_cache_insert(cache, key, handle);
+}
+
+/**
+ * b1_handle_cache_get() - look up a handle in a cache
+ * @cache:              the cache
+ * @key:                the key to look up
+ * @handlep:            pointer to the returned handle
+ *
+ * This looks up the handle stored under @key and marks it as most recently
+ * used. If there is none, the refill callback is invoked to provide it, and
+ * the result is cached. The callback must return a new reference to the
+ * handle, which is owned by the caller of this function afterwards.
+ *
+ * Return: 0 on success, -ENOENT if @key is not cached and could not be
+ *         refilled, or a negative error code on failure.
+ */
+_c_public_ int b1_handle_cache_get(B1HandleCache *cache, uint64_t key, B1Handle **handlep) {
+        B1HandleCacheEntry *entry;
+        B1Handle *handle;
+        CRBNode *n;
+        int r;
+
+        n = c_rbtree_find_node(&cache->entries, entries_compare, &key);
+        if (_c_likely_(n)) {
+                entry = c_container_of(n, B1HandleCacheEntry, rb);
+
+                if (entry != cache->lru_first) {
+                        b1_handle_cache_unlink(cache, entry);
+                        b1_handle_cache_link(cache, entry);
+                }
+
+                ++cache->n_hits;
+                *handlep = b1_handle_ref(entry->handle);
+                return 0;
+        }
+
+        ++cache->n_misses;
+
+        if (!cache->refill_fn)
+                return -ENOENT;
+
+        handle = NULL;
+        r = cache->refill_fn(cache, key, &handle, cache->userdata);
+        if (r < 0)
+                return r;
+        if (!handle)
+                return -ENOENT;
+
+        assert(b1_handle_get_peer(handle) == cache->peer);
+
+        r = b1_handle_cache_insert(cache, key, handle);
+        if (r < 0) {
+                b1_handle_unref(handle);
+                return r;
+        }
+
+        *handlep = handle;
+        return 0;
+}
+
+/**
+ * b1_handle_cache_remove() - remove a handle from a cache
+ * @cache:              the cache
+ * @key:                the key to remove
+ *
+ * Return: 0 on success, or -ENOENT if @key is not cached.
+ */
+_c_public_ int b1_handle_cache_remove(B1HandleCache *cache, uint64_t key) {
+        CRBNode *n;
+
+        n = c_rbtree_find_node(&cache->entries, entries_compare, &key);
+        if (!n)
+                return -ENOENT;
+
+        b1_handle_cache_drop(cache, c_container_of(n, B1HandleCacheEntry, rb));
+
+        return 0;
+}
+
+/**
+ * b1_handle_cache_get_stats() - query the statistics of a cache
+ * @cache:              the cache
+ * @n_entriesp:         pointer to the number of cached handles, or NULL
+ * @n_hitsp:            pointer to the number of hits, or NULL
+ * @n_missesp:          pointer to the number of misses, or NULL
+ * @n_evictedp:         pointer to the number of evicted handles, or NULL
+ */
+_c_public_ void b1_handle_cache_get_stats(B1HandleCache *cache,
+                                          size_t *n_entriesp,
+                                          uint64_t *n_hitsp,
+                                          uint64_t *n_missesp,
+                                          uint64_t *n_evictedp) {
+        if (n_entriesp)
+                *n_entriesp = cache->n_entries;
+        if (n_hitsp)
+                *n_hitsp = cache->n_hits;
+        if (n_missesp)
+                *n_missesp = cache->n_misses;
+        if (n_evictedp)
+                *n_evictedp = cache->n_evicted;
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <c-rbtree.h>
+#include "org.bus1/b1-peer.h"
+
+typedef struct B1HandleCacheEntry B1HandleCacheEntry;
+
+struct B1HandleCacheEntry {
+        uint64_t key;
+        B1Handle *handle; /* the cache owns a reference */
+        CRBNode rb;
+
+        /* LRU list, most recently used first */
+        B1HandleCacheEntry *lru_prev;
+        B1HandleCacheEntry *lru_next;
+};
+
+struct B1HandleCache {
+        B1Peer *peer;
+        size_t max;
+
+        CRBTree entries; /* keyed by the caller-provided key */
+        size_t n_entries;
+        B1HandleCacheEntry *lru_first;
+        B1HandleCacheEntry *lru_last;
+
+        B1HandleCacheFn refill_fn;
+        void *userdata;
+
+        uint64_t n_hits;
+        uint64_t n_misses;
+        uint64_t n_evicted;
+};
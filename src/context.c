@@ -0,0 +1,583 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+/*
+ * Contexts
+ *
+ * A context lets independent components of a process share one epoll set, one
+ * timer source and one pool of threads, rather than each running an event
+ * thread of its own. Peers attached to a context are dispatched by whichever
+ * context thread is idle, and timers are multiplexed over a single timerfd.
+ *
+ * Peers are registered with EPOLLONESHOT, so at most one thread dispatches a
+ * given peer at any time, and the peer is re-armed once it was drained. The
+ * same goes for the timerfd, so timer callbacks run one at a time. Epoll keys
+ * of peers carry a generation next to the slot index, so events still queued
+ * for a removed peer are ignored rather than resolved to its successor.
+ */
+
+#include <assert.h>
+#include <c-macro.h>
+#include <c-rbtree.h>
+#include <errno.h>
+#include "context.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define B1_CONTEXT_KEY_STOP ((uint64_t)-1)
+#define B1_CONTEXT_KEY_TIMER ((uint64_t)-2)
+
+/* consecutive dispatch failures after which a peer waits for its next wakeup */
+#define B1_CONTEXT_N_FAILED_MAX (8)
+
+static uint64_t b1_context_now(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int timers_compare(CRBTree *t, void *k, CRBNode *n) {
+        B1Timer *key = k, *timer = c_container_of(n, B1Timer, rb);
+
+        if (key->deadline_ns < timer->deadline_ns)
+                return -1;
+        else if (key->deadline_ns > timer->deadline_ns)
+                return 1;
+        else if (key < timer)
+                return -1;
+        else if (key > timer)
+                return 1;
+        else
+                return 0;
+}
+
+static bool b1_context_is_own_thread(B1Context *context) {
+        for (size_t i = 0; i < context->n_threads; i++)
+                if (pthread_equal(context->threads[i], pthread_self()))
+                        return true;
+
+        return false;
+}
+
+static void b1_context_clear_peer(B1ContextPeer *slot) {
+        slot->peer = b1_peer_unref(slot->peer);
+        slot->fn = NULL;
+        slot->userdata = NULL;
+        slot->removed = false;
+        ++slot->generation;
+}
+
+static void b1_context_run_peer(B1Context *context, uint64_t key) {
+        struct epoll_event event = {
+                .events = EPOLLIN | EPOLLONESHOT,
+                .data.u64 = key,
+        };
+        size_t i = (uint32_t)key;
+        unsigned int n_failed = 0;
+        B1ContextPeer *slot;
+        B1Message *message;
+        B1ContextFn fn;
+        B1Peer *peer;
+        void *userdata;
+        int r;
+
+        pthread_mutex_lock(&context->lock);
+
+        if (i >= context->n_peers ||
+            !context->peers[i].peer ||
+            context->peers[i].generation != key >> 32) {
+                pthread_mutex_unlock(&context->lock);
+                return;
+        }
+
+        slot = &context->peers[i];
+        slot->busy = true;
+        peer = slot->peer;
+        fn = slot->fn;
+        userdata = slot->userdata;
+
+        pthread_mutex_unlock(&context->lock);
+
+        /*
+         * Drain the peer, as messages may be queued in the library while its
+         * fd is no longer readable. Failures are returned by the handlers as
+         * well, so only a run of them makes the peer wait for its next wakeup.
+         */
+        do {
+                message = NULL;
+
+                r = b1_peer_dispatch(peer, &message);
+                if (message) {
+                        if (fn)
+                                fn(peer, message, userdata);
+                        b1_message_unref(message);
+                }
+
+                n_failed = r < 0 ? n_failed + 1 : 0;
+        } while (r != -EAGAIN && n_failed < B1_CONTEXT_N_FAILED_MAX);
+
+        pthread_mutex_lock(&context->lock);
+
+        /* handlers may have added peers, so the slot may have moved */
+        slot = &context->peers[i];
+        slot->busy = false;
+
+        if (slot->removed)
+                b1_context_clear_peer(slot);
+        else
+                epoll_ctl(context->epoll_fd, EPOLL_CTL_MOD, b1_peer_get_fd(peer), &event);
+
+        pthread_cond_broadcast(&context->cond);
+        pthread_mutex_unlock(&context->lock);
+}
+
+static void b1_context_arm_timer_fd(B1Context *context) {
+        struct itimerspec its = {};
+        B1Timer *timer;
+        CRBNode *n;
+
+        n = c_rbtree_first(&context->timers);
+        if (n) {
+                timer = c_container_of(n, B1Timer, rb);
+                its.it_value.tv_sec = timer->deadline_ns / 1000000000ULL;
+                its.it_value.tv_nsec = timer->deadline_ns % 1000000000ULL;
+        }
+
+        timerfd_settime(context->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void b1_context_run_timers(B1Context *context) {
+        struct epoll_event event = {
+                .events = EPOLLIN | EPOLLONESHOT,
+                .data.u64 = B1_CONTEXT_KEY_TIMER,
+        };
+        uint64_t n_expirations;
+        B1Timer *timer;
+        CRBNode *n;
+        ssize_t l;
+
+        l = read(context->timer_fd, &n_expirations, sizeof(n_expirations));
+        (void)l;
+
+        pthread_mutex_lock(&context->lock);
+
+        while ((n = c_rbtree_first(&context->timers))) {
+                timer = c_container_of(n, B1Timer, rb);
+                if (timer->deadline_ns > b1_context_now())
+                        break;
+
+                c_rbtree_remove_init(&context->timers, &timer->rb);
+                timer->deadline_ns = 0;
+                timer->busy = true;
+
+                pthread_mutex_unlock(&context->lock);
+                timer->fn(timer, timer->userdata);
+                pthread_mutex_lock(&context->lock);
+
+                timer->busy = false;
+
+                if (timer->freed) {
+                        c_rbtree_remove_init(&context->timers, &timer->rb);
+                        --context->n_timers;
+                        free(timer);
+                } else {
+                        pthread_cond_broadcast(&context->cond);
+                }
+        }
+
+        b1_context_arm_timer_fd(context);
+        epoll_ctl(context->epoll_fd, EPOLL_CTL_MOD, context->timer_fd, &event);
+
+        pthread_mutex_unlock(&context->lock);
+}
+
+static void *b1_context_thread(void *userdata) {
+        B1Context *context = userdata;
+        struct epoll_event event;
+        sigset_t mask;
+        int n;
+
+        /* leave signals to the threads of the application, but SIGRTMIN to the watchdog */
+        sigfillset(&mask);
+        sigdelset(&mask, SIGRTMIN);
+        pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+        for (;;) {
+                /* one event at a time, so idle threads pick up the others */
+                n = epoll_wait(context->epoll_fd, &event, 1, -1);
+                if (n < 0 && errno == EINTR)
+                        continue;
+                else if (n < 0)
+                        break;
+                else if (n == 0)
+                        continue;
+
+                if (event.data.u64 == B1_CONTEXT_KEY_STOP)
+                        break;
+                else if (event.data.u64 == B1_CONTEXT_KEY_TIMER)
+                        b1_context_run_timers(context);
+                else
+                        b1_context_run_peer(context, event.data.u64);
+        }
+
+        return NULL;
+}
+
+/**
+ * b1_context_new() - create a new dispatch context
+ * @contextp:           pointer to the new context
+ * @n_threads:          the number of threads to dispatch on
+ *
+ * This creates a context with its own epoll set and timerfd, and starts
+ * @n_threads threads, which dispatch the peers attached to the context (see
+ * b1_context_add_peer()) and run its timers (see b1_timer_new()). A single
+ * context is meant to be shared by all components of a process.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_context_new(B1Context **contextp, unsigned int n_threads) {
+        _c_cleanup_(b1_context_freep) B1Context *context = NULL;
+        struct epoll_event event = {};
+        int r;
+
+        if (!n_threads)
+                return -EINVAL;
+
+        context = calloc(1, sizeof(*context));
+        if (!context)
+                return -ENOMEM;
+
+        context->epoll_fd = -1;
+        context->timer_fd = -1;
+        context->stop_fd = -1;
+        pthread_mutex_init(&context->lock, NULL);
+        pthread_cond_init(&context->cond, NULL);
+
+        context->threads = calloc(n_threads, sizeof(*context->threads));
+        if (!context->threads)
+                return -ENOMEM;
+
+        context->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (context->epoll_fd < 0)
+                return -errno;
+
+        context->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+        if (context->timer_fd < 0)
+                return -errno;
+
+        context->stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (context->stop_fd < 0)
+                return -errno;
+
+        event.events = EPOLLIN | EPOLLONESHOT;
+        event.data.u64 = B1_CONTEXT_KEY_TIMER;
+        if (epoll_ctl(context->epoll_fd, EPOLL_CTL_ADD, context->timer_fd, &event) < 0)
+                return -errno;
+
+        /* level-triggered, so it wakes up every thread */
+        event.events = EPOLLIN;
+        event.data.u64 = B1_CONTEXT_KEY_STOP;
+        if (epoll_ctl(context->epoll_fd, EPOLL_CTL_ADD, context->stop_fd, &event) < 0)
+                return -errno;
+
+        while (context->n_threads < n_threads) {
+                r = pthread_create(&context->threads[context->n_threads], NULL, b1_context_thread, context);
+                if (r)
+                        return -r;
+
+                ++context->n_threads;
+        }
+
+        *contextp = context;
+        context = NULL;
+        return 0;
+}
+
+/**
+ * b1_context_free() - destroy a context
+ * @context:            the context to destroy, or NULL
+ *
+ * This stops all threads of @context, after waiting for running handlers and
+ * timers to return, and detaches all remaining peers. All timers of @context
+ * must have been freed before. This must not be called from a context thread.
+ *
+ * Return: NULL is returned.
+ */
+_c_public_ B1Context *b1_context_free(B1Context *context) {
+        uint64_t one = 1;
+        ssize_t l;
+
+        if (!context)
+                return NULL;
+
+        if (context->n_threads) {
+                l = write(context->stop_fd, &one, sizeof(one));
+                (void)l;
+
+                for (size_t i = 0; i < context->n_threads; i++)
+                        pthread_join(context->threads[i], NULL);
+        }
+
+        assert(!context->n_timers);
+
+        for (size_t i = 0; i < context->n_peers; i++)
+                b1_peer_unref(context->peers[i].peer);
+
+        if (context->stop_fd >= 0)
+                close(context->stop_fd);
+        if (context->timer_fd >= 0)
+                close(context->timer_fd);
+        if (context->epoll_fd >= 0)
+                close(context->epoll_fd);
+
+        pthread_cond_destroy(&context->cond);
+        pthread_mutex_destroy(&context->lock);
+        free(context->threads);
+        free(context->peers);
+        free(context);
+
+        return NULL;
+}
+
+/**
+ * b1_context_add_peer() - dispatch a peer on a context
+ * @context:            the context
+ * @peer:               the peer to attach
+ * @fn:                 callback for unhandled messages, or NULL
+ * @userdata:           userdata passed to @fn
+ *
+ * From now on, messages received on @peer are passed to b1_peer_dispatch() on
+ * one of the threads of @context. Messages not consumed by a node handler are
+ * passed to @fn, and released when it returns, or dropped without @fn.
+ * Failures of node handlers are not reported, so handlers must deal with
+ * their own errors.
+ *
+ * Peers are not thread-safe, and @peer is used by the threads of @context
+ * while attached, so other threads must synchronize with its handlers before
+ * using it. The context holds a reference to @peer until it is detached.
+ *
+ * Return: 0 on success, -EEXIST if @peer is already attached, or a negative
+ *         error code on failure.
+ */
+_c_public_ int b1_context_add_peer(B1Context *context, B1Peer *peer, B1ContextFn fn, void *userdata) {
+        struct epoll_event event = {
+                .events = EPOLLIN | EPOLLONESHOT,
+        };
+        B1ContextPeer *peers, *slot = NULL;
+        size_t n;
+        int r = 0;
+
+        pthread_mutex_lock(&context->lock);
+
+        for (size_t i = 0; i < context->n_peers; i++) {
+                if (context->peers[i].peer == peer) {
+                        r = -EEXIST;
+                        goto exit;
+                } else if (!context->peers[i].peer && !slot) {
+                        slot = &context->peers[i];
+                }
+        }
+
+        if (!slot) {
+                if (context->n_peers == context->n_peers_max) {
+                        n = context->n_peers_max ? context->n_peers_max * 2 : 8;
+
+                        peers = realloc(context->peers, n * sizeof(*peers));
+                        if (!peers) {
+                                r = -ENOMEM;
+                                goto exit;
+                        }
+
+                        context->peers = peers;
+                        context->n_peers_max = n;
+                }
+
+                slot = &context->peers[context->n_peers++];
+                *slot = (B1ContextPeer){};
+        }
+
+        slot->peer = b1_peer_ref(peer);
+        slot->fn = fn;
+        slot->userdata = userdata;
+
+        event.data.u64 = (uint64_t)slot->generation << 32 | (slot - context->peers);
+        if (epoll_ctl(context->epoll_fd, EPOLL_CTL_ADD, b1_peer_get_fd(peer), &event) < 0) {
+                r = -errno;
+                b1_context_clear_peer(slot);
+        }
+
+exit:
+        pthread_mutex_unlock(&context->lock);
+        return r;
+}
+
+/**
+ * b1_context_remove_peer() - stop dispatching a peer on a context
+ * @context:            the context
+ * @peer:               the peer to detach
+ *
+ * If @peer is being dispatched by another thread, this waits for it to finish.
+ * If called on a thread of @context, for instance from any handler, this never
+ * waits, as two handlers removing each other's peer would deadlock. Instead,
+ * if @peer is being dispatched, it is detached by the dispatching thread once
+ * its handler returns, which may thus still be running when this returns.
+ *
+ * Return: 0 on success, -ENOENT if @peer is not attached, or a negative error
+ *         code on failure.
+ */
+_c_public_ int b1_context_remove_peer(B1Context *context, B1Peer *peer) {
+        B1ContextPeer *slot;
+        uint32_t generation;
+        size_t i;
+
+        pthread_mutex_lock(&context->lock);
+
+        for (i = 0; i < context->n_peers; i++)
+                if (context->peers[i].peer == peer && !context->peers[i].removed)
+                        break;
+
+        if (i == context->n_peers) {
+                pthread_mutex_unlock(&context->lock);
+                return -ENOENT;
+        }
+
+        generation = context->peers[i].generation;
+        epoll_ctl(context->epoll_fd, EPOLL_CTL_DEL, b1_peer_get_fd(peer), NULL);
+
+        for (;;) {
+                slot = &context->peers[i];
+                if (slot->generation != generation)
+                        break; /* detached by someone else meanwhile */
+
+                if (!slot->busy) {
+                        b1_context_clear_peer(slot);
+                        break;
+                } else if (b1_context_is_own_thread(context)) {
+                        slot->removed = true;
+                        break;
+                }
+
+                pthread_cond_wait(&context->cond, &context->lock);
+        }
+
+        pthread_mutex_unlock(&context->lock);
+        return 0;
+}
+
+/**
+ * b1_timer_new() - create a new timer
+ * @context:            the context to run the timer on
+ * @timerp:             pointer to the new timer
+ * @fn:                 the timer callback
+ * @userdata:           userdata passed to @fn
+ *
+ * The timer is created disarmed, see b1_timer_arm().
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_timer_new(B1Context *context, B1Timer **timerp, B1TimerFn fn, void *userdata) {
+        B1Timer *timer;
+
+        timer = calloc(1, sizeof(*timer));
+        if (!timer)
+                return -ENOMEM;
+
+        timer->context = context;
+        timer->fn = fn;
+        timer->userdata = userdata;
+        c_rbnode_init(&timer->rb);
+
+        pthread_mutex_lock(&context->lock);
+        ++context->n_timers;
+        pthread_mutex_unlock(&context->lock);
+
+        *timerp = timer;
+        return 0;
+}
+
+/**
+ * b1_timer_free() - destroy a timer
+ * @timer:              the timer to destroy, or NULL
+ *
+ * If the callback of @timer is running on another thread, this waits for it to
+ * return. If called on a thread of its context, for instance from the callback
+ * itself or any handler, this never waits. Instead, @timer is destroyed by the
+ * running thread once the callback returns.
+ *
+ * Return: NULL is returned.
+ */
+_c_public_ B1Timer *b1_timer_free(B1Timer *timer) {
+        B1Context *context;
+
+        if (!timer)
+                return NULL;
+
+        context = timer->context;
+
+        pthread_mutex_lock(&context->lock);
+
+        c_rbtree_remove_init(&context->timers, &timer->rb);
+
+        while (timer->busy && !b1_context_is_own_thread(context))
+                pthread_cond_wait(&context->cond, &context->lock);
+
+        if (timer->busy) {
+                timer->freed = true;
+        } else {
+                --context->n_timers;
+                free(timer);
+        }
+
+        pthread_mutex_unlock(&context->lock);
+
+        return NULL;
+}
+
+/**
+ * b1_timer_arm() - arm a timer
+ * @timer:              the timer
+ * @timeout_ns:         the time until the timer fires, in ns, or 0 to disarm
+ *
+ * The callback of @timer is run once on one of the threads of its context,
+ * after @timeout_ns passed on CLOCK_MONOTONIC. Any previous timeout of @timer
+ * is replaced. Periodic timers re-arm themselves from their callback.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_timer_arm(B1Timer *timer, uint64_t timeout_ns) {
+        B1Context *context = timer->context;
+        CRBNode **slot, *p;
+
+        pthread_mutex_lock(&context->lock);
+
+        c_rbtree_remove_init(&context->timers, &timer->rb);
+        timer->deadline_ns = 0;
+
+        if (timeout_ns) {
+                timer->deadline_ns = b1_context_now() + c_min(timeout_ns, UINT64_MAX / 2);
+
+                slot = c_rbtree_find_slot(&context->timers, timers_compare, timer, &p);
+                assert(slot);
+                c_rbtree_add(&context->timers, p, slot, &timer->rb);
+        }
+
+        b1_context_arm_timer_fd(context);
+
+        pthread_mutex_unlock(&context->lock);
+
+        return 0;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <c-rbtree.h>
+#include <pthread.h>
+#include "org.bus1/b1-peer.h"
+
+typedef struct B1ContextPeer B1ContextPeer;
+
+struct B1ContextPeer {
+        B1Peer *peer; /* the context owns a reference, NULL if the slot is free */
+        B1ContextFn fn;
+        void *userdata;
+        uint32_t generation; /* upper half of the epoll key, bumped on removal */
+
+        bool busy; /* being dispatched by a context thread */
+        bool removed; /* removed while busy, the dispatching thread cleans up */
+};
+
+struct B1Timer {
+        B1Context *context;
+        B1TimerFn fn;
+        void *userdata;
+
+        uint64_t deadline_ns; /* CLOCK_MONOTONIC, 0 if disarmed */
+        CRBNode rb; /* linked into the context while armed */
+
+        bool busy; /* being run by a context thread */
+        bool freed; /* freed while busy, the running thread cleans up */
+};
+
+struct B1Context {
+        int epoll_fd;
+        int timer_fd; /* armed for the first timer in @timers */
+        int stop_fd; /* eventfd, readable once all threads shall exit */
+
+        pthread_mutex_t lock; /* protects everything below */
+        pthread_cond_t cond; /* signalled whenever a peer or timer is no longer busy */
+
+        B1ContextPeer *peers; /* the epoll key of slot i is (generation << 32 | i) */
+        size_t n_peers;
+        size_t n_peers_max;
+
+        CRBTree timers; /* armed timers, by deadline */
+        size_t n_timers; /* all timers, armed or not */
+
+        pthread_t *threads;
+        size_t n_threads;
+};
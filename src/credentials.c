@@ -0,0 +1,525 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+/*
+ * Credential Cache
+ *
+ * Messages only carry the uid, gid, pid and tid of their sender. Anything
+ * else (executable, cgroup, capabilities) has to be read from /proc, which
+ * costs several syscalls. Each peer therefore caches this information per
+ * sending process, keyed by pid. An entry is only used as long as the process
+ * it was read from is still alive, which is checked with a single poll() on a
+ * pidfd, or by comparing the start time of the process if pidfds are not
+ * supported by the kernel. As a pid cannot be re-used before its process is
+ * gone, this reliably detects pid re-use.
+ *
+ * Changes of a live process are not tracked: after an execve(), a capability
+ * drop or a cgroup move, the cache keeps returning what was read before.
+ * Callers that learn about such a change drop the entry with
+ * b1_peer_invalidate_credentials(). Entries are never modified once created,
+ * so callers may keep using the strings of the credentials they hold.
+ *
+ * The cache holds at most B1_CREDENTIALS_N_MAX entries, each charged to the
+ * buffer budget of the peer. Once it is full, a miss drops the entries of
+ * exited processes, which closes their pidfds, and if there are none, the
+ * least recently used entry is evicted.
+ */
+
+#include <assert.h>
+#include <c-macro.h>
+#include <c-rbtree.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include "credentials.h"
+#include "message.h"
+#include "peer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int credentials_compare(CRBTree *t, void *k, CRBNode *n) {
+        B1Credentials *credentials = c_container_of(n, B1Credentials, rb);
+        pid_t pid = *(pid_t *)k;
+
+        if (pid < credentials->pid)
+                return -1;
+        else if (pid > credentials->pid)
+                return 1;
+        else
+                return 0;
+}
+
+static int b1_credentials_read(int dirfd, const char *name, char **contentp) {
+        char *content = NULL;
+        size_t n_content = 0, size = 0;
+        ssize_t l;
+        int fd, r = 0;
+
+        fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+                return -errno;
+
+        do {
+                if (size - n_content < 2) {
+                        char *p;
+
+                        size = size ? size * 2 : 1024;
+                        p = realloc(content, size);
+                        if (!p) {
+                                r = -ENOMEM;
+                                break;
+                        }
+
+                        content = p;
+                }
+
+                l = read(fd, content + n_content, size - n_content - 1);
+                if (l < 0) {
+                        r = -errno;
+                        break;
+                }
+
+                n_content += l;
+        } while (l > 0);
+
+        close(fd);
+        if (r < 0) {
+                free(content);
+                return r;
+        }
+
+        content[n_content] = 0;
+
+        *contentp = content;
+        return 0;
+}
+
+static int b1_credentials_read_start_time(int dirfd, uint64_t *start_timep) {
+        unsigned long long start_time;
+        char *stat;
+        const char *p;
+        int r;
+
+        r = b1_credentials_read(dirfd, "stat", &stat);
+        if (r < 0)
+                return r;
+
+        /* skip the comm field, which may contain anything but is in parentheses */
+        p = strrchr(stat, ')');
+
+        /* the start time is the 22nd field, and the field after comm the 3rd */
+        for (unsigned int i = 3; p && i <= 22; i++)
+                p = strchr(p + 1, ' ');
+
+        if (!p || sscanf(p, " %llu", &start_time) != 1)
+                r = -EIO;
+
+        free(stat);
+        if (r < 0)
+                return r;
+
+        *start_timep = start_time;
+        return 0;
+}
+
+static int b1_credentials_read_cgroup(int dirfd, char **cgroupp) {
+        char *content, *cgroup;
+        int r;
+
+        r = b1_credentials_read(dirfd, "cgroup", &content);
+        if (r < 0)
+                return r;
+
+        /* prefer the unified hierarchy, fall back to the first listed one */
+        if (!strncmp(content, "0::", 3))
+                cgroup = content + 3;
+        else if ((cgroup = strstr(content, "\n0::")))
+                cgroup += 4;
+        else if ((cgroup = strchr(content, ':')) && (cgroup = strchr(cgroup + 1, ':')))
+                ++cgroup;
+
+        if (cgroup) {
+                cgroup = strndup(cgroup, strchrnul(cgroup, '\n') - cgroup);
+                if (!cgroup)
+                        r = -ENOMEM;
+        } else {
+                r = -EIO;
+        }
+
+        free(content);
+        if (r < 0)
+                return r;
+
+        *cgroupp = cgroup;
+        return 0;
+}
+
+static int b1_credentials_read_capabilities(int dirfd, uint64_t *capabilitiesp) {
+        unsigned long long capabilities;
+        char *status;
+        const char *p;
+        int r;
+
+        r = b1_credentials_read(dirfd, "status", &status);
+        if (r < 0)
+                return r;
+
+        p = strstr(status, "\nCapEff:");
+        if (!p || sscanf(p + strlen("\nCapEff:"), " %llx", &capabilities) != 1)
+                r = -EIO;
+
+        free(status);
+        if (r < 0)
+                return r;
+
+        *capabilitiesp = capabilities;
+        return 0;
+}
+
+static int b1_credentials_read_exe(int dirfd, char **exep) {
+        char path[PATH_MAX + 1], *exe;
+        ssize_t l;
+
+        l = readlinkat(dirfd, "exe", path, sizeof(path) - 1);
+        if (l < 0)
+                return -errno;
+
+        path[l] = 0;
+
+        exe = strdup(path);
+        if (!exe)
+                return -ENOMEM;
+
+        *exep = exe;
+        return 0;
+}
+
+static int b1_credentials_read_all(int dirfd, B1Credentials *credentials) {
+        int r;
+
+        r = b1_credentials_read_start_time(dirfd, &credentials->start_time);
+        if (r < 0)
+                return r;
+
+        r = b1_credentials_read_capabilities(dirfd, &credentials->capabilities);
+        if (r < 0)
+                return r;
+
+        /* the executable and cgroup may legitimately be inaccessible */
+        r = b1_credentials_read_exe(dirfd, &credentials->exe);
+        if (r < 0 && r != -EACCES && r != -EPERM && r != -ENOENT)
+                return r;
+
+        r = b1_credentials_read_cgroup(dirfd, &credentials->cgroup);
+        if (r < 0 && r != -EACCES && r != -EPERM && r != -ENOENT)
+                return r;
+
+        return 0;
+}
+
+static void b1_credentials_free(CRef *ref, void *userdata) {
+        B1Credentials *credentials = userdata;
+
+        assert(!c_rbnode_is_linked(&credentials->rb));
+
+        if (credentials->pidfd >= 0)
+                close(credentials->pidfd);
+
+        free(credentials->cgroup);
+        free(credentials->exe);
+        free(credentials);
+}
+
+static int b1_credentials_new(B1Credentials **credentialsp, pid_t pid) {
+        _c_cleanup_(b1_credentials_unrefp) B1Credentials *credentials = NULL;
+        char path[sizeof("/proc/") + sizeof(pid_t) * 3];
+        int dirfd, r;
+
+        credentials = calloc(1, sizeof(*credentials));
+        if (!credentials)
+                return -ENOMEM;
+
+        credentials->ref = (CRef)C_REF_INIT;
+        credentials->pid = pid;
+        credentials->pidfd = -1;
+        c_rbnode_init(&credentials->rb);
+
+#ifdef SYS_pidfd_open
+        credentials->pidfd = syscall(SYS_pidfd_open, pid, 0);
+        if (credentials->pidfd < 0) {
+                /* pidfds may be unsupported, or filtered by seccomp */
+                if (errno != ENOSYS && errno != EPERM)
+                        return -errno;
+
+                credentials->pidfd = -1;
+        }
+#endif
+
+        sprintf(path, "/proc/%d", (int)pid);
+        dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dirfd < 0)
+                return errno == ENOENT ? -ESRCH : -errno;
+
+        r = b1_credentials_read_all(dirfd, credentials);
+        close(dirfd);
+        if (r < 0)
+                return r;
+
+        *credentialsp = credentials;
+        credentials = NULL;
+        return 0;
+}
+
+static bool b1_credentials_is_alive(B1Credentials *credentials) {
+        char path[sizeof("/proc/") + sizeof(pid_t) * 3];
+        uint64_t start_time;
+        int dirfd, r;
+
+        if (credentials->pidfd >= 0) {
+                struct pollfd pfd = {
+                        .fd = credentials->pidfd,
+                        .events = POLLIN,
+                };
+
+                /* a pidfd becomes readable once the process exited */
+                return poll(&pfd, 1, 0) == 0;
+        }
+
+        sprintf(path, "/proc/%d", (int)credentials->pid);
+        dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dirfd < 0)
+                return false;
+
+        r = b1_credentials_read_start_time(dirfd, &start_time);
+        close(dirfd);
+
+        return r >= 0 && start_time == credentials->start_time;
+}
+
+static void b1_credentials_unlink(B1Peer *peer, B1Credentials *credentials) {
+        c_rbtree_remove_init(&peer->credentials, &credentials->rb);
+        b1_peer_uncharge(peer, B1_PEER_LIMIT_BUFFERS, sizeof(*credentials));
+        --peer->n_credentials;
+        b1_credentials_unref(credentials);
+}
+
+static void b1_credentials_trim(B1Peer *peer) {
+        B1Credentials *credentials, *lru = NULL;
+        CRBNode *n, *next;
+
+        if (peer->n_credentials < B1_CREDENTIALS_N_MAX)
+                return;
+
+        for (n = c_rbtree_first(&peer->credentials); n; n = next) {
+                next = c_rbnode_next(n);
+                credentials = c_container_of(n, B1Credentials, rb);
+
+                if (!b1_credentials_is_alive(credentials))
+                        b1_credentials_unlink(peer, credentials);
+                else if (!lru || credentials->last_used < lru->last_used)
+                        lru = credentials;
+        }
+
+        if (lru && peer->n_credentials >= B1_CREDENTIALS_N_MAX)
+                b1_credentials_unlink(peer, lru);
+}
+
+int b1_credentials_get(B1Peer *peer, pid_t pid, B1Credentials **credentialsp) {
+        B1Credentials *credentials;
+        CRBNode **slot, *p;
+        int r;
+
+        if (pid <= 0)
+                return -ENODATA;
+
+        ++peer->credentials_clock;
+
+        p = c_rbtree_find_node(&peer->credentials, credentials_compare, &pid);
+        if (p) {
+                credentials = c_container_of(p, B1Credentials, rb);
+                if (b1_credentials_is_alive(credentials)) {
+                        credentials->last_used = peer->credentials_clock;
+                        *credentialsp = b1_credentials_ref(credentials);
+                        return 0;
+                }
+
+                b1_credentials_unlink(peer, credentials);
+        }
+
+        b1_credentials_trim(peer);
+
+        r = b1_credentials_new(&credentials, pid);
+        if (r < 0)
+                return r;
+
+        /* without budget, the credentials are returned, but not cached */
+        if (b1_peer_charge(peer, B1_PEER_LIMIT_BUFFERS, sizeof(*credentials)) < 0) {
+                *credentialsp = credentials;
+                return 0;
+        }
+
+        slot = c_rbtree_find_slot(&peer->credentials, credentials_compare, &pid, &p);
+        assert(slot);
+        c_rbtree_add(&peer->credentials, p, slot, &credentials->rb);
+        credentials->last_used = peer->credentials_clock;
+        ++peer->n_credentials;
+
+        *credentialsp = b1_credentials_ref(credentials);
+        return 0;
+}
+
+/**
+ * b1_peer_invalidate_credentials() - drop cached credentials of a process
+ * @peer:               the peer
+ * @pid:                the process, or 0 for all processes
+ *
+ * Cached credentials are only dropped once their process exits, so changes
+ * of a live process, such as an execve(), a capability drop or a cgroup move,
+ * are not noticed. This drops the cached credentials of @pid, so they are
+ * read again on the next lookup. Credentials already returned are not
+ * affected.
+ *
+ * Return: 0 on success, or -ENOENT if nothing was cached for @pid.
+ */
+_c_public_ int b1_peer_invalidate_credentials(B1Peer *peer, pid_t pid) {
+        CRBNode *n;
+
+        if (!pid) {
+                b1_credentials_flush(peer);
+                return 0;
+        }
+
+        n = c_rbtree_find_node(&peer->credentials, credentials_compare, &pid);
+        if (!n)
+                return -ENOENT;
+
+        b1_credentials_unlink(peer, c_container_of(n, B1Credentials, rb));
+        return 0;
+}
+
+void b1_credentials_flush(B1Peer *peer) {
+        CRBNode *n;
+
+        while ((n = c_rbtree_first(&peer->credentials)))
+                b1_credentials_unlink(peer, c_container_of(n, B1Credentials, rb));
+}
+
+/**
+ * b1_credentials_ref() - acquire reference
+ * @credentials:        credentials to acquire reference to, or NULL
+ *
+ * Return: @credentials is returned.
+ */
+_c_public_ B1Credentials *b1_credentials_ref(B1Credentials *credentials) {
+        if (credentials)
+                c_ref_inc(&credentials->ref);
+
+        return credentials;
+}
+
+/**
+ * b1_credentials_unref() - release reference
+ * @credentials:        credentials to release reference to, or NULL
+ *
+ * Return: NULL is returned.
+ */
+_c_public_ B1Credentials *b1_credentials_unref(B1Credentials *credentials) {
+        if (credentials)
+                c_ref_dec(&credentials->ref, b1_credentials_free, credentials);
+
+        return NULL;
+}
+
+/**
+ * b1_credentials_get_pid() - get the pid of a process
+ * @credentials:        the credentials
+ *
+ * Return: the pid.
+ */
+_c_public_ pid_t b1_credentials_get_pid(B1Credentials *credentials) {
+        return credentials->pid;
+}
+
+/**
+ * b1_credentials_get_start_time() - get the start time of a process
+ * @credentials:        the credentials
+ *
+ * Together with the pid, the start time uniquely identifies a process.
+ *
+ * Return: the start time in clock ticks since boot.
+ */
+_c_public_ uint64_t b1_credentials_get_start_time(B1Credentials *credentials) {
+        return credentials->start_time;
+}
+
+/**
+ * b1_credentials_get_exe() - get the executable of a process
+ * @credentials:        the credentials
+ *
+ * Return: the path of the executable, or NULL if not accessible.
+ */
+_c_public_ const char *b1_credentials_get_exe(B1Credentials *credentials) {
+        return credentials->exe;
+}
+
+/**
+ * b1_credentials_get_cgroup() - get the cgroup of a process
+ * @credentials:        the credentials
+ *
+ * Return: the cgroup path, or NULL if not accessible.
+ */
+_c_public_ const char *b1_credentials_get_cgroup(B1Credentials *credentials) {
+        return credentials->cgroup;
+}
+
+/**
+ * b1_credentials_get_capabilities() - get the capabilities of a process
+ * @credentials:        the credentials
+ *
+ * Return: the effective capability set, as a bitmask of CAP_* bits.
+ */
+_c_public_ uint64_t b1_credentials_get_capabilities(B1Credentials *credentials) {
+        return credentials->capabilities;
+}
+
+/**
+ * b1_message_get_credentials() - get the credentials of the sending process
+ * @message:            the received message
+ * @credentialsp:       pointer to the credentials
+ *
+ * This looks up the credentials of the process that sent @message in the
+ * credential cache of its peer, and reads them from /proc on a cache miss.
+ * The returned credentials remain owned by the message, so the caller must
+ * take a reference if they want to keep them after the message has been
+ * freed.
+ *
+ * Credentials are read lazily, so if the sending process exited before they
+ * were first queried, -ESRCH is returned, and if its pid got re-used in the
+ * meantime, the credentials of the new process are returned.
+ *
+ * Return: 0 on success, -ENODATA if the message has no sender, or a negative
+ *         error code on failure.
+ */
+_c_public_ int b1_message_get_credentials(B1Message *message, B1Credentials **credentialsp) {
+        int r;
+
+        if (!message->credentials) {
+                r = b1_credentials_get(message->peer, message->pid, &message->credentials);
+                if (r < 0)
+                        return r;
+        }
+
+        *credentialsp = message->credentials;
+        return 0;
+}
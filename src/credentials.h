@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <c-rbtree.h>
+#include <c-ref.h>
+#include "org.bus1/b1-peer.h"
+
+#define B1_CREDENTIALS_N_MAX (64) /* per peer */
+
+struct B1Credentials {
+        CRef ref;
+
+        pid_t pid;
+        uint64_t start_time; /* in clock ticks since boot */
+        int pidfd; /* -1 if pidfds are not supported */
+
+        char *exe; /* NULL if not accessible */
+        char *cgroup; /* NULL if not accessible */
+        uint64_t capabilities; /* effective capability set */
+
+        CRBNode rb; /* linked into the peer while cached */
+        uint64_t last_used; /* credentials_clock of the peer at the last hit */
+};
+
+int b1_credentials_get(B1Peer *peer, pid_t pid, B1Credentials **credentialsp);
+void b1_credentials_flush(B1Peer *peer);
@@ -16,17 +16,61 @@
 #include "peer.h"
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 #include "bus1-peer.h"
 #include "org.bus1/b1-peer.h"
 
+static int b1_buffer_new(B1Peer *peer, void **bufferp, size_t n, size_t size) {
+        void *buffer;
+        int r;
+
+        if (size && n > SIZE_MAX / size)
+                return -ENOMEM;
+
+        if (!n || !size) {
+                *bufferp = NULL;
+                return 0;
+        }
+
+        r = b1_peer_charge(peer, B1_PEER_LIMIT_BUFFERS, n * size);
+        if (r < 0)
+                return r;
+
+        buffer = calloc(n, size);
+        if (!buffer) {
+                b1_peer_uncharge(peer, B1_PEER_LIMIT_BUFFERS, n * size);
+                return -ENOMEM;
+        }
+
+        *bufferp = buffer;
+        return 0;
+}
+
+static void b1_buffer_free(B1Peer *peer, void *buffer, size_t n, size_t size) {
+        if (!buffer)
+                return;
+
+        b1_peer_uncharge(peer, B1_PEER_LIMIT_BUFFERS, n * size);
+        free(buffer);
+}
+
 static int b1_message_new_internal(B1Peer *peer, B1Message **messagep) {
         _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        int r;
+
+        r = b1_peer_charge(peer, B1_PEER_LIMIT_MESSAGES, 1);
+        if (r < 0)
+                return r;
+
         message = calloc(1, sizeof(*message));
-        if (!message)
+        if (!message) {
+                b1_peer_uncharge(peer, B1_PEER_LIMIT_MESSAGES, 1);
                 return -ENOMEM;
+        }
 
         message->ref = (CRef)C_REF_INIT;
         message->peer = b1_peer_ref(peer);
+        c_rbnode_init(&message->rb_slices);
 
         *messagep = message;
         message = NULL;
@@ -58,6 +102,8 @@ _c_public_ int b1_message_new(B1Peer *peer, B1Message **messagep) {
         message->pid = 0;
         message->tid = 0;
 
+        b1_peer_track(peer, &message->site, B1_PEER_LIMIT_MESSAGES, __builtin_return_address(0));
+
         *messagep = message;
         message = NULL;
 
@@ -78,35 +124,104 @@ _c_public_ B1Message *b1_message_ref(B1Message *message) {
 }
 
 static void b1_message_free_vecs(B1Message *message) {
-        free(message->vecs);
+        if (!message->borrowed_vecs)
+                b1_buffer_free(message->peer, message->vecs, message->n_vecs, sizeof(*message->vecs));
+
         message->vecs = NULL;
         message->n_vecs = 0;
+        message->object_vec = false;
+        message->n_written = 0;
+        message->borrowed_vecs = false;
 }
 
 static void b1_message_free_handles(B1Message *message) {
-        for (unsigned int i = 0; i < message->n_handles; i++)
-                b1_handle_unref(message->handles[i]);
+        if (!message->borrowed_handles) {
+                for (unsigned int i = 0; i < message->n_handles; i++)
+                        b1_handle_unref(message->handles[i]);
+
+                b1_buffer_free(message->peer, message->handles, message->n_handles, sizeof(*message->handles));
+        }
 
-        free(message->handles);
         message->handles = NULL;
+        message->n_handles = 0;
+        message->borrowed_handles = false;
 }
 
 static void b1_message_free_fds(B1Message *message) {
-        for (unsigned int i = 0; i < message->n_fds; i++)
-                if (message->fds[i] >= 0)
-                        close(message->fds[i]);
+        if (!message->borrowed_fds) {
+                for (unsigned int i = 0; i < message->n_fds; i++)
+                        if (message->fds[i] >= 0)
+                                close(message->fds[i]);
+
+                b1_buffer_free(message->peer, message->fds, message->n_fds, sizeof(*message->fds));
+        }
 
-        free(message->fds);
         message->fds = NULL;
+        message->n_fds = 0;
+        message->borrowed_fds = false;
+}
+
+static int slices_compare(CRBTree *t, void *k, CRBNode *n) {
+        B1Message *message = c_container_of(n, B1Message, rb_slices);
+        const uint8_t *slice = k;
+
+        if (slice < (const uint8_t *)message->slice)
+                return -1;
+        else if (slice > (const uint8_t *)message->slice)
+                return 1;
+        else
+                return 0;
+}
+
+static int b1_message_link_slice(B1Message *message) {
+        CRBNode **slot, *p;
+
+        assert(message->slice);
+
+        slot = c_rbtree_find_slot(&message->peer->slices, slices_compare, message->slice, &p);
+        if (!slot)
+                return -ENOTUNIQ;
+
+        pthread_mutex_lock(&message->peer->lock);
+        c_rbtree_add(&message->peer->slices, p, slot, &message->rb_slices);
+        B1_COUNTER_ADD(message->peer->n_slices, 1);
+        B1_COUNTER_ADD(message->peer->n_slice_bytes, message->n_slice);
+        pthread_mutex_unlock(&message->peer->lock);
+
+        return 0;
+}
+
+static void b1_message_release_slice(B1Message *message) {
+        if (!c_rbnode_is_linked(&message->rb_slices))
+                return;
+
+        pthread_mutex_lock(&message->peer->lock);
+        c_rbtree_remove_init(&message->peer->slices, &message->rb_slices);
+        B1_COUNTER_SUB(message->peer->n_slices, 1);
+        B1_COUNTER_SUB(message->peer->n_slice_bytes, message->n_slice);
+        pthread_mutex_unlock(&message->peer->lock);
+
+        bus1_peer_slice_release(message->peer->peer,
+                                bus1_peer_slice_to_offset(message->peer->peer, message->slice));
 }
 
 static void b1_message_free(CRef *ref, void *userdata) {
         B1Message *message = userdata;
 
+        b1_message_release_slice(message);
         b1_message_free_vecs(message);
         b1_message_free_handles(message);
         b1_message_free_fds(message);
 
+        b1_credentials_unref(message->credentials);
+
+        if (message->origin) {
+                --message->origin->n_clones;
+                b1_message_unref(message->origin);
+        }
+
+        b1_peer_untrack(message->peer, &message->site);
+        b1_peer_uncharge(message->peer, B1_PEER_LIMIT_MESSAGES, 1);
         b1_peer_unref(message->peer);
         free(message);
 }
@@ -124,6 +239,61 @@ _c_public_ B1Message *b1_message_unref(B1Message *message) {
         return NULL;
 }
 
+/**
+ * b1_message_clone() - create an independent copy of a message
+ * @message:            the message to clone
+ * @clonep:             pointer to the new message
+ *
+ * Creates a new message with the same type, metadata, payload, handles and
+ * file descriptors as @message, but with its own reference count. This allows
+ * passing a received message to several consumers, each of which may retain
+ * or modify its copy independently.
+ *
+ * The clone does not copy anything, but borrows the payload, handles and file
+ * descriptors of @message, and keeps @message (and hence its pool slice)
+ * alive for as long as it borrows from it. Setting the payload, handles or
+ * file descriptors of the clone replaces the borrowed ones with its own, while
+ * those of @message can no longer be changed once it has been cloned.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_message_clone(B1Message *message, B1Message **clonep) {
+        _c_cleanup_(b1_message_unrefp) B1Message *clone = NULL;
+        int r;
+
+        r = b1_message_new_internal(message->peer, &clone);
+        if (r < 0)
+                return r;
+
+        clone->type = message->type;
+        clone->destination = message->destination;
+        clone->object = message->object;
+        clone->uid = message->uid;
+        clone->gid = message->gid;
+        clone->pid = message->pid;
+        clone->tid = message->tid;
+
+        clone->vecs = message->vecs;
+        clone->n_vecs = message->n_vecs;
+        clone->handles = message->handles;
+        clone->n_handles = message->n_handles;
+        clone->fds = message->fds;
+        clone->n_fds = message->n_fds;
+        clone->borrowed_vecs = true;
+        clone->borrowed_handles = true;
+        clone->borrowed_fds = true;
+        clone->object_vec = message->object_vec;
+
+        clone->origin = b1_message_ref(message);
+        ++message->n_clones;
+
+        b1_peer_track(message->peer, &clone->site, B1_PEER_LIMIT_MESSAGES, __builtin_return_address(0));
+
+        *clonep = clone;
+        clone = NULL;
+        return 0;
+}
+
 int b1_message_new_from_slice(B1Peer *peer,
                               B1Message **messagep,
                               const void *slice,
@@ -137,14 +307,30 @@ int b1_message_new_from_slice(B1Peer *peer,
                               size_t n_handles,
                               size_t n_fds) {
         _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
-        struct iovec *vec;
-        uint64_t *handle_ids;
+        const uint64_t *handle_ids;
+        const int *fds;
+        size_t n_acquired = 0;
+        void *buffer;
         int r;
 
+        handle_ids = (const uint64_t*)((const uint8_t*)slice + c_align_to(n_bytes, 8));
+        fds = (const int*)(handle_ids + n_handles);
+
         r = b1_message_new_internal(peer, &message);
         if (r < 0)
-                return r;
+                goto error;
+
         message->slice = slice;
+        message->n_slice = c_align_to(n_bytes, 8) +
+                           n_handles * sizeof(*handle_ids) +
+                           n_fds * sizeof(*fds);
+
+        /* slices outside of the pool are not owned by the kernel */
+        if (slice && bus1_peer_slice_to_offset(peer->peer, slice) != BUS1_OFFSET_INVALID) {
+                r = b1_message_link_slice(message);
+                if (r < 0)
+                        goto error;
+        }
 
         message->type = type;
         message->destination = destination;
@@ -153,86 +339,138 @@ int b1_message_new_from_slice(B1Peer *peer,
         message->pid = pid;
         message->tid = tid;
 
-        message->vecs = calloc(1, sizeof(*vec));
-        if (!message->vecs)
-                return -ENOMEM;
+        /* notifications carry no payload, so avoid allocating an empty vector */
+        if (type == BUS1_MSG_DATA || n_bytes) {
+                r = b1_buffer_new(peer, &buffer, 1, sizeof(*message->vecs));
+                if (r < 0)
+                        goto error;
 
-        message->vecs->iov_base = (void*)slice;
-        message->vecs->iov_len = n_bytes;
-        message->n_vecs = 1;
+                message->vecs = buffer;
+                message->vecs->iov_base = (void*)slice;
+                message->vecs->iov_len = n_bytes;
+                message->n_vecs = 1;
+        }
 
-        message->handles = calloc(n_handles, sizeof(B1Handle*));
-        if (!message->handles)
-                return -ENOMEM;
+        r = b1_buffer_new(peer, &buffer, n_handles, sizeof(*message->handles));
+        if (r < 0)
+                goto error;
 
+        message->handles = buffer;
         message->n_handles = n_handles;
 
-        handle_ids = (uint64_t*)((uint8_t*)slice + c_align_to(n_bytes, 8));
-
-        for (unsigned int i = 0; i < n_handles; i++) {
+        for (n_acquired = 0; n_acquired < n_handles; n_acquired++) {
                 B1Handle *handle;
 
-                r = b1_handle_acquire(peer, &handle, handle_ids[i]);
+                r = b1_handle_acquire(peer, &handle, handle_ids[n_acquired]);
                 if (r < 0)
-                        return r;
+                        goto error;
 
-                message->handles[i] = handle;
+                message->handles[n_acquired] = handle;
         }
 
-        message->fds = calloc(n_fds, sizeof(int));
-        if (!message->fds)
-                return -ENOMEM;
-        memcpy(message->fds, (uint8_t*)handle_ids + c_align_to(n_handles, 8), n_fds * sizeof(int));
+        r = b1_buffer_new(peer, &buffer, n_fds, sizeof(*message->fds));
+        if (r < 0)
+                goto error;
+
+        message->fds = buffer;
+        if (n_fds)
+                memcpy(message->fds, fds, n_fds * sizeof(int));
         message->n_fds = n_fds;
 
         *messagep = message;
         message = NULL;
 
         return 0;
+
+error:
+        /* drop the kernel resources we did not take ownership of */
+        if ((!message || !c_rbnode_is_linked(&message->rb_slices)) &&
+            slice && bus1_peer_slice_to_offset(peer->peer, slice) != BUS1_OFFSET_INVALID)
+                bus1_peer_slice_release(peer->peer, bus1_peer_slice_to_offset(peer->peer, slice));
+
+        for (size_t i = n_acquired; i < n_handles; i++)
+                if (handle_ids[i] != BUS1_HANDLE_INVALID)
+                        bus1_peer_handle_release(peer->peer, handle_ids[i]);
+
+        for (size_t i = 0; i < n_fds; i++)
+                close(fds[i]);
+
+        return r;
 }
 
-/**
- * b1_message_send() - send a message to the given handles
- * @message             the message to be sent
- * @destinations        the destination handles
- * @n_destinations      the number of destinations
- *
- * Return: 0 on succes, or a negative error code on failure.
+/*
+ * Drops a received slice without creating a message from it, releasing the
+ * slice itself, and all handles and file descriptors passed along with it.
  */
-_c_public_ int b1_message_send(B1Message *message,
-                               B1Handle **destinations,
-                               size_t n_destinations) {
-        /* limit number of destinations? */
-        uint64_t destination_ids[n_destinations];
-        uint64_t *handle_ids;
-        struct bus1_cmd_send send = {
-                .ptr_destinations = n_destinations > 0 ? (uintptr_t)destination_ids : 0,
-                .n_destinations = n_destinations,
-        };
-        int r;
+void b1_message_discard_slice(B1Peer *peer,
+                              const void *slice,
+                              size_t n_bytes,
+                              size_t n_handles,
+                              size_t n_fds) {
+        const uint64_t *handle_ids;
+        const int *fds;
 
-        assert(!n_destinations || destinations);
+        handle_ids = (const uint64_t*)((const uint8_t*)slice + c_align_to(n_bytes, 8));
+        fds = (const int*)(handle_ids + n_handles);
 
-        if (!message || message->type != BUS1_MSG_DATA)
-                return -EINVAL;
+        for (size_t i = 0; i < n_handles; i++)
+                if (handle_ids[i] != BUS1_HANDLE_INVALID)
+                        bus1_peer_handle_release(peer->peer, handle_ids[i]);
 
-        handle_ids = malloc(sizeof(uint64_t) * message->n_handles);
-        if (!handle_ids)
-                return -ENOMEM;
+        for (size_t i = 0; i < n_fds; i++)
+                close(fds[i]);
 
-        send.ptr_vecs = (uintptr_t)message->vecs;
-        send.n_vecs = message->n_vecs;
-        send.ptr_handles = (uintptr_t)handle_ids;
-        send.n_handles = message->n_handles;
-        send.ptr_fds = (uintptr_t)message->fds;
-        send.n_fds = message->n_fds;
+        if (slice && bus1_peer_slice_to_offset(peer->peer, slice) != BUS1_OFFSET_INVALID)
+                bus1_peer_slice_release(peer->peer, bus1_peer_slice_to_offset(peer->peer, slice));
+}
 
+void b1_message_track(B1Message *message, const void *address) {
+        b1_peer_track(message->peer, &message->site, B1_PEER_LIMIT_MESSAGES, address);
+
+        for (size_t i = 0; i < message->n_handles; i++)
+                if (message->handles[i])
+                        b1_peer_track(message->peer, &message->handles[i]->site, B1_PEER_LIMIT_HANDLES, address);
+}
+
+static void b1_message_unmark_handles(B1Message *message) {
+        for (unsigned int i = 0; i < message->n_handles; i++)
+                message->handles[i]->marked = false;
+}
+
+static int b1_message_check_handles(B1Message *message) {
+        int r = 0;
+
+        for (unsigned int i = 0; i < message->n_handles && r >= 0; i++) {
+                if (message->handles[i]->marked)
+                        r = -ENOTUNIQ;
+
+                message->handles[i]->marked = true;
+        }
+
+        b1_message_unmark_handles(message);
+        return r;
+}
+
+/*
+ * Send hooks run before the scratch space of the peer is reserved, as they may
+ * send messages on the same peer themselves.
+ */
+static int b1_message_run_send_hooks(B1Message *message,
+                                     B1Handle **destinations,
+                                     size_t n_destinations) {
+        if (_c_likely_(!message->peer->n_hooks[B1_HOOK_SEND]))
+                return 0;
+
+        return b1_peer_run_hooks(message->peer, B1_HOOK_SEND, message, destinations, n_destinations);
+}
+
+static int b1_message_prepare_handles(B1Message *message, uint64_t *handle_ids) {
         for (unsigned int i = 0; i < message->n_handles; i++) {
                 B1Handle *handle = message->handles[i];
 
                 if (handle->marked) {
-                        r = -ENOTUNIQ;
-                        goto error;
+                        b1_message_unmark_handles(message);
+                        return -ENOTUNIQ;
                 }
 
                 handle->marked = true;
@@ -244,19 +482,10 @@ _c_public_ int b1_message_send(B1Message *message,
                         handle_ids[i] = handle->id;
         }
 
-        for (unsigned int i = 0; i < n_destinations; i++) {
-                if (destinations[i]->holder != message->peer) {
-                        r = -EINVAL;
-                        goto error;
-                }
-
-                destination_ids[i] = destinations[i]->id;
-        }
-
-        r = bus1_peer_send(message->peer->peer, &send);
-        if (r < 0)
-                goto error;
+        return 0;
+}
 
+static void b1_message_link_handles(B1Message *message, const uint64_t *handle_ids) {
         for (unsigned int i = 0; i < message->n_handles; i++) {
                 B1Handle *handle = message->handles[i];
 
@@ -270,19 +499,208 @@ _c_public_ int b1_message_send(B1Message *message,
                 if (handle->node)
                         assert(b1_node_link(handle->node, handle_ids[i]) >= 0);
         }
+}
+
+static int b1_message_send_prepared(B1Message *message,
+                                    size_t n_destinations,
+                                    uint64_t *destination_ids,
+                                    uint64_t *handle_ids) {
+        struct bus1_cmd_send send = {
+                .ptr_destinations = n_destinations > 0 ? (uintptr_t)destination_ids : 0,
+                .n_destinations = n_destinations,
+                .ptr_vecs = (uintptr_t)message->vecs,
+                .n_vecs = message->n_vecs,
+                .ptr_handles = (uintptr_t)handle_ids,
+                .n_handles = message->n_handles,
+                .ptr_fds = (uintptr_t)message->fds,
+                .n_fds = message->n_fds,
+        };
+        int r;
+
+        r = b1_message_prepare_handles(message, handle_ids);
+        if (r < 0)
+                return r;
+
+        r = bus1_peer_send(message->peer->peer, &send);
+        if (r < 0) {
+                b1_message_unmark_handles(message);
+                return r;
+        }
 
-        free(handle_ids);
+        b1_message_link_handles(message, handle_ids);
 
         return 0;
+}
 
-error:
-        free(handle_ids);
+/**
+ * b1_message_send() - send a message to the given handles
+ * @message             the message to be sent
+ * @destinations        the destination handles
+ * @n_destinations      the number of destinations
+ *
+ * Return: 0 on succes, or a negative error code on failure.
+ */
+_c_public_ int b1_message_send(B1Message *message,
+                               B1Handle **destinations,
+                               size_t n_destinations) {
+        /* limit number of destinations? */
+        uint64_t destination_ids[n_destinations];
+        void *scratch;
+        int r;
 
-        /* unmark handles */
-        for (unsigned int i = 0; i < message->n_handles; i++)
-                message->handles[i]->marked = false;
+        assert(!n_destinations || destinations);
 
-        return r;
+        if (!message || message->type != BUS1_MSG_DATA)
+                return -EINVAL;
+
+        for (unsigned int i = 0; i < n_destinations; i++) {
+                if (destinations[i]->holder != message->peer)
+                        return -EINVAL;
+
+                destination_ids[i] = destinations[i]->id;
+        }
+
+        r = b1_message_check_handles(message);
+        if (r < 0)
+                return r;
+
+        r = b1_message_run_send_hooks(message, destinations, n_destinations);
+        if (r < 0)
+                return r;
+
+        r = b1_peer_reserve_scratch(message->peer, message->n_handles * sizeof(uint64_t), &scratch);
+        if (r < 0)
+                return r;
+
+        return b1_message_send_prepared(message, n_destinations, destination_ids, scratch);
+}
+
+/**
+ * b1_messages_send() - send a batch of messages
+ * @sends:              the messages and their destinations
+ * @n_sends:            the number of messages
+ * @n_sentp:            pointer to the number of messages sent, or NULL
+ *
+ * This sends each message in @sends to its destinations, in order, as if
+ * b1_message_send() was called for each of them, but the scratch space for
+ * the whole batch is reserved only once. All messages must belong to the same
+ * peer.
+ *
+ * All messages are validated, checked for duplicate handles and passed to the
+ * send hooks of the peer before the first one is sent; if any of that fails,
+ * nothing is sent. Only the kernel may still reject a message afterwards, in
+ * which case the messages before it were sent, and their number is returned
+ * in @n_sentp.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_messages_send(B1MessageSend *sends, size_t n_sends, size_t *n_sentp) {
+        uint64_t *ids;
+        B1Peer *peer;
+        size_t i, n_ids = 0;
+        void *scratch;
+        int r;
+
+        if (n_sentp)
+                *n_sentp = 0;
+
+        if (!n_sends)
+                return 0;
+
+        assert(sends);
+
+        peer = sends[0].message ? sends[0].message->peer : NULL;
+
+        for (i = 0; i < n_sends; i++) {
+                B1Message *message = sends[i].message;
+
+                assert(!sends[i].n_destinations || sends[i].destinations);
+
+                if (!message || message->type != BUS1_MSG_DATA || message->peer != peer)
+                        return -EINVAL;
+
+                for (size_t j = 0; j < sends[i].n_destinations; j++)
+                        if (sends[i].destinations[j]->holder != peer)
+                                return -EINVAL;
+
+                r = b1_message_check_handles(message);
+                if (r < 0)
+                        return r;
+
+                n_ids += message->n_handles + sends[i].n_destinations;
+        }
+
+        for (i = 0; i < n_sends; i++) {
+                r = b1_message_run_send_hooks(sends[i].message, sends[i].destinations, sends[i].n_destinations);
+                if (r < 0)
+                        return r;
+        }
+
+        if (n_ids > SIZE_MAX / sizeof(*ids))
+                return -ENOMEM;
+
+        r = b1_peer_reserve_scratch(peer, n_ids * sizeof(*ids), &scratch);
+        if (r < 0)
+                return r;
+
+        ids = scratch;
+
+        for (i = 0; i < n_sends; i++) {
+                B1MessageSend *s = &sends[i];
+                uint64_t *destination_ids = ids;
+                uint64_t *handle_ids = ids + s->n_destinations;
+
+                /* ids of handles allocated by earlier messages are known by now */
+                for (size_t j = 0; j < s->n_destinations; j++)
+                        destination_ids[j] = s->destinations[j]->id;
+
+                r = b1_message_send_prepared(s->message, s->n_destinations, destination_ids, handle_ids);
+                if (r < 0)
+                        return r;
+
+                ids = handle_ids + s->message->n_handles;
+
+                if (n_sentp)
+                        ++*n_sentp;
+        }
+
+        return 0;
+}
+
+static int b1_message_build_vecs(B1Message *message, uint64_t object, struct iovec *vecs, size_t n_vecs) {
+        struct iovec *vecs_new;
+        bool object_vec = !!object;
+        void *buffer;
+        int r;
+
+        if (n_vecs + object_vec == 0) {
+                b1_message_free_vecs(message);
+                message->object.id = 0;
+                return 0;
+        }
+
+        r = b1_buffer_new(message->peer, &buffer, n_vecs + object_vec, sizeof(*vecs_new));
+        if (r < 0)
+                return r;
+
+        vecs_new = buffer;
+        if (object_vec) {
+                vecs_new->iov_base = &message->object;
+                vecs_new->iov_len = sizeof(message->object);
+        }
+        memcpy(vecs_new + object_vec, vecs, sizeof(*vecs) * n_vecs);
+
+        b1_message_free_vecs(message);
+        message->vecs = vecs_new;
+        message->n_vecs = n_vecs + object_vec;
+        message->n_written = 0;
+        message->object = (B1MessageObject){
+                .magic = B1_MESSAGE_OBJECT_MAGIC,
+                .id = object,
+        };
+        message->object_vec = object_vec;
+
+        return 0;
 }
 
 /**
@@ -297,28 +715,73 @@ error:
  * The caller must ensure that the underlying data remains valid for the
  * lifetime of the message, but the iovec array itself may be freed.
  *
+ * The destination object of the message, if any, is kept.
+ *
  * Return: 0 on succes, or a negative error code on failure.
  */
 _c_public_ int b1_message_set_payload(B1Message *message, struct iovec *vecs, size_t n_vecs) {
-        struct iovec *vecs_new;
-
         assert(!vecs || n_vecs);
 
-        if (n_vecs == 0) {
-                b1_message_free_vecs(message);
+        if (message->n_clones)
+                return -EBUSY;
+
+        return b1_message_build_vecs(message, message->object.id, vecs, n_vecs);
+}
+
+/**
+ * b1_message_set_object() - address an object multiplexed over a node
+ * @message:            the message to be sent
+ * @object:             the object id, or 0
+ *
+ * This puts a header with @object in front of the payload, so the message is
+ * dispatched to that object when sent to the handle of the node carrying it
+ * (see b1_node_set_object_handler()). The header starts with a magic number,
+ * so the receiver only strips it from messages that carry it. It is not part
+ * of the payload as returned by b1_message_get_payload() or written by
+ * b1_message_write(). An object id of 0 removes the header again.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_message_set_object(B1Message *message, uint64_t object) {
+        if (message->n_clones)
+                return -EBUSY;
+
+        /* the header points at @message->object, so only the id changes */
+        if (object && message->object_vec && !message->borrowed_vecs) {
+                message->object.id = object;
                 return 0;
         }
 
-        vecs_new = malloc(sizeof(*vecs_new) * n_vecs);
-        if (!vecs_new)
-                return -ENOMEM;
-        memcpy(vecs_new, vecs, sizeof(*vecs) * n_vecs);
+        return b1_message_build_vecs(message,
+                                     object,
+                                     message->vecs + message->object_vec,
+                                     message->n_vecs - message->object_vec);
+}
 
-        b1_message_free_vecs(message);
-        message->vecs = vecs_new;
-        message->n_vecs = n_vecs;
+/**
+ * b1_message_get_object() - get the destination object of a message
+ * @message:            the message
+ *
+ * Return: The object id, or 0 if the message was not addressed to an object.
+ */
+_c_public_ uint64_t b1_message_get_object(B1Message *message) {
+        return message->object.id;
+}
 
-        return 0;
+void b1_message_strip_object(B1Message *message) {
+        B1MessageObject object;
+
+        if (message->n_vecs != 1 || message->vecs->iov_len < sizeof(object))
+                return;
+
+        /* messages sent without b1_message_set_object() keep their payload */
+        memcpy(&object, message->vecs->iov_base, sizeof(object));
+        if (object.magic != B1_MESSAGE_OBJECT_MAGIC)
+                return;
+
+        message->object = object;
+        message->vecs->iov_base = (uint8_t *)message->vecs->iov_base + sizeof(object);
+        message->vecs->iov_len -= sizeof(object);
 }
 
 /**
@@ -335,9 +798,14 @@ _c_public_ int b1_message_set_payload(B1Message *message, struct iovec *vecs, si
  */
 _c_public_ int b1_message_set_handles(B1Message *message, B1Handle **handles, size_t n_handles) {
         B1Handle **handles_new;
+        void *buffer;
+        int r;
 
         assert(!handles || n_handles);
 
+        if (message->n_clones)
+                return -EBUSY;
+
         if (n_handles == 0) {
                 b1_message_free_handles(message);
                 return 0;
@@ -348,9 +816,11 @@ _c_public_ int b1_message_set_handles(B1Message *message, B1Handle **handles, si
                         return -EINVAL;
         }
 
-        handles_new = malloc(sizeof(*handles_new) * n_handles);
-        if (!handles_new)
-                return -ENOMEM;
+        r = b1_buffer_new(message->peer, &buffer, n_handles, sizeof(*handles_new));
+        if (r < 0)
+                return r;
+
+        handles_new = buffer;
         memcpy(handles_new, handles, sizeof(*handles) * n_handles);
 
         for (unsigned int i = 0; i < n_handles; i++)
@@ -376,17 +846,23 @@ _c_public_ int b1_message_set_handles(B1Message *message, B1Handle **handles, si
  */
 _c_public_ int b1_message_set_fds(B1Message *message, int *fds, size_t n_fds) {
         int *fds_new, r;
+        void *buffer;
 
         assert(!fds || n_fds);
 
+        if (message->n_clones)
+                return -EBUSY;
+
         if (n_fds == 0) {
                 b1_message_free_fds(message);
                 return 0;
         }
 
-        fds_new = malloc(sizeof(*fds_new) * n_fds);
-        if (!fds_new)
-                return -ENOMEM;
+        r = b1_buffer_new(message->peer, &buffer, n_fds, sizeof(*fds_new));
+        if (r < 0)
+                return r;
+
+        fds_new = buffer;
         memset(fds_new, -1, sizeof(*fds_new) * n_fds);
 
         for (unsigned int i = 0; i < n_fds; i++) {
@@ -408,7 +884,7 @@ error:
                 if (fds_new[i] >= 0)
                         close(fds_new[i]);
 
-        free(fds_new);
+        b1_buffer_free(message->peer, fds_new, n_fds, sizeof(*fds_new));
         return r;
 }
 
@@ -526,8 +1002,64 @@ _c_public_ int b1_message_get_payload(B1Message *message, struct iovec **vecsp,
                 *vecsp = NULL;
                 *n_vecsp = 0;
         } else {
-                *vecsp = message->vecs;
-                *n_vecsp = message->n_vecs;
+                *vecsp = message->vecs + message->object_vec;
+                *n_vecsp = message->n_vecs - message->object_vec;
+        }
+
+        return 0;
+}
+
+/**
+ * b1_message_write() - write the message payload to a file descriptor
+ * @message:            the message
+ * @fd:                 the file descriptor to write to
+ *
+ * This writes the payload of @message to @fd, straight from where it is
+ * stored, which for received messages is the pool mapping, so no intermediate
+ * copy is made. If @fd is non-blocking and would block, -EAGAIN is returned,
+ * and a later call continues where the previous one stopped.
+ *
+ * Once the payload of a received message was written completely, its slice is
+ * released back to the kernel right away, rather than when the message is
+ * freed, and the payload of @message is empty afterwards. This is skipped if
+ * the payload is shared with clones.
+ *
+ * Return: 0 once the payload was written completely, -EAGAIN if @fd would
+ *         block, or a negative error code on failure.
+ */
+_c_public_ int b1_message_write(B1Message *message, int fd) {
+        struct iovec vecs[64];
+        size_t i, skip, n;
+        ssize_t l;
+
+        for (;;) {
+                /* find the first iovec that was not written completely */
+                skip = message->n_written;
+                for (i = message->object_vec; i < message->n_vecs && skip >= message->vecs[i].iov_len; i++)
+                        skip -= message->vecs[i].iov_len;
+
+                if (i == message->n_vecs)
+                        break;
+
+                n = c_min(message->n_vecs - i, C_ARRAY_SIZE(vecs));
+                memcpy(vecs, message->vecs + i, n * sizeof(*vecs));
+                vecs[0].iov_base = (uint8_t *)vecs[0].iov_base + skip;
+                vecs[0].iov_len -= skip;
+
+                l = writev(fd, vecs, n);
+                if (l < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        return -errno;
+                }
+
+                message->n_written += l;
+        }
+
+        if (c_rbnode_is_linked(&message->rb_slices) && !message->n_clones) {
+                b1_message_release_slice(message);
+                b1_message_free_vecs(message);
         }
 
         return 0;
@@ -7,30 +7,55 @@
  * any later version.
  */
 
+#include <c-rbtree.h>
 #include <c-ref.h>
 #include <stdlib.h>
 #include "org.bus1/b1-peer.h"
 
+#define B1_MESSAGE_OBJECT_MAGIC UINT64_C(0x7463656a624f3142) /* "B1Object" */
+
+typedef struct B1MessageObject B1MessageObject;
+
+/* header in front of the payload of a message to an object */
+struct B1MessageObject {
+        uint64_t magic; /* B1_MESSAGE_OBJECT_MAGIC */
+        uint64_t id;
+};
+
 struct B1Message {
         CRef ref;
         B1Peer *peer;
         const void *slice; /* NULL if not backed by a slice */
+        size_t n_slice; /* size of the slice in bytes */
+        CRBNode rb_slices; /* linked into the peer while the slice is owned */
+        struct B1Site *site; /* allocation site, if tracked */
+
+        B1Message *origin; /* message this was cloned from, if any */
+        size_t n_clones; /* number of messages cloned from this one */
+
+        B1Credentials *credentials; /* sender credentials, once queried */
 
         uint64_t type; /* BUS1_MSG_* */
 
         uint64_t destination;
+        B1MessageObject object; /* destination object, id 0 if none */
         uid_t uid;
         gid_t gid;
         pid_t pid;
         pid_t tid;
 
-        /* each of the following arrays are owned by the message */
+        /* each of the following arrays are owned by the message, unless borrowed from the origin */
         struct iovec *vecs; /* message does not own the backing data */
         size_t n_vecs;
+        size_t n_written; /* payload bytes already written by b1_message_write() */
         B1Handle **handles; /* message owns a ref to each handle */
         size_t n_handles;
         int *fds; /* message owns each fd */
         size_t n_fds;
+        bool borrowed_vecs;
+        bool borrowed_handles;
+        bool borrowed_fds;
+        bool object_vec; /* vecs[0] carries @object, as header of the payload */
 };
 
 int b1_message_new_from_slice(B1Peer *peer,
@@ -45,3 +70,10 @@ int b1_message_new_from_slice(B1Peer *peer,
                               size_t n_bytes,
                               size_t n_handles,
                               size_t n_fds);
+void b1_message_discard_slice(B1Peer *peer,
+                              const void *slice,
+                              size_t n_bytes,
+                              size_t n_handles,
+                              size_t n_fds);
+void b1_message_track(B1Message *message, const void *address);
+void b1_message_strip_object(B1Message *message);
@@ -52,9 +52,10 @@ int b1_node_link(B1Node *node, uint64_t id) {
         if (!slot)
                 return -ENOTUNIQ;
 
+        pthread_mutex_lock(&node->owner->lock);
         node->id = id;
-
         c_rbtree_add(&node->owner->nodes, p, slot, &node->rb_nodes);
+        pthread_mutex_unlock(&node->owner->lock);
 
         return 0;
 }
@@ -71,22 +72,30 @@ int b1_handle_link(B1Handle *handle, uint64_t id) {
         if (!slot)
                 return -ENOTUNIQ;
 
+        pthread_mutex_lock(&handle->holder->lock);
         handle->id = id;
-
         c_rbtree_add(&handle->holder->handles, p, slot, &handle->rb);
+        pthread_mutex_unlock(&handle->holder->lock);
 
         return 0;
 }
 
 static int b1_handle_new(B1Peer *peer, B1Handle **handlep) {
         _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL;
+        int r;
 
         assert(peer);
         assert(handlep);
 
+        r = b1_peer_charge(peer, B1_PEER_LIMIT_HANDLES, 1);
+        if (r < 0)
+                return r;
+
         handle = calloc(1, sizeof(*handle));
-        if (!handle)
+        if (!handle) {
+                b1_peer_uncharge(peer, B1_PEER_LIMIT_HANDLES, 1);
                 return -ENOMEM;
+        }
 
         handle->ref = (CRef)C_REF_INIT;
         handle->holder = b1_peer_ref(peer);
@@ -119,11 +128,12 @@ int b1_handle_acquire(B1Peer *peer, B1Handle **handlep, uint64_t handle_id) {
                 if (r < 0)
                         return r;
 
+                pthread_mutex_lock(&peer->lock);
                 handle->ref_kernel = (CRef)C_REF_INIT;
                 handle->live = true;
                 handle->id = handle_id;
-
                 c_rbtree_add(&peer->handles, p, slot, &handle->rb);
+                pthread_mutex_unlock(&peer->lock);
         } else {
                 handle = c_container_of(p, B1Handle, rb);
                 if (handle->live) {
@@ -133,8 +143,10 @@ int b1_handle_acquire(B1Peer *peer, B1Handle **handlep, uint64_t handle_id) {
                         if (r < 0)
                                 return r;
                 } else {
+                        pthread_mutex_lock(&peer->lock);
                         handle->ref_kernel = (CRef)C_REF_INIT;
                         handle->live = true;
+                        pthread_mutex_unlock(&peer->lock);
                 }
                 c_ref_inc(&handle->ref);
         }
@@ -154,11 +166,18 @@ _c_public_ int b1_node_new(B1Peer *peer, B1Node **nodep) {
         _c_cleanup_(b1_node_freep) B1Node *node = NULL;
         int r;
 
+        r = b1_peer_charge(peer, B1_PEER_LIMIT_NODES, 1);
+        if (r < 0)
+                return r;
+
         node = calloc(1, sizeof(*node));
-        if (!node)
+        if (!node) {
+                b1_peer_uncharge(peer, B1_PEER_LIMIT_NODES, 1);
                 return -ENOMEM;
+        }
 
         node->id = BUS1_HANDLE_INVALID;
+        node->i_objects_free = B1_NODE_OBJECT_END;
         node->owner = b1_peer_ref(peer);
         c_rbnode_init(&node->rb_nodes);
 
@@ -168,6 +187,9 @@ _c_public_ int b1_node_new(B1Peer *peer, B1Node **nodep) {
 
         node->handle->node = node;
 
+        b1_peer_track(peer, &node->site, B1_PEER_LIMIT_NODES, __builtin_return_address(0));
+        b1_peer_track(peer, &node->handle->site, B1_PEER_LIMIT_HANDLES, __builtin_return_address(0));
+
         *nodep = node;
         node = NULL;
         return 0;
@@ -186,11 +208,25 @@ _c_public_ B1Node *b1_node_free(B1Node *node) {
         if (!node)
                 return NULL;
 
+        pthread_mutex_lock(&node->owner->lock);
         c_rbtree_remove_init(&node->owner->nodes, &node->rb_nodes);
+        pthread_mutex_unlock(&node->owner->lock);
 
         b1_node_destroy(node);
 
+        b1_node_set_policy(node, NULL);
+        b1_node_set_object_handler(node, NULL);
+        if (node->objects) {
+                b1_peer_uncharge(node->owner, B1_PEER_LIMIT_BUFFERS, node->n_objects_max * sizeof(*node->objects));
+                free(node->objects);
+        }
+        if (node->profile) {
+                b1_peer_uncharge(node->owner, B1_PEER_LIMIT_BUFFERS, sizeof(*node->profile));
+                free(node->profile);
+        }
         b1_handle_unref(node->handle);
+        b1_peer_untrack(node->owner, &node->site);
+        b1_peer_uncharge(node->owner, B1_PEER_LIMIT_NODES, 1);
         b1_peer_unref(node->owner);
         free(node);
 
@@ -222,6 +258,252 @@ _c_public_ B1Handle *b1_node_get_handle(B1Node *node) {
         return node->handle;
 }
 
+/**
+ * b1_node_get_id() - get kernel id of a node
+ * @node:               node to query
+ *
+ * The id is stable for the lifetime of the node in the kernel, and survives a
+ * hand-over with b1_peer_export() and b1_peer_import().
+ *
+ * Return: The id of @node, or BUS1_HANDLE_INVALID if not known to the kernel.
+ */
+_c_public_ uint64_t b1_node_get_id(B1Node *node) {
+        return node->id;
+}
+
+/**
+ * b1_node_set_handler() - set the message handler of a node
+ * @node:               the node
+ * @fn:                 the handler, or NULL
+ * @userdata:           userdata passed to @fn
+ *
+ * The handler is invoked by b1_peer_dispatch() for every message destined for
+ * @node, instead of the message being returned to the caller.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_node_set_handler(B1Node *node, B1NodeFn fn, void *userdata) {
+        node->fn = fn;
+        node->userdata = userdata;
+
+        return 0;
+}
+
+/**
+ * b1_node_set_object_handler() - multiplex objects over a node
+ * @node:               the node
+ * @fn:                 the object handler, or NULL
+ *
+ * With an object handler set, @node carries many lightweight objects (see
+ * b1_node_add_object()), rather than being an object on its own. Messages to
+ * such objects are sent to the handle of @node, and the object id is put in
+ * front of the payload (see b1_message_set_object()). For every data message
+ * received for @node that carries such a header, it is stripped from the
+ * payload again, and the id is available via b1_message_get_object(). Messages
+ * sent to @node without an object keep their payload, and have no object.
+ *
+ * b1_peer_dispatch() looks the object up in the object table of @node, and
+ * invokes @fn with its userdata, in place of the node handler. Messages for
+ * unknown objects, or without any, are returned to the caller instead.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_node_set_object_handler(B1Node *node, B1ObjectFn fn) {
+        if (!node->object_fn && fn)
+                ++node->owner->n_object_nodes;
+        else if (node->object_fn && !fn)
+                --node->owner->n_object_nodes;
+
+        node->object_fn = fn;
+
+        return 0;
+}
+
+/**
+ * b1_node_add_object() - add an object to a node
+ * @node:               the node
+ * @userdata:           userdata of the object
+ * @objectp:            pointer to the new object id
+ *
+ * This allocates a slot in the object table of @node, which costs 16 bytes
+ * per object, and no kernel resources at all. The returned id is never 0, and
+ * is not reused for a different object once it was removed, so stale ids do
+ * not resolve to new objects.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_node_add_object(B1Node *node, void *userdata, uint64_t *objectp) {
+        B1NodeObject *objects, *object;
+        uint32_t i, n;
+        int r;
+
+        if (node->i_objects_free != B1_NODE_OBJECT_END) {
+                i = node->i_objects_free;
+                object = &node->objects[i];
+                node->i_objects_free = object->next;
+        } else {
+                if (node->n_objects == node->n_objects_max) {
+                        if (node->n_objects_max >= B1_NODE_OBJECT_END / 2)
+                                return -ENOSPC;
+
+                        n = node->n_objects_max ? node->n_objects_max * 2 : 16;
+
+                        r = b1_peer_charge(node->owner,
+                                           B1_PEER_LIMIT_BUFFERS,
+                                           (n - node->n_objects_max) * sizeof(*objects));
+                        if (r < 0)
+                                return r;
+
+                        objects = realloc(node->objects, n * sizeof(*objects));
+                        if (!objects) {
+                                b1_peer_uncharge(node->owner,
+                                                 B1_PEER_LIMIT_BUFFERS,
+                                                 (n - node->n_objects_max) * sizeof(*objects));
+                                return -ENOMEM;
+                        }
+
+                        node->objects = objects;
+                        node->n_objects_max = n;
+                }
+
+                i = node->n_objects++;
+                object = &node->objects[i];
+                object->generation = 1;
+        }
+
+        object->userdata = userdata;
+        object->next = B1_NODE_OBJECT_LIVE;
+
+        *objectp = (uint64_t)object->generation << 32 | i;
+        return 0;
+}
+
+static B1NodeObject *b1_node_find_object(B1Node *node, uint64_t object) {
+        uint32_t i = (uint32_t)object;
+
+        if (i >= node->n_objects ||
+            node->objects[i].next != B1_NODE_OBJECT_LIVE ||
+            node->objects[i].generation != object >> 32)
+                return NULL;
+
+        return &node->objects[i];
+}
+
+/**
+ * b1_node_remove_object() - remove an object from a node
+ * @node:               the node
+ * @object:             the object id
+ *
+ * Messages still queued for @object are no longer dispatched to the object
+ * handler, but returned by b1_peer_dispatch().
+ *
+ * Return: 0 on success, -ENOENT if @object is unknown, or a negative error
+ *         code on failure.
+ */
+_c_public_ int b1_node_remove_object(B1Node *node, uint64_t object) {
+        B1NodeObject *o;
+
+        o = b1_node_find_object(node, object);
+        if (!o)
+                return -ENOENT;
+
+        /* retire the slot for good once its generations are used up */
+        o->userdata = NULL;
+        if (++o->generation) {
+                o->next = node->i_objects_free;
+                node->i_objects_free = o - node->objects;
+        } else {
+                o->next = B1_NODE_OBJECT_END;
+        }
+
+        return 0;
+}
+
+/**
+ * b1_node_get_object() - look up an object of a node
+ * @node:               the node
+ * @object:             the object id
+ * @userdatap:          pointer to the userdata of the object
+ *
+ * Return: 0 on success, -ENOENT if @object is unknown, or a negative error
+ *         code on failure.
+ */
+_c_public_ int b1_node_get_object(B1Node *node, uint64_t object, void **userdatap) {
+        B1NodeObject *o;
+
+        o = b1_node_find_object(node, object);
+        if (!o)
+                return -ENOENT;
+
+        *userdatap = o->userdata;
+        return 0;
+}
+
+void b1_node_profile(B1Node *node, unsigned int type, uint64_t n_ns) {
+        unsigned int bucket;
+
+        assert(type >= BUS1_MSG_DATA && type <= BUS1_MSG_NODE_RELEASE);
+
+        if (!node->profile) {
+                if (b1_peer_charge(node->owner, B1_PEER_LIMIT_BUFFERS, sizeof(*node->profile)) < 0)
+                        return;
+
+                node->profile = calloc(1, sizeof(*node->profile));
+                if (!node->profile) {
+                        b1_peer_uncharge(node->owner, B1_PEER_LIMIT_BUFFERS, sizeof(*node->profile));
+                        return;
+                }
+        }
+
+        bucket = n_ns ? 64 - __builtin_clzll(n_ns) : 0;
+        if (bucket >= B1_NODE_PROFILE_N)
+                bucket = B1_NODE_PROFILE_N - 1;
+
+        ++node->profile->n_calls[type - 1];
+        node->profile->n_ns[type - 1] += n_ns;
+        ++node->profile->buckets[type - 1][bucket];
+}
+
+/**
+ * b1_node_get_profile() - query the handler profile of a node
+ * @node:               the node
+ * @type:               the message type to query, BUS1_MSG_*
+ * @n_callsp:           pointer to the number of profiled calls, or NULL
+ * @n_nsp:              pointer to the total time spent, in ns, or NULL
+ * @buckets:            histogram of the call durations, or NULL
+ *
+ * This returns the time spent in the handler of @node for messages of type
+ * @type, as measured by b1_peer_dispatch() while profiling is enabled (see
+ * b1_peer_set_profiling()). Bucket 0 of @buckets counts calls that took no
+ * measurable time, and bucket i counts calls that took [2^(i-1), 2^i) ns. The
+ * last bucket counts all longer calls as well.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_node_get_profile(B1Node *node,
+                                   unsigned int type,
+                                   uint64_t *n_callsp,
+                                   uint64_t *n_nsp,
+                                   uint64_t buckets[B1_NODE_PROFILE_N]) {
+        B1NodeProfile *profile = node->profile;
+
+        if (type < BUS1_MSG_DATA || type > BUS1_MSG_NODE_RELEASE)
+                return -EINVAL;
+
+        if (n_callsp)
+                *n_callsp = profile ? profile->n_calls[type - 1] : 0;
+        if (n_nsp)
+                *n_nsp = profile ? profile->n_ns[type - 1] : 0;
+        if (buckets) {
+                if (profile)
+                        memcpy(buckets, profile->buckets[type - 1], sizeof(profile->buckets[type - 1]));
+                else
+                        memset(buckets, 0, sizeof(profile->buckets[type - 1]));
+        }
+
+        return 0;
+}
+
 /**
  * b1_node_destroy() - destroy node
  * @node:               node to destroy, or NULL
@@ -230,7 +512,8 @@ _c_public_ B1Handle *b1_node_get_handle(B1Node *node) {
  * peers. If any peers still hold handles, they will receive node destruction
  * notifications for this node.
  *
- * If NULL is passed, this is a no-op.
+ * If NULL is passed, or if the node was never made known to the kernel, this is
+ * a no-op.
  *
  * Return: 0 on success, and a negative error code on failure.
  */
@@ -240,7 +523,7 @@ _c_public_ int b1_node_destroy(B1Node *node) {
                 .n_nodes = 1,
         };
 
-        if (!node)
+        if (!node || node->id == BUS1_HANDLE_INVALID)
                 return 0;
 
         return bus1_peer_nodes_destroy(node->owner->peer, &nodes_destroy);
@@ -279,7 +562,10 @@ static void b1_handle_release(CRef *ref, void *userdata) {
         B1Handle *handle = userdata;
         int r;
 
+        pthread_mutex_lock(&handle->holder->lock);
         handle->live = false;
+        pthread_mutex_unlock(&handle->holder->lock);
+
         r = bus1_peer_handle_release(handle->holder->peer, handle->id);
         assert(r >= 0);
 }
@@ -289,8 +575,12 @@ static void b1_handle_free(CRef *ref, void *userdata) {
 
         assert(!handle->live);
 
+        pthread_mutex_lock(&handle->holder->lock);
         c_rbtree_remove_init(&handle->holder->handles, &handle->rb);
+        pthread_mutex_unlock(&handle->holder->lock);
 
+        b1_peer_untrack(handle->holder, &handle->site);
+        b1_peer_uncharge(handle->holder, B1_PEER_LIMIT_HANDLES, 1);
         b1_peer_unref(handle->holder);
         free(handle);
 }
@@ -328,6 +618,19 @@ _c_public_ B1Peer *b1_handle_get_peer(B1Handle *handle) {
         return handle->holder;
 }
 
+/**
+ * b1_handle_get_id() - get kernel id of a handle
+ * @handle:             handle to query
+ *
+ * The id is stable for the lifetime of the handle in the kernel, and survives
+ * a hand-over with b1_peer_export() and b1_peer_import().
+ *
+ * Return: The id of @handle, or BUS1_HANDLE_INVALID if not known to the kernel.
+ */
+_c_public_ uint64_t b1_handle_get_id(B1Handle *handle) {
+        return handle->id;
+}
+
 B1Node *b1_node_lookup(B1Peer *peer, uint64_t node_id) {
         CRBNode *n;
 
@@ -393,6 +696,8 @@ _c_public_ int b1_handle_transfer(B1Handle *src_handle, B1Peer *dst, B1Handle **
         if (r < 0)
                 return r;
 
+        b1_peer_track(dst, &dst_handle->site, B1_PEER_LIMIT_HANDLES, __builtin_return_address(0));
+
         *dst_handlep = dst_handle;
         dst_handle = NULL;
         return 0;
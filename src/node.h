@@ -23,14 +23,47 @@ struct B1Handle {
         bool marked; /* used for duplicate detection */
 
         CRBNode rb;
+        struct B1Site *site; /* allocation site, if tracked */
 };
 
+typedef struct B1NodeProfile B1NodeProfile;
+
+struct B1NodeProfile {
+        /* indexed by BUS1_MSG_* - 1 */
+        uint64_t n_calls[3];
+        uint64_t n_ns[3];
+        uint64_t buckets[3][B1_NODE_PROFILE_N]; /* log2 of the duration in ns */
+};
+
+typedef struct B1NodeObject B1NodeObject;
+
+struct B1NodeObject {
+        void *userdata;
+        uint32_t generation; /* upper half of the object id */
+        uint32_t next; /* next free slot, or B1_NODE_OBJECT_LIVE */
+};
+
+#define B1_NODE_OBJECT_LIVE ((uint32_t)-1)
+#define B1_NODE_OBJECT_END ((uint32_t)-2)
+
 struct B1Node {
         B1Peer *owner;
         B1Handle *handle;
         uint64_t id;
 
         CRBNode rb_nodes;
+        struct B1Site *site; /* allocation site, if tracked */
+        B1Policy *policy;
+
+        B1NodeFn fn;
+        void *userdata;
+        B1NodeProfile *profile; /* allocated on first profiled call */
+
+        B1ObjectFn object_fn;
+        B1NodeObject *objects; /* indexed by the lower half of the object id */
+        uint32_t n_objects; /* slots in use or on the free list */
+        uint32_t n_objects_max;
+        uint32_t i_objects_free; /* first free slot, or B1_NODE_OBJECT_END */
 };
 
 int b1_handle_acquire(B1Peer *peer, B1Handle **handlep, uint64_t handle_id);
@@ -39,3 +72,5 @@ B1Handle *b1_handle_lookup(B1Peer *peer, uint64_t id);
 
 int b1_node_link(B1Node *node, uint64_t id);
 B1Node *b1_node_lookup(B1Peer *peer, uint64_t id);
+
+void b1_node_profile(B1Node *node, unsigned int type, uint64_t n_ns);
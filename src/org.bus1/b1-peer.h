@@ -23,10 +23,88 @@
 extern "C" {
 #endif
 
+typedef struct B1Context B1Context;
+typedef struct B1Credentials B1Credentials;
 typedef struct B1Handle B1Handle;
+typedef struct B1HandleCache B1HandleCache;
 typedef struct B1Message B1Message;
+typedef struct B1MessageSend B1MessageSend;
 typedef struct B1Node B1Node;
 typedef struct B1Peer B1Peer;
+typedef struct B1Policy B1Policy;
+typedef struct B1Region B1Region;
+typedef struct B1RegionPool B1RegionPool;
+typedef struct B1Timer B1Timer;
+
+enum {
+        B1_PEER_LIMIT_HANDLES,
+        B1_PEER_LIMIT_NODES,
+        B1_PEER_LIMIT_MESSAGES,
+        B1_PEER_LIMIT_BUFFERS,
+        _B1_PEER_LIMIT_N,
+};
+
+enum {
+        B1_HOOK_SEND,
+        B1_HOOK_RECV,
+        _B1_HOOK_N,
+};
+
+struct B1MessageSend {
+        B1Message *message;
+        B1Handle **destinations;
+        size_t n_destinations;
+};
+
+typedef int (*B1HookFn) (B1Message *message,
+                         B1Handle **destinations,
+                         size_t n_destinations,
+                         void *userdata);
+
+typedef int (*B1NotifyFn) (B1Peer *peer,
+                           unsigned int type,
+                           B1Node *node,
+                           B1Handle *handle,
+                           void *userdata);
+
+typedef int (*B1NodeFn) (B1Node *node,
+                         B1Message *message,
+                         void *userdata);
+
+typedef int (*B1ObjectFn) (B1Node *node,
+                           uint64_t object,
+                           B1Message *message,
+                           void *userdata);
+
+typedef void (*B1WatchdogFn) (B1Peer *peer,
+                              B1Node *node,
+                              unsigned int type,
+                              uint64_t n_ns,
+                              void * const *frames,
+                              size_t n_frames,
+                              void *userdata);
+
+typedef int (*B1HandleCacheFn) (B1HandleCache *cache,
+                                uint64_t key,
+                                B1Handle **handlep,
+                                void *userdata);
+
+typedef void (*B1ContextFn) (B1Peer *peer,
+                             B1Message *message,
+                             void *userdata);
+
+typedef void (*B1TimerFn) (B1Timer *timer,
+                           void *userdata);
+
+enum {
+        B1_PEER_DUMP_JSON               = 1U << 0,
+        B1_PEER_DUMP_DETAILS            = 1U << 1,
+        B1_PEER_DUMP_SITES              = 1U << 2,
+};
+
+enum {
+        B1_NODE_PROFILE_N               = 32,
+};
 
 /* peers */
 
@@ -35,24 +113,66 @@ int b1_peer_new_from_fd(B1Peer **peerp, int fd);
 B1Peer *b1_peer_ref(B1Peer *peer);
 B1Peer *b1_peer_unref(B1Peer *peer);
 
+int b1_peer_shutdown(B1Peer *peer);
+
 int b1_peer_get_fd(B1Peer *peer);
 
+int b1_peer_export(B1Peer *peer, int socket_fd);
+int b1_peer_import(B1Peer **peerp,
+                   int socket_fd,
+                   B1Node ***nodesp,
+                   size_t *n_nodesp,
+                   B1Handle ***handlesp,
+                   size_t *n_handlesp);
+
 int b1_peer_recv(B1Peer *peer, B1Message **messagep);
+int b1_peer_dispatch(B1Peer *peer, B1Message **messagep);
+int b1_peer_set_profiling(B1Peer *peer, bool enable);
+int b1_peer_set_watchdog(B1Peer *peer, uint64_t budget_ns, B1WatchdogFn fn, void *userdata);
+int b1_peer_gather(B1Peer *peer,
+                   B1Message *request,
+                   B1Handle **dests,
+                   size_t n_dests,
+                   const int *timeouts_ms,
+                   B1Message **replies,
+                   size_t *n_repliesp);
 
 int b1_peer_set_seed(B1Peer *peer, B1Message *seed);
 int b1_peer_get_seed(B1Peer *peer, B1Message **seedp);
 
+int b1_peer_set_limit(B1Peer *peer, unsigned int limit, size_t max);
+int b1_peer_get_limit(B1Peer *peer,
+                      unsigned int limit,
+                      size_t *maxp,
+                      size_t *usagep,
+                      uint64_t *n_exceededp);
+
+int b1_peer_compact(B1Peer *peer);
+int b1_peer_set_auto_compact(B1Peer *peer, unsigned int n_idle);
+
+int b1_peer_dump(B1Peer *peer, int fd, unsigned int flags);
+int b1_peer_set_track_sites(B1Peer *peer, bool enable);
+
+int b1_peer_add_hook(B1Peer *peer, unsigned int hook, B1HookFn fn, void *userdata);
+int b1_peer_remove_hook(B1Peer *peer, unsigned int hook, B1HookFn fn, void *userdata);
+
+uint64_t b1_peer_get_n_dropped(B1Peer *peer);
+
+int b1_peer_set_notify_fn(B1Peer *peer, B1NotifyFn fn, void *userdata);
+
 /* messages */
 
 int b1_message_new(B1Peer *peer, B1Message **messagep);
 B1Message *b1_message_ref(B1Message *message);
 B1Message *b1_message_unref(B1Message *message);
+int b1_message_clone(B1Message *message, B1Message **clonep);
 
 int b1_message_set_payload(B1Message *message, struct iovec *vecs, size_t n_vecs);
 int b1_message_set_handles(B1Message *message, B1Handle **handles, size_t n_handles);
 int b1_message_set_fds(B1Message *message, int *fds, size_t n_fds);
 
 int b1_message_send(B1Message *message, B1Handle **dests, size_t n_dests);
+int b1_messages_send(B1MessageSend *sends, size_t n_sends, size_t *n_sentp);
 
 uid_t b1_message_get_uid(B1Message *message);
 gid_t b1_message_get_gid(B1Message *message);
@@ -64,9 +184,13 @@ B1Node *b1_message_get_destination_node(B1Message *message);
 B1Handle *b1_message_get_destination_handle(B1Message *message);
 
 int b1_message_get_payload(B1Message *message, struct iovec **vecsp, size_t *n_vecsp);
+int b1_message_write(B1Message *message, int fd);
 int b1_message_get_handle(B1Message *message, unsigned int index, B1Handle **handlep);
 int b1_message_get_fd(B1Message *message, unsigned int index, int *fdp);
 
+int b1_message_set_object(B1Message *message, uint64_t object);
+uint64_t b1_message_get_object(B1Message *message);
+
 /* nodes */
 
 int b1_node_new(B1Peer *peer, B1Node **nodep);
@@ -74,6 +198,19 @@ B1Node *b1_node_free(B1Node *node);
 
 B1Peer *b1_node_get_peer(B1Node *node);
 B1Handle *b1_node_get_handle(B1Node *node);
+uint64_t b1_node_get_id(B1Node *node);
+
+int b1_node_set_handler(B1Node *node, B1NodeFn fn, void *userdata);
+int b1_node_get_profile(B1Node *node,
+                        unsigned int type,
+                        uint64_t *n_callsp,
+                        uint64_t *n_nsp,
+                        uint64_t buckets[B1_NODE_PROFILE_N]);
+
+int b1_node_set_object_handler(B1Node *node, B1ObjectFn fn);
+int b1_node_add_object(B1Node *node, void *userdata, uint64_t *objectp);
+int b1_node_remove_object(B1Node *node, uint64_t object);
+int b1_node_get_object(B1Node *node, uint64_t object, void **userdatap);
 
 int b1_node_destroy(B1Node *node);
 
@@ -85,6 +222,98 @@ B1Handle *b1_handle_unref(B1Handle *handle);
 int b1_handle_transfer(B1Handle *src_handle, B1Peer *dst, B1Handle **dst_handlep);
 
 B1Peer *b1_handle_get_peer(B1Handle *handle);
+uint64_t b1_handle_get_id(B1Handle *handle);
+
+/* handle caches */
+
+int b1_handle_cache_new(B1Peer *peer,
+                        B1HandleCache **cachep,
+                        size_t max,
+                        B1HandleCacheFn refill_fn,
+                        void *userdata);
+B1HandleCache *b1_handle_cache_free(B1HandleCache *cache);
+
+int b1_handle_cache_put(B1HandleCache *cache, uint64_t key, B1Handle *handle);
+int b1_handle_cache_get(B1HandleCache *cache, uint64_t key, B1Handle **handlep);
+int b1_handle_cache_remove(B1HandleCache *cache, uint64_t key);
+
+void b1_handle_cache_get_stats(B1HandleCache *cache,
+                               size_t *n_entriesp,
+                               uint64_t *n_hitsp,
+                               uint64_t *n_missesp,
+                               uint64_t *n_evictedp);
+
+/* contexts */
+
+int b1_context_new(B1Context **contextp, unsigned int n_threads);
+B1Context *b1_context_free(B1Context *context);
+
+int b1_context_add_peer(B1Context *context, B1Peer *peer, B1ContextFn fn, void *userdata);
+int b1_context_remove_peer(B1Context *context, B1Peer *peer);
+
+int b1_timer_new(B1Context *context, B1Timer **timerp, B1TimerFn fn, void *userdata);
+B1Timer *b1_timer_free(B1Timer *timer);
+
+int b1_timer_arm(B1Timer *timer, uint64_t timeout_ns);
+
+/* regions */
+
+int b1_region_new(B1Peer *peer, B1Region **regionp, size_t size);
+int b1_region_new_from_fd(B1Peer *peer, B1Region **regionp, int fd);
+B1Region *b1_region_ref(B1Region *region);
+B1Region *b1_region_unref(B1Region *region);
+
+int b1_region_get_fd(B1Region *region);
+void *b1_region_get_data(B1Region *region);
+size_t b1_region_get_size(B1Region *region);
+
+int b1_region_bind(B1Region *region, B1Message *message, uint64_t id);
+int b1_region_unbind(B1Region *region);
+
+int b1_region_resolve(B1Region *region, uint64_t offset, uint64_t length, const void **datap);
+int b1_message_resolve_region(B1Message *message,
+                              uint64_t id,
+                              uint64_t offset,
+                              uint64_t length,
+                              const void **datap);
+
+int b1_region_pool_new(B1Peer *peer, B1RegionPool **poolp);
+B1RegionPool *b1_region_pool_free(B1RegionPool *pool);
+
+int b1_region_pool_acquire(B1RegionPool *pool,
+                           size_t size,
+                           B1Handle *destination,
+                           B1Region **regionp,
+                           uint64_t *idp);
+int b1_region_pool_release(B1RegionPool *pool, uint64_t id, B1Handle *destination);
+int b1_region_pool_trim(B1RegionPool *pool);
+
+int b1_region_send_release(B1Handle *destination, B1Node *node, uint64_t id);
+int b1_message_get_region_release(B1Message *message, uint64_t *idp, B1Handle **destinationp);
+
+/* credentials */
+
+B1Credentials *b1_credentials_ref(B1Credentials *credentials);
+B1Credentials *b1_credentials_unref(B1Credentials *credentials);
+
+pid_t b1_credentials_get_pid(B1Credentials *credentials);
+uint64_t b1_credentials_get_start_time(B1Credentials *credentials);
+const char *b1_credentials_get_exe(B1Credentials *credentials);
+const char *b1_credentials_get_cgroup(B1Credentials *credentials);
+uint64_t b1_credentials_get_capabilities(B1Credentials *credentials);
+
+int b1_message_get_credentials(B1Message *message, B1Credentials **credentialsp);
+int b1_peer_invalidate_credentials(B1Peer *peer, pid_t pid);
+
+/* policies */
+
+int b1_policy_new_from_string(B1Policy **policyp, const char *string);
+B1Policy *b1_policy_ref(B1Policy *policy);
+B1Policy *b1_policy_unref(B1Policy *policy);
+
+int b1_peer_set_policy(B1Peer *peer, B1Policy *policy);
+int b1_node_set_policy(B1Node *node, B1Policy *policy);
+uint64_t b1_peer_get_n_denied(B1Peer *peer);
 
 /* inline helpers */
 
@@ -108,6 +337,41 @@ static inline void b1_handle_unrefp(B1Handle **handle) {
                 b1_handle_unref(*handle);
 }
 
+static inline void b1_handle_cache_freep(B1HandleCache **cache) {
+        if (*cache)
+                b1_handle_cache_free(*cache);
+}
+
+static inline void b1_context_freep(B1Context **context) {
+        if (*context)
+                b1_context_free(*context);
+}
+
+static inline void b1_timer_freep(B1Timer **timer) {
+        if (*timer)
+                b1_timer_free(*timer);
+}
+
+static inline void b1_region_unrefp(B1Region **region) {
+        if (*region)
+                b1_region_unref(*region);
+}
+
+static inline void b1_region_pool_freep(B1RegionPool **pool) {
+        if (*pool)
+                b1_region_pool_free(*pool);
+}
+
+static inline void b1_credentials_unrefp(B1Credentials **credentials) {
+        if (*credentials)
+                b1_credentials_unref(*credentials);
+}
+
+static inline void b1_policy_unrefp(B1Policy **policy) {
+        if (*policy)
+                b1_policy_unref(*policy);
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -11,11 +11,24 @@
 #include <c-macro.h>
 #include <c-rbtree.h>
 #include <errno.h>
+#include "credentials.h"
 #include "message.h"
 #include "node.h"
 #include "peer.h"
+#include "policy.h"
+#include "watchdog.h"
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
 
 /**
  * b1_peer_new() - creates a new disconnected peer
@@ -34,6 +47,10 @@ _c_public_ int b1_peer_new(B1Peer **peerp) {
                 return -ENOMEM;
 
         peer->ref = (CRef)C_REF_INIT;
+        pthread_mutex_init(&peer->lock, NULL);
+
+        for (unsigned int i = 0; i < _B1_PEER_LIMIT_N; i++)
+                peer->budgets[i].max = SIZE_MAX;
 
         r = bus1_peer_new_from_path(&peer->peer, NULL);
         if (r < 0)
@@ -68,6 +85,10 @@ _c_public_ int b1_peer_new_from_fd(B1Peer **peerp, int fd) {
                 return -ENOMEM;
 
         peer->ref = (CRef)C_REF_INIT;
+        pthread_mutex_init(&peer->lock, NULL);
+
+        for (unsigned int i = 0; i < _B1_PEER_LIMIT_N; i++)
+                peer->budgets[i].max = SIZE_MAX;
 
         r = bus1_peer_new_from_fd(&peer->peer, fd);
         if (r < 0)
@@ -96,12 +117,48 @@ _c_public_ B1Peer *b1_peer_ref(B1Peer *peer) {
         return peer;
 }
 
+static void b1_peer_free_scratch(B1Peer *peer) {
+        if (!peer->scratch)
+                return;
+
+        b1_peer_uncharge(peer, B1_PEER_LIMIT_BUFFERS, peer->n_scratch);
+        free(peer->scratch);
+        peer->scratch = NULL;
+        B1_COUNTER_SET(peer->n_scratch, 0);
+}
+
 static void b1_peer_free(CRef *ref, void *userdata) {
         B1Peer *peer = userdata;
+        CRBNode *n;
 
         assert(!c_rbtree_first(&peer->handles));
         assert(!c_rbtree_first(&peer->nodes));
+        assert(!c_rbtree_first(&peer->slices));
+        assert(!c_rbtree_first(&peer->regions));
+        b1_watchdog_free(peer->watchdog);
+        b1_credentials_flush(peer);
+        b1_peer_free_scratch(peer);
+        b1_peer_uncharge(peer, B1_PEER_LIMIT_BUFFERS, peer->n_pending_max * sizeof(*peer->pending));
+        free(peer->pending);
+        for (unsigned int i = 0; i < _B1_PEER_LIMIT_N; i++)
+                assert(!peer->budgets[i].usage);
+
+        for (unsigned int i = 0; i < _B1_HOOK_N; i++)
+                free(peer->hooks[i]);
+
+        assert(!peer->n_node_policies);
+        b1_policy_unref(peer->policy);
+
+        while ((n = c_rbtree_first(&peer->sites))) {
+                B1Site *site = c_container_of(n, B1Site, rb);
+
+                assert(!site->n_live);
+                c_rbtree_remove(&peer->sites, n);
+                free(site);
+        }
+
         bus1_peer_free(peer->peer);
+        pthread_mutex_destroy(&peer->lock);
         free(peer);
 }
 
@@ -118,6 +175,426 @@ _c_public_ B1Peer *b1_peer_unref(B1Peer *peer) {
         return NULL;
 }
 
+static void b1_peer_discard(B1Peer *peer, struct bus1_cmd_recv *recv) {
+        b1_message_discard_slice(peer,
+                                 bus1_peer_slice_from_offset(peer->peer, recv->msg.offset),
+                                 recv->msg.n_bytes,
+                                 recv->msg.n_handles,
+                                 recv->msg.n_fds);
+}
+
+static void b1_peer_flush(B1Peer *peer) {
+        CRBNode *n;
+
+        /*
+         * Forget all kernel state tracked on @peer, without telling the
+         * kernel. Any object still referenced by the caller stays valid, but
+         * is no longer linked to a kernel object, and can only be released.
+         */
+
+        pthread_mutex_lock(&peer->lock);
+
+        while ((n = c_rbtree_first(&peer->nodes))) {
+                B1Node *node = c_container_of(n, B1Node, rb_nodes);
+
+                c_rbtree_remove_init(&peer->nodes, n);
+                node->id = BUS1_HANDLE_INVALID;
+        }
+
+        while ((n = c_rbtree_first(&peer->handles))) {
+                B1Handle *handle = c_container_of(n, B1Handle, rb);
+
+                c_rbtree_remove_init(&peer->handles, n);
+                handle->id = BUS1_HANDLE_INVALID;
+                handle->live = false;
+        }
+
+        while ((n = c_rbtree_first(&peer->slices)))
+                c_rbtree_remove_init(&peer->slices, n);
+
+        B1_COUNTER_SET(peer->n_slices, 0);
+        B1_COUNTER_SET(peer->n_slice_bytes, 0);
+
+        pthread_mutex_unlock(&peer->lock);
+
+        peer->i_pending = 0;
+        peer->n_pending = 0;
+        peer->n_idle = 0;
+}
+
+/**
+ * b1_peer_shutdown() - tear down all kernel state of a peer
+ * @peer:               the peer to shut down
+ *
+ * This resets @peer in the kernel with a single call: all its nodes are
+ * destroyed, all its handles released, all queued messages dropped and all
+ * slices in its pool released. Afterwards, the library-side bookkeeping is
+ * dropped without any further kernel round-trips.
+ *
+ * Nodes, handles and messages still referenced by the caller stay valid, but
+ * are disconnected from the kernel. The only valid operation on them is to
+ * release them, which no longer causes any kernel calls. The payload of any
+ * retained message must not be accessed after this returns.
+ *
+ * The peer itself remains connected and can be used to create new objects.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_peer_shutdown(B1Peer *peer) {
+        int r;
+
+        /* queued messages carry installed fds, which the reset cannot close */
+        for (size_t i = peer->i_pending; i < peer->n_pending; i++)
+                b1_peer_discard(peer, &peer->pending[i]);
+        peer->i_pending = 0;
+        peer->n_pending = 0;
+
+        r = bus1_peer_reset(peer->peer, 0);
+        if (r < 0)
+                return r;
+
+        b1_peer_flush(peer);
+
+        return 0;
+}
+
+#define B1_PEER_EXPORT_MAGIC UINT64_C(0x7845726565503142) /* "B1PeerEx" */
+
+enum {
+        B1_PEER_EXPORT_NODE             = 1ULL << 0,
+        B1_PEER_EXPORT_LIVE             = 1ULL << 1,
+};
+
+typedef struct B1PeerExportEntry {
+        uint64_t id;
+        uint64_t flags;
+} B1PeerExportEntry;
+
+typedef struct B1PeerExportHeader {
+        uint64_t magic;
+        uint64_t n_entries;
+} B1PeerExportHeader;
+
+/**
+ * b1_peer_export() - hand a peer over to another process
+ * @peer:               the peer to export
+ * @socket_fd:          connected AF_UNIX stream socket to the successor
+ *
+ * This passes the file descriptor of @peer, together with the ids and state of
+ * all its nodes and handles, over @socket_fd, so that the successor can pick
+ * up the peer with b1_peer_import() without a single kernel round-trip, and
+ * without any of the other peers noticing.
+ *
+ * Only the node and handle bookkeeping is transferred. Hooks, policies,
+ * budgets and other per-process state must be set up again by the successor.
+ * All received messages, including those queued by b1_peer_gather(), must have
+ * been released before the export, otherwise -EBUSY is returned.
+ *
+ * On success, @peer is disconnected from the kernel, just like after
+ * b1_peer_shutdown(), but without resetting the kernel state: the successor
+ * owns it now. All nodes and handles of @peer can only be released.
+ *
+ * Return: 0 on success, and a negative error code on failure.
+ */
+_c_public_ int b1_peer_export(B1Peer *peer, int socket_fd) {
+        union {
+                struct cmsghdr cmsg;
+                char buffer[CMSG_SPACE(sizeof(int))];
+        } control = {};
+        B1PeerExportHeader *header;
+        B1PeerExportEntry *entries;
+        struct cmsghdr *cmsg;
+        struct msghdr msg = {};
+        struct iovec vec;
+        size_t n_entries = 0, size, offset;
+        uint8_t *data;
+        ssize_t l;
+        CRBNode *n;
+        int r;
+
+        if (c_rbtree_first(&peer->slices) || peer->n_pending)
+                return -EBUSY;
+
+        for (n = c_rbtree_first(&peer->handles); n; n = c_rbnode_next(n))
+                ++n_entries;
+
+        size = sizeof(*header) + n_entries * sizeof(*entries);
+        data = malloc(size);
+        if (!data)
+                return -ENOMEM;
+
+        header = (B1PeerExportHeader *)data;
+        header->magic = B1_PEER_EXPORT_MAGIC;
+        header->n_entries = n_entries;
+
+        entries = (B1PeerExportEntry *)(header + 1);
+        for (n = c_rbtree_first(&peer->handles); n; n = c_rbnode_next(n)) {
+                B1Handle *handle = c_container_of(n, B1Handle, rb);
+
+                entries->id = handle->id;
+                entries->flags = 0;
+                if (handle->node)
+                        entries->flags |= B1_PEER_EXPORT_NODE;
+                if (handle->live)
+                        entries->flags |= B1_PEER_EXPORT_LIVE;
+
+                ++entries;
+        }
+
+        /* the fd goes with the first chunk, the rest is streamed after it */
+        vec.iov_base = data;
+        vec.iov_len = size;
+        msg.msg_iov = &vec;
+        msg.msg_iovlen = 1;
+        msg.msg_control = &control;
+        msg.msg_controllen = sizeof(control);
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        *(int *)CMSG_DATA(cmsg) = bus1_peer_get_fd(peer->peer);
+
+        l = sendmsg(socket_fd, &msg, MSG_NOSIGNAL);
+        if (l < 0) {
+                r = -errno;
+                goto exit;
+        }
+
+        for (offset = l; offset < size; offset += l) {
+                l = send(socket_fd, data + offset, size - offset, MSG_NOSIGNAL);
+                if (l < 0) {
+                        if (errno == EINTR) {
+                                l = 0;
+                                continue;
+                        }
+
+                        r = -errno;
+                        goto exit;
+                }
+        }
+
+        b1_peer_flush(peer);
+        r = 0;
+
+exit:
+        free(data);
+        return r;
+}
+
+static int b1_peer_import_read(int socket_fd, void *data, size_t size) {
+        ssize_t l;
+
+        for (size_t offset = 0; offset < size; offset += l) {
+                l = recv(socket_fd, (uint8_t *)data + offset, size - offset, MSG_WAITALL);
+                if (l < 0) {
+                        if (errno == EINTR) {
+                                l = 0;
+                                continue;
+                        }
+
+                        return -errno;
+                } else if (l == 0) {
+                        return -EPIPE;
+                }
+        }
+
+        return 0;
+}
+
+static int b1_peer_import_entry(B1Peer *peer, B1PeerExportEntry *entry, B1Node **nodep, B1Handle **handlep) {
+        B1Handle *handle;
+        B1Node *node;
+        int r;
+
+        if (entry->id == BUS1_HANDLE_INVALID ||
+            (entry->flags & ~(B1_PEER_EXPORT_NODE | B1_PEER_EXPORT_LIVE)) ||
+            b1_handle_lookup(peer, entry->id))
+                return -EBADMSG;
+
+        if (entry->flags & B1_PEER_EXPORT_NODE) {
+                r = b1_node_new(peer, &node);
+                if (r < 0)
+                        return r;
+
+                r = b1_node_link(node, entry->id);
+                if (r < 0) {
+                        b1_node_free(node);
+                        return -EBADMSG;
+                }
+
+                handle = node->handle;
+
+                r = b1_handle_link(handle, entry->id);
+                assert(r >= 0);
+
+                if (entry->flags & B1_PEER_EXPORT_LIVE) {
+                        pthread_mutex_lock(&peer->lock);
+                        handle->ref_kernel = (CRef)C_REF_INIT;
+                        handle->live = true;
+                        pthread_mutex_unlock(&peer->lock);
+                }
+
+                *nodep = node;
+        } else {
+                /* an unknown id creates a new handle, without any kernel call */
+                r = b1_handle_acquire(peer, &handle, entry->id);
+                if (r < 0)
+                        return r;
+
+                if (!(entry->flags & B1_PEER_EXPORT_LIVE)) {
+                        pthread_mutex_lock(&peer->lock);
+                        handle->live = false;
+                        pthread_mutex_unlock(&peer->lock);
+                }
+
+                *handlep = handle;
+        }
+
+        return 0;
+}
+
+/**
+ * b1_peer_import() - take over a peer from another process
+ * @peerp:              the new peer object
+ * @socket_fd:          connected AF_UNIX stream socket to the predecessor
+ * @nodesp:             pointer to the array of imported nodes
+ * @n_nodesp:           pointer to the number of imported nodes
+ * @handlesp:           pointer to the array of imported handles
+ * @n_handlesp:         pointer to the number of imported handles
+ *
+ * This receives a peer exported by b1_peer_export() from @socket_fd, and
+ * reconstructs all its nodes and handles from the transferred state, without
+ * any kernel round-trips. The ids of the returned objects, as returned by
+ * b1_node_get_id() and b1_handle_get_id(), are the same as in the
+ * predecessor, so it can pass along whatever application state it associated
+ * with them.
+ *
+ * The caller owns the returned nodes, one reference to each returned handle,
+ * and both arrays, which must be released with free(). The handles of the
+ * returned nodes are not part of @handlesp.
+ *
+ * Return: 0 on success, and a negative error code on failure.
+ */
+_c_public_ int b1_peer_import(B1Peer **peerp,
+                              int socket_fd,
+                              B1Node ***nodesp,
+                              size_t *n_nodesp,
+                              B1Handle ***handlesp,
+                              size_t *n_handlesp) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *peer = NULL;
+        union {
+                struct cmsghdr cmsg;
+                char buffer[CMSG_SPACE(sizeof(int))];
+        } control = {};
+        B1PeerExportEntry *entries = NULL;
+        B1PeerExportHeader header;
+        B1Handle **handles = NULL;
+        B1Node **nodes = NULL;
+        size_t n_nodes = 0, n_handles = 0;
+        struct cmsghdr *cmsg;
+        struct msghdr msg = {};
+        struct iovec vec;
+        ssize_t l;
+        int r, fd = -1;
+
+        vec.iov_base = &header;
+        vec.iov_len = sizeof(header);
+        msg.msg_iov = &vec;
+        msg.msg_iovlen = 1;
+        msg.msg_control = &control;
+        msg.msg_controllen = sizeof(control);
+
+        l = recvmsg(socket_fd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+        if (l < 0)
+                return -errno;
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (cmsg->cmsg_level == SOL_SOCKET &&
+                    cmsg->cmsg_type == SCM_RIGHTS &&
+                    cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+                        fd = *(int *)CMSG_DATA(cmsg);
+                        break;
+                }
+        }
+
+        if (fd < 0)
+                return -EBADMSG;
+
+        if (msg.msg_flags & MSG_CTRUNC) {
+                close(fd);
+                return -EBADMSG;
+        }
+
+        r = b1_peer_import_read(socket_fd, (uint8_t *)&header + l, sizeof(header) - l);
+        if (r < 0) {
+                close(fd);
+                return r;
+        }
+
+        if (header.magic != B1_PEER_EXPORT_MAGIC ||
+            header.n_entries > SIZE_MAX / sizeof(*entries)) {
+                close(fd);
+                return -EBADMSG;
+        }
+
+        r = b1_peer_new_from_fd(&peer, fd);
+        if (r < 0)
+                return r;
+
+        entries = malloc(header.n_entries * sizeof(*entries) ?: 1);
+        nodes = calloc(header.n_entries ?: 1, sizeof(*nodes));
+        handles = calloc(header.n_entries ?: 1, sizeof(*handles));
+        if (!entries || !nodes || !handles) {
+                r = -ENOMEM;
+                goto error;
+        }
+
+        r = b1_peer_import_read(socket_fd, entries, header.n_entries * sizeof(*entries));
+        if (r < 0)
+                goto error;
+
+        for (size_t i = 0; i < header.n_entries; i++) {
+                B1Node *node = NULL;
+                B1Handle *handle = NULL;
+
+                r = b1_peer_import_entry(peer, &entries[i], &node, &handle);
+                if (r < 0)
+                        goto error;
+
+                if (node)
+                        nodes[n_nodes++] = node;
+                else
+                        handles[n_handles++] = handle;
+        }
+
+        free(entries);
+
+        *peerp = peer;
+        peer = NULL;
+        *nodesp = nodes;
+        *n_nodesp = n_nodes;
+        *handlesp = handles;
+        *n_handlesp = n_handles;
+
+        return 0;
+
+error:
+        /* the predecessor may still be around, so never touch the kernel */
+        b1_peer_flush(peer);
+
+        for (size_t i = 0; i < n_handles; i++)
+                b1_handle_unref(handles[i]);
+        for (size_t i = 0; i < n_nodes; i++)
+                b1_node_free(nodes[i]);
+
+        free(handles);
+        free(nodes);
+        free(entries);
+
+        return r;
+}
+
 /**
  * b1_peer_get_fd() - get file descriptor representing peer in the kernel
  * @peer:               the peer
@@ -128,47 +605,1256 @@ _c_public_ int b1_peer_get_fd(B1Peer *peer) {
         return bus1_peer_get_fd(peer->peer);
 }
 
+/**
+ * b1_peer_set_limit() - set a resource budget of a peer
+ * @peer:               the peer
+ * @limit:              the budget to modify, B1_PEER_LIMIT_*
+ * @max:                the new maximum
+ *
+ * Every peer accounts the library-side state it holds: B1_PEER_LIMIT_HANDLES
+ * and B1_PEER_LIMIT_NODES count handle and node objects,
+ * B1_PEER_LIMIT_MESSAGES counts message objects (both created and received),
+ * and B1_PEER_LIMIT_BUFFERS counts the bytes of internal arrays and scratch
+ * buffers allocated on behalf of the peer. Once a budget is exhausted, any
+ * operation that would allocate more fails with -EDQUOT. By default, all
+ * budgets are unlimited.
+ *
+ * Lowering a budget below its current usage is allowed, it only affects
+ * future allocations.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_peer_set_limit(B1Peer *peer, unsigned int limit, size_t max) {
+        if (limit >= _B1_PEER_LIMIT_N)
+                return -EINVAL;
+
+        B1_COUNTER_SET(peer->budgets[limit].max, max);
+
+        return 0;
+}
+
+/**
+ * b1_peer_get_limit() - query a resource budget of a peer
+ * @peer:               the peer
+ * @limit:              the budget to query, B1_PEER_LIMIT_*
+ * @maxp:               pointer to the maximum, or NULL
+ * @usagep:             pointer to the current usage, or NULL
+ * @n_exceededp:        pointer to the number of rejected allocations, or NULL
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_peer_get_limit(B1Peer *peer,
+                                 unsigned int limit,
+                                 size_t *maxp,
+                                 size_t *usagep,
+                                 uint64_t *n_exceededp) {
+        B1PeerBudget *budget;
+
+        if (limit >= _B1_PEER_LIMIT_N)
+                return -EINVAL;
+
+        budget = &peer->budgets[limit];
+
+        if (maxp)
+                *maxp = budget->max;
+        if (usagep)
+                *usagep = budget->usage;
+        if (n_exceededp)
+                *n_exceededp = budget->n_exceeded;
+
+        return 0;
+}
+
+int b1_peer_charge(B1Peer *peer, unsigned int limit, size_t n) {
+        B1PeerBudget *budget;
+
+        assert(peer);
+        assert(limit < _B1_PEER_LIMIT_N);
+
+        budget = &peer->budgets[limit];
+
+        if (n > budget->max || budget->usage > budget->max - n) {
+                B1_COUNTER_ADD(budget->n_exceeded, 1);
+                return -EDQUOT;
+        }
+
+        B1_COUNTER_ADD(budget->usage, n);
+
+        return 0;
+}
+
+void b1_peer_uncharge(B1Peer *peer, unsigned int limit, size_t n) {
+        assert(peer);
+        assert(limit < _B1_PEER_LIMIT_N);
+        assert(peer->budgets[limit].usage >= n);
+
+        B1_COUNTER_SUB(peer->budgets[limit].usage, n);
+}
+
+int b1_peer_reserve_scratch(B1Peer *peer, size_t size, void **scratchp) {
+        void *scratch;
+        int r;
+
+        if (_c_likely_(size <= peer->n_scratch)) {
+                *scratchp = peer->scratch;
+                return 0;
+        }
+
+        r = b1_peer_charge(peer, B1_PEER_LIMIT_BUFFERS, size - peer->n_scratch);
+        if (r < 0)
+                return r;
+
+        scratch = realloc(peer->scratch, size);
+        if (!scratch) {
+                b1_peer_uncharge(peer, B1_PEER_LIMIT_BUFFERS, size - peer->n_scratch);
+                return -ENOMEM;
+        }
+
+        peer->scratch = scratch;
+        B1_COUNTER_SET(peer->n_scratch, size);
+
+        *scratchp = scratch;
+        return 0;
+}
+
+/**
+ * b1_peer_compact() - return unused memory of a peer
+ * @peer:               the peer to compact
+ *
+ * This drops all cached scratch buffers and credentials of @peer and the pages
+ * of the pool that do not back any slice currently owned by one of the
+ * messages of @peer. Nothing observable changes for the caller, but the memory
+ * of a mostly idle peer is reduced to what is actually in use.
+ *
+ * The pool is owned by the kernel, so the unused pages are only dropped from
+ * the mapping of the caller via MADV_DONTNEED, which reduces its resident set
+ * size. The pages are faulted back in once a slice placed there is read. Any
+ * cache dropped is transparently re-allocated when needed. The pool is left
+ * alone while messages queued by b1_peer_gather() are pending.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_peer_compact(B1Peer *peer) {
+        const uint8_t *pool, *pos, *end;
+        size_t page_size;
+        CRBNode *n;
+        int r;
+
+        b1_peer_free_scratch(peer);
+        b1_credentials_flush(peer);
+
+        /* pending messages are not materialized, so their slices are unknown */
+        pool = bus1_peer_get_pool(peer->peer);
+        if (!pool || peer->n_pending)
+                return 0;
+
+        page_size = sysconf(_SC_PAGESIZE);
+        pos = pool;
+
+        for (n = c_rbtree_first(&peer->slices); ; n = c_rbnode_next(n)) {
+                const uint8_t *next;
+                uintptr_t from, to;
+
+                if (n) {
+                        B1Message *message = c_container_of(n, B1Message, rb_slices);
+
+                        next = message->slice;
+                        end = next + message->n_slice;
+                } else {
+                        next = pool + bus1_peer_get_pool_size(peer->peer);
+                        end = next;
+                }
+
+                from = c_align_to((uintptr_t)pos, page_size);
+                to = (uintptr_t)next & ~(uintptr_t)(page_size - 1);
+
+                if (from < to) {
+                        r = madvise((void *)from, to - from, MADV_DONTNEED);
+                        if (r < 0)
+                                return -errno;
+                }
+
+                if (!n)
+                        break;
+
+                if (end > pos)
+                        pos = end;
+        }
+
+        return 0;
+}
+
+/**
+ * b1_peer_set_auto_compact() - compact peer automatically when idle
+ * @peer:               the peer
+ * @n_idle:             number of empty receive attempts, or 0 to disable
+ *
+ * If enabled, @peer is compacted via b1_peer_compact() once @n_idle
+ * consecutive calls to b1_peer_recv() found the queue empty. The counter is
+ * reset whenever a message is received.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_peer_set_auto_compact(B1Peer *peer, unsigned int n_idle) {
+        peer->n_idle_max = n_idle;
+        peer->n_idle = 0;
+
+        return 0;
+}
+
+static int sites_compare(CRBTree *t, void *k, CRBNode *n) {
+        B1Site *site = c_container_of(n, B1Site, rb);
+        B1Site *key = k;
+
+        if (key->address < site->address)
+                return -1;
+        else if (key->address > site->address)
+                return 1;
+        else if (key->type < site->type)
+                return -1;
+        else if (key->type > site->type)
+                return 1;
+        else
+                return 0;
+}
+
+/**
+ * b1_peer_set_track_sites() - track allocation sites of objects
+ * @peer:               the peer
+ * @enable:             whether to enable tracking
+ *
+ * If enabled, every message, node and handle created on @peer records the
+ * address of the library call that created it. Objects are accounted per
+ * site and type, and the sites with live objects are reported by
+ * b1_peer_dump() if B1_PEER_DUMP_SITES is given. This is meant to find the
+ * origin of leaked objects. It costs one tree lookup per created object.
+ *
+ * Disabling tracking only affects objects created afterwards.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_peer_set_track_sites(B1Peer *peer, bool enable) {
+        peer->track_sites = enable;
+
+        return 0;
+}
+
+void b1_peer_track(B1Peer *peer, B1Site **sitep, unsigned int type, const void *address) {
+        B1Site key = { .address = address, .type = type }, *site;
+        CRBNode **slot, *p;
+
+        if (_c_likely_(!peer->track_sites) || *sitep)
+                return;
+
+        slot = c_rbtree_find_slot(&peer->sites, sites_compare, &key, &p);
+        if (slot) {
+                /* tracking is best-effort, silently skip on failure */
+                site = calloc(1, sizeof(*site));
+                if (!site)
+                        return;
+
+                site->address = address;
+                site->type = type;
+        } else {
+                site = c_container_of(p, B1Site, rb);
+        }
+
+        pthread_mutex_lock(&peer->lock);
+        if (slot)
+                c_rbtree_add(&peer->sites, p, slot, &site->rb);
+        ++site->n_live;
+        ++site->n_total;
+        pthread_mutex_unlock(&peer->lock);
+
+        *sitep = site;
+}
+
+void b1_peer_untrack(B1Peer *peer, B1Site **sitep) {
+        if (_c_likely_(!*sitep))
+                return;
+
+        pthread_mutex_lock(&peer->lock);
+        assert((*sitep)->n_live);
+        --(*sitep)->n_live;
+        pthread_mutex_unlock(&peer->lock);
+
+        *sitep = NULL;
+}
+
+/**
+ * b1_peer_add_hook() - register a message hook
+ * @peer:               the peer
+ * @hook:               the hook chain, B1_HOOK_*
+ * @fn:                 the hook function
+ * @userdata:           userdata passed to @fn
+ *
+ * Hooks of the B1_HOOK_SEND chain are called by b1_message_send() and
+ * b1_messages_send() for every message sent on @peer, before it is passed to
+ * the kernel, with the destinations of the message. A batch runs the hooks of
+ * all its messages before sending the first one. Hooks of the B1_HOOK_RECV
+ * chain are called by b1_peer_recv() for every message received on @peer,
+ * before it is returned to the caller, without destinations. The hooks may
+ * inspect the message with the usual accessors, but must not modify it. Send
+ * hooks may send other messages on @peer themselves.
+ *
+ * Hooks are called in the order they were registered. If a hook returns a
+ * negative error code, the remaining hooks are skipped, and the error code is
+ * returned by the calling operation, which is aborted. That is, the message
+ * is not sent, or the received message is dropped.
+ *
+ * Hooks may add and remove hooks of any chain while they run. Hooks added to
+ * the running chain are called for the current message, too, and hooks
+ * removed from it are not called anymore, starting with the current message.
+ *
+ * If no hook is registered on a chain, it costs a single branch.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_peer_add_hook(B1Peer *peer, unsigned int hook, B1HookFn fn, void *userdata) {
+        B1Hook *hooks;
+        size_t n_hooks;
+
+        if (hook >= _B1_HOOK_N || !fn)
+                return -EINVAL;
+
+        n_hooks = peer->n_hooks[hook];
+
+        hooks = realloc(peer->hooks[hook], (n_hooks + 1) * sizeof(*hooks));
+        if (!hooks)
+                return -ENOMEM;
+
+        hooks[n_hooks].fn = fn;
+        hooks[n_hooks].userdata = userdata;
+
+        peer->hooks[hook] = hooks;
+        peer->n_hooks[hook] = n_hooks + 1;
+
+        return 0;
+}
+
+/**
+ * b1_peer_remove_hook() - unregister a message hook
+ * @peer:               the peer
+ * @hook:               the hook chain, B1_HOOK_*
+ * @fn:                 the hook function
+ * @userdata:           userdata the hook was registered with
+ *
+ * This removes the first hook on the given chain that was registered with
+ * @fn and @userdata.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_peer_remove_hook(B1Peer *peer, unsigned int hook, B1HookFn fn, void *userdata) {
+        B1Hook *hooks;
+        size_t n_hooks;
+
+        if (hook >= _B1_HOOK_N)
+                return -EINVAL;
+
+        hooks = peer->hooks[hook];
+        n_hooks = peer->n_hooks[hook];
+
+        for (size_t i = 0; i < n_hooks; i++) {
+                if (hooks[i].fn != fn || hooks[i].userdata != userdata)
+                        continue;
+
+                memmove(hooks + i, hooks + i + 1, (n_hooks - i - 1) * sizeof(*hooks));
+                peer->n_hooks[hook] = n_hooks - 1;
+
+                /* keep running chains on the hook they would have run next */
+                for (B1HookRun *run = peer->hook_runs; run; run = run->next)
+                        if (run->hook == hook && i < run->i)
+                                --run->i;
+
+                return 0;
+        }
+
+        return -ENOENT;
+}
+
+/**
+ * b1_peer_get_n_dropped() - get the number of messages dropped by the kernel
+ * @peer:               the peer
+ *
+ * Return: the number of messages the kernel dropped for @peer so far, as
+ *         reported on receive.
+ */
+_c_public_ uint64_t b1_peer_get_n_dropped(B1Peer *peer) {
+        return peer->n_dropped;
+}
+
+/**
+ * b1_peer_set_notify_fn() - handle notifications with a callback
+ * @peer:               the peer
+ * @fn:                 the notification callback, or NULL
+ * @userdata:           userdata passed to @fn
+ *
+ * If set, node release and node destruction notifications are no longer
+ * returned as messages by b1_peer_recv(), but passed to @fn directly, without
+ * any message being allocated. @fn is called with the type of the
+ * notification (BUS1_MSG_NODE_*), and the same node and handle that
+ * b1_message_get_destination_node() and b1_message_get_destination_handle()
+ * would return for it. If @fn returns a negative error code, it is returned
+ * by b1_peer_recv().
+ *
+ * Passing NULL as @fn restores the default behavior.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_peer_set_notify_fn(B1Peer *peer, B1NotifyFn fn, void *userdata) {
+        peer->notify_fn = fn;
+        peer->notify_userdata = userdata;
+
+        return 0;
+}
+
+static int b1_peer_notify(B1Peer *peer, const struct bus1_cmd_recv *recv) {
+        B1Handle *handle = NULL;
+        B1Node *node;
+
+        node = b1_node_lookup(peer, recv->msg.destination);
+        if (recv->msg.type == BUS1_MSG_NODE_DESTROY)
+                handle = b1_handle_lookup(peer, recv->msg.destination);
+
+        return peer->notify_fn(peer, recv->msg.type, node, handle, peer->notify_userdata);
+}
+
+int b1_peer_run_hooks(B1Peer *peer,
+                      unsigned int hook,
+                      B1Message *message,
+                      B1Handle **destinations,
+                      size_t n_destinations) {
+        B1HookRun run = {
+                .hook = hook,
+                .next = peer->hook_runs,
+        };
+        B1Hook h;
+        int r = 0;
+
+        /*
+         * Hooks may add or remove hooks, so the chain is re-read for every
+         * hook, and b1_peer_remove_hook() moves the position of all runs of
+         * the chain back if it removes a hook that already ran.
+         */
+        peer->hook_runs = &run;
+
+        for (run.i = 0; run.i < peer->n_hooks[hook]; ) {
+                h = peer->hooks[hook][run.i++];
+
+                r = h.fn(message, destinations, n_destinations, h.userdata);
+                if (r < 0)
+                        break;
+        }
+
+        peer->hook_runs = run.next;
+
+        return r < 0 ? r : 0;
+}
+
+static const char * const b1_peer_limit_names[_B1_PEER_LIMIT_N] = {
+        [B1_PEER_LIMIT_HANDLES]         = "handles",
+        [B1_PEER_LIMIT_NODES]           = "nodes",
+        [B1_PEER_LIMIT_MESSAGES]        = "messages",
+        [B1_PEER_LIMIT_BUFFERS]         = "buffers",
+};
+
+static int b1_peer_dump_text(B1Peer *peer, int fd, bool details) {
+        CRBNode *n;
+
+        if (dprintf(fd, "peer fd=%d slices=%zu slice-bytes=%zu scratch-bytes=%zu denied=%" PRIu64 " dropped=%" PRIu64 "\n",
+                    bus1_peer_get_fd(peer->peer),
+                    B1_COUNTER_GET(peer->n_slices),
+                    B1_COUNTER_GET(peer->n_slice_bytes),
+                    B1_COUNTER_GET(peer->n_scratch),
+                    B1_COUNTER_GET(peer->n_denied),
+                    B1_COUNTER_GET(peer->n_dropped)) < 0)
+                return -errno;
+
+        for (unsigned int i = 0; i < _B1_PEER_LIMIT_N; i++)
+                if (dprintf(fd, "budget %s usage=%zu max=%zu exceeded=%" PRIu64 "\n",
+                            b1_peer_limit_names[i],
+                            B1_COUNTER_GET(peer->budgets[i].usage),
+                            B1_COUNTER_GET(peer->budgets[i].max),
+                            B1_COUNTER_GET(peer->budgets[i].n_exceeded)) < 0)
+                        return -errno;
+
+        if (!details)
+                return 0;
+
+        for (n = c_rbtree_first(&peer->nodes); n; n = c_rbnode_next(n)) {
+                B1Node *node = c_container_of(n, B1Node, rb_nodes);
+
+                if (dprintf(fd, "node id=%" PRIu64 "\n", node->id) < 0)
+                        return -errno;
+        }
+
+        for (n = c_rbtree_first(&peer->handles); n; n = c_rbnode_next(n)) {
+                B1Handle *handle = c_container_of(n, B1Handle, rb);
+
+                if (dprintf(fd, "handle id=%" PRIu64 " ref=%lu ref-kernel=%lu live=%d owner=%d\n",
+                            handle->id,
+                            __atomic_load_n(&handle->ref.n, __ATOMIC_RELAXED),
+                            handle->live ? __atomic_load_n(&handle->ref_kernel.n, __ATOMIC_RELAXED) : 0,
+                            handle->live,
+                            !!handle->node) < 0)
+                        return -errno;
+        }
+
+        for (n = c_rbtree_first(&peer->slices); n; n = c_rbnode_next(n)) {
+                B1Message *message = c_container_of(n, B1Message, rb_slices);
+
+                if (dprintf(fd, "slice offset=%" PRIu64 " size=%zu type=%" PRIu64 " ref=%lu\n",
+                            bus1_peer_slice_to_offset(peer->peer, message->slice),
+                            message->n_slice,
+                            message->type,
+                            __atomic_load_n(&message->ref.n, __ATOMIC_RELAXED)) < 0)
+                        return -errno;
+        }
+
+        return 0;
+}
+
+static int b1_peer_dump_sites_text(B1Peer *peer, int fd) {
+        CRBNode *n;
+
+        for (n = c_rbtree_first(&peer->sites); n; n = c_rbnode_next(n)) {
+                B1Site *site = c_container_of(n, B1Site, rb);
+
+                if (!site->n_live)
+                        continue;
+
+                if (dprintf(fd, "site address=%p type=%s live=%zu total=%" PRIu64 "\n",
+                            site->address,
+                            b1_peer_limit_names[site->type],
+                            site->n_live,
+                            site->n_total) < 0)
+                        return -errno;
+        }
+
+        return 0;
+}
+
+static int b1_peer_dump_json(B1Peer *peer, int fd, bool details, bool sites) {
+        const char *sep;
+        CRBNode *n;
+
+        if (dprintf(fd, "{\"fd\":%d,\"slices\":%zu,\"slice_bytes\":%zu,\"scratch_bytes\":%zu,\"denied\":%" PRIu64 ",\"dropped\":%" PRIu64 ",\"budgets\":{",
+                    bus1_peer_get_fd(peer->peer),
+                    B1_COUNTER_GET(peer->n_slices),
+                    B1_COUNTER_GET(peer->n_slice_bytes),
+                    B1_COUNTER_GET(peer->n_scratch),
+                    B1_COUNTER_GET(peer->n_denied),
+                    B1_COUNTER_GET(peer->n_dropped)) < 0)
+                return -errno;
+
+        for (unsigned int i = 0; i < _B1_PEER_LIMIT_N; i++)
+                if (dprintf(fd, "%s\"%s\":{\"usage\":%zu,\"max\":%zu,\"exceeded\":%" PRIu64 "}",
+                            i ? "," : "",
+                            b1_peer_limit_names[i],
+                            B1_COUNTER_GET(peer->budgets[i].usage),
+                            B1_COUNTER_GET(peer->budgets[i].max),
+                            B1_COUNTER_GET(peer->budgets[i].n_exceeded)) < 0)
+                        return -errno;
+
+        if (dprintf(fd, "}") < 0)
+                return -errno;
+
+        if (details) {
+                sep = "";
+                if (dprintf(fd, ",\"nodes\":[") < 0)
+                        return -errno;
+
+                for (n = c_rbtree_first(&peer->nodes); n; n = c_rbnode_next(n), sep = ",") {
+                        B1Node *node = c_container_of(n, B1Node, rb_nodes);
+
+                        if (dprintf(fd, "%s{\"id\":%" PRIu64 "}", sep, node->id) < 0)
+                                return -errno;
+                }
+
+                sep = "";
+                if (dprintf(fd, "],\"handles\":[") < 0)
+                        return -errno;
+
+                for (n = c_rbtree_first(&peer->handles); n; n = c_rbnode_next(n), sep = ",") {
+                        B1Handle *handle = c_container_of(n, B1Handle, rb);
+
+                        if (dprintf(fd, "%s{\"id\":%" PRIu64 ",\"ref\":%lu,\"ref_kernel\":%lu,\"live\":%s,\"owner\":%s}",
+                                    sep,
+                                    handle->id,
+                                    __atomic_load_n(&handle->ref.n, __ATOMIC_RELAXED),
+                                    handle->live ? __atomic_load_n(&handle->ref_kernel.n, __ATOMIC_RELAXED) : 0,
+                                    handle->live ? "true" : "false",
+                                    handle->node ? "true" : "false") < 0)
+                                return -errno;
+                }
+
+                sep = "";
+                if (dprintf(fd, "],\"slices\":[") < 0)
+                        return -errno;
+
+                for (n = c_rbtree_first(&peer->slices); n; n = c_rbnode_next(n), sep = ",") {
+                        B1Message *message = c_container_of(n, B1Message, rb_slices);
+
+                        if (dprintf(fd, "%s{\"offset\":%" PRIu64 ",\"size\":%zu,\"type\":%" PRIu64 ",\"ref\":%lu}",
+                                    sep,
+                                    bus1_peer_slice_to_offset(peer->peer, message->slice),
+                                    message->n_slice,
+                                    message->type,
+                                    __atomic_load_n(&message->ref.n, __ATOMIC_RELAXED)) < 0)
+                                return -errno;
+                }
+
+                if (dprintf(fd, "]") < 0)
+                        return -errno;
+        }
+
+        if (sites) {
+                sep = "";
+                if (dprintf(fd, ",\"sites\":[") < 0)
+                        return -errno;
+
+                for (n = c_rbtree_first(&peer->sites); n; n = c_rbnode_next(n)) {
+                        B1Site *site = c_container_of(n, B1Site, rb);
+
+                        if (!site->n_live)
+                                continue;
+
+                        if (dprintf(fd, "%s{\"address\":\"%p\",\"type\":\"%s\",\"live\":%zu,\"total\":%" PRIu64 "}",
+                                    sep,
+                                    site->address,
+                                    b1_peer_limit_names[site->type],
+                                    site->n_live,
+                                    site->n_total) < 0)
+                                return -errno;
+
+                        sep = ",";
+                }
+
+                if (dprintf(fd, "]") < 0)
+                        return -errno;
+        }
+
+        if (dprintf(fd, "}\n") < 0)
+                return -errno;
+
+        return 0;
+}
+
+/**
+ * b1_peer_dump() - write a description of the peer state
+ * @peer:               the peer to describe
+ * @fd:                 the file descriptor to write to
+ * @flags:              B1_PEER_DUMP_* flags
+ *
+ * This writes the resource usage of @peer to @fd, including its budgets,
+ * the owned pool slices and the cached scratch memory. If
+ * B1_PEER_DUMP_DETAILS is given, every linked node, handle (with its
+ * reference counts) and owned slice is listed as well. If B1_PEER_DUMP_SITES
+ * is given, every allocation site with live objects is listed (see
+ * b1_peer_set_track_sites()). The output is a
+ * line-based text format, or a single line of JSON if B1_PEER_DUMP_JSON is
+ * given.
+ *
+ * This neither allocates memory nor calls into the kernel, apart from writing
+ * to @fd, so it is cheap enough for production use. It may be called from a
+ * debug thread while @peer is in use by another thread, as long as the caller
+ * holds a reference to @peer. The counters are updated atomically and read
+ * without any lock. The node, handle, slice and site lists are written while
+ * holding a lock that the thread using @peer takes whenever it changes them,
+ * so a slow @fd stalls that thread as well. It must not be called from a
+ * signal handler that may interrupt a call on @peer.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_peer_dump(B1Peer *peer, int fd, unsigned int flags) {
+        bool lock = flags & (B1_PEER_DUMP_DETAILS | B1_PEER_DUMP_SITES);
+        int r;
+
+        if (lock)
+                pthread_mutex_lock(&peer->lock);
+
+        if (flags & B1_PEER_DUMP_JSON) {
+                r = b1_peer_dump_json(peer, fd, flags & B1_PEER_DUMP_DETAILS, flags & B1_PEER_DUMP_SITES);
+                goto exit;
+        }
+
+        r = b1_peer_dump_text(peer, fd, flags & B1_PEER_DUMP_DETAILS);
+        if (r < 0)
+                goto exit;
+
+        if (flags & B1_PEER_DUMP_SITES)
+                r = b1_peer_dump_sites_text(peer, fd);
+
+exit:
+        if (lock)
+                pthread_mutex_unlock(&peer->lock);
+        return r;
+}
+
+static int b1_peer_filter(B1Peer *peer, struct bus1_cmd_recv *recv) {
+        int r;
+
+        /* returns 1 if @recv is to be materialized, 0 if it was consumed */
+
+        if (recv->msg.type != BUS1_MSG_DATA &&
+            recv->msg.type != BUS1_MSG_NODE_DESTROY &&
+            recv->msg.type != BUS1_MSG_NODE_RELEASE)
+                return -EIO;
+
+        if (recv->msg.type == BUS1_MSG_DATA) {
+                if (_c_likely_(!peer->policy && !peer->n_node_policies) ||
+                    b1_peer_check_policy(peer, recv))
+                        return 1;
+
+                /* denied by policy, drop it before it is materialized */
+                b1_message_discard_slice(peer,
+                                         bus1_peer_slice_from_offset(peer->peer, recv->msg.offset),
+                                         recv->msg.n_bytes,
+                                         recv->msg.n_handles,
+                                         recv->msg.n_fds);
+                B1_COUNTER_ADD(peer->n_denied, 1);
+        } else {
+                if (!peer->notify_fn)
+                        return 1;
+
+                /* notifications carry nothing but their destination */
+                b1_message_discard_slice(peer,
+                                         bus1_peer_slice_from_offset(peer->peer, recv->msg.offset),
+                                         recv->msg.n_bytes,
+                                         recv->msg.n_handles,
+                                         recv->msg.n_fds);
+
+                r = b1_peer_notify(peer, recv);
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+static int b1_peer_queue(B1Peer *peer, struct bus1_cmd_recv *recv) {
+        struct bus1_cmd_recv *pending;
+        size_t n;
+        int r;
+
+        /*
+         * Messages received while waiting for something else are queued
+         * without being materialized, so they hold no references and their
+         * slices stay in the pool until b1_peer_recv() returns them.
+         */
+
+        if (peer->n_pending == peer->n_pending_max) {
+                n = peer->n_pending_max ? peer->n_pending_max * 2 : 8;
+
+                r = b1_peer_charge(peer, B1_PEER_LIMIT_BUFFERS, (n - peer->n_pending_max) * sizeof(*pending));
+                if (r < 0)
+                        return r;
+
+                pending = realloc(peer->pending, n * sizeof(*pending));
+                if (!pending) {
+                        b1_peer_uncharge(peer, B1_PEER_LIMIT_BUFFERS, (n - peer->n_pending_max) * sizeof(*pending));
+                        return -ENOMEM;
+                }
+
+                peer->pending = pending;
+                peer->n_pending_max = n;
+        }
+
+        peer->pending[peer->n_pending++] = *recv;
+
+        return 0;
+}
+
+static int b1_peer_recv_raw(B1Peer *peer, struct bus1_cmd_recv *recv) {
+        int r;
+
+        for (;;) {
+                *recv = (struct bus1_cmd_recv){};
+
+                r = bus1_peer_recv(peer->peer, recv);
+                if (r == -EAGAIN && peer->n_idle_max && ++peer->n_idle == peer->n_idle_max)
+                        b1_peer_compact(peer);
+                if (r < 0)
+                        return r;
+
+                peer->n_idle = 0;
+
+                if (_c_unlikely_(recv->n_dropped)) {
+                        B1_COUNTER_ADD(peer->n_dropped, recv->n_dropped);
+
+                        /* report the drops, and return the message with the next call */
+                        r = b1_peer_filter(peer, recv);
+                        if (r > 0 && b1_peer_queue(peer, recv) < 0)
+                                b1_message_discard_slice(peer,
+                                                         bus1_peer_slice_from_offset(peer->peer, recv->msg.offset),
+                                                         recv->msg.n_bytes,
+                                                         recv->msg.n_handles,
+                                                         recv->msg.n_fds);
+
+                        return r < 0 ? r : -ENOBUFS;
+                }
+
+                r = b1_peer_filter(peer, recv);
+                if (r != 0)
+                        return r < 0 ? r : 0;
+        }
+}
+
+static int b1_peer_materialize(B1Peer *peer,
+                               struct bus1_cmd_recv *recv,
+                               B1Message **messagep,
+                               const void *address) {
+        B1Message *message;
+        B1Node *node;
+        int r;
+
+        r = b1_message_new_from_slice(peer,
+                                      &message,
+                                      bus1_peer_slice_from_offset(peer->peer, recv->msg.offset),
+                                      recv->msg.type,
+                                      recv->msg.destination,
+                                      recv->msg.uid,
+                                      recv->msg.gid,
+                                      recv->msg.pid,
+                                      recv->msg.tid,
+                                      recv->msg.n_bytes,
+                                      recv->msg.n_handles,
+                                      recv->msg.n_fds);
+        if (r < 0)
+                return r;
+
+        if (_c_unlikely_(peer->n_object_nodes) && message->type == BUS1_MSG_DATA) {
+                node = b1_node_lookup(peer, message->destination);
+                if (node && node->object_fn)
+                        b1_message_strip_object(message);
+        }
+
+        if (_c_unlikely_(peer->n_hooks[B1_HOOK_RECV])) {
+                r = b1_peer_run_hooks(peer, B1_HOOK_RECV, message, NULL, 0);
+                if (r < 0) {
+                        b1_message_unref(message);
+                        return r;
+                }
+        }
+
+        b1_message_track(message, address);
+
+        *messagep = message;
+        return 0;
+}
+
+static bool b1_peer_dequeue(B1Peer *peer, struct bus1_cmd_recv *recv) {
+        if (peer->i_pending == peer->n_pending)
+                return false;
+
+        *recv = peer->pending[peer->i_pending++];
+        if (peer->i_pending == peer->n_pending)
+                peer->i_pending = peer->n_pending = 0;
+
+        return true;
+}
+
 /*
  * b1_peer_recv() - receive one message
  * @peer:               the receiving peer
  * @messagep:           the received message
  *
- * Dequeues one message from the queue if available and returns it.
+ * Dequeues one message from the queue if available and returns it. Data
+ * messages denied by the policy of @peer or their destination node are
+ * dropped, and notifications are passed to the notification callback, if
+ * set (see b1_peer_set_notify_fn()). In both cases, the next message is
+ * dequeued instead. Messages set aside by b1_peer_gather() are returned
+ * first, in the order they were received.
+ *
+ * If the kernel dropped messages for @peer since the last call, -ENOBUFS is
+ * returned once, and the number of dropped messages is added to the counter
+ * returned by b1_peer_get_n_dropped(). The message that reported the drops is
+ * returned by the next call.
  *
  * Return: 0 on success, or a negative error code on failure.
  */
 _c_public_ int b1_peer_recv(B1Peer *peer, B1Message **messagep) {
-        struct bus1_cmd_recv recv = {};
+        struct bus1_cmd_recv recv;
         int r;
 
         assert(peer);
 
-        r = bus1_peer_recv(peer->peer, &recv);
+        if (_c_unlikely_(b1_peer_dequeue(peer, &recv)))
+                return b1_peer_materialize(peer, &recv, messagep, __builtin_return_address(0));
+
+        r = b1_peer_recv_raw(peer, &recv);
         if (r < 0)
                 return r;
 
-        if (recv.n_dropped)
-                return -ENOBUFS;
+        return b1_peer_materialize(peer, &recv, messagep, __builtin_return_address(0));
+}
 
-        if (recv.msg.type != BUS1_MSG_DATA &&
-            recv.msg.type != BUS1_MSG_NODE_DESTROY &&
-            recv.msg.type != BUS1_MSG_NODE_RELEASE)
-                return -EIO;
+typedef struct B1PeerGatherTarget {
+        B1Node *reply_node;
+        B1Message *request;
+        uint64_t deadline; /* in ms, UINT64_MAX to wait forever */
+        bool waiting;
+} B1PeerGatherTarget;
+
+static uint64_t b1_peer_now_ms(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000ULL;
+}
+
+/*
+ * Stops waiting for all targets whose deadline passed, and returns the
+ * earliest deadline of the remaining ones.
+ */
+static uint64_t b1_peer_gather_expire(B1PeerGatherTarget *targets,
+                                      size_t n_targets,
+                                      size_t *n_waitingp,
+                                      uint64_t now) {
+        uint64_t next = UINT64_MAX;
+
+        for (size_t i = 0; i < n_targets; i++) {
+                if (!targets[i].waiting)
+                        continue;
+
+                if (now >= targets[i].deadline) {
+                        targets[i].waiting = false;
+                        --*n_waitingp;
+                } else if (targets[i].deadline < next) {
+                        next = targets[i].deadline;
+                }
+        }
+
+        return next;
+}
+
+static int b1_peer_gather_collect(B1Peer *peer,
+                                  B1PeerGatherTarget *targets,
+                                  size_t n_targets,
+                                  size_t n_waiting,
+                                  B1Message **replies,
+                                  size_t *n_repliesp) {
+        struct pollfd pfd = {
+                .fd = bus1_peer_get_fd(peer->peer),
+                .events = POLLIN,
+        };
+        struct bus1_cmd_recv recv;
+        uint64_t next, now;
+        size_t i, n_pending;
+        int r;
+
+        next = b1_peer_gather_expire(targets, n_targets, &n_waiting, b1_peer_now_ms());
+
+        while (n_waiting) {
+                n_pending = peer->n_pending;
+
+                r = b1_peer_recv_raw(peer, &recv);
+                if (r == -ENOBUFS) {
+                        /*
+                         * The drops are counted on @peer, and the message
+                         * reporting them was queued, if it was not filtered.
+                         * Take it back, it may well be one of the replies.
+                         */
+                        if (peer->n_pending == n_pending)
+                                continue;
+
+                        recv = peer->pending[--peer->n_pending];
+                        if (peer->i_pending == peer->n_pending)
+                                peer->i_pending = peer->n_pending = 0;
+                } else if (r == -EAGAIN) {
+                        int timeout = -1;
+
+                        if (next < UINT64_MAX) {
+                                now = b1_peer_now_ms();
+                                if (now >= next) {
+                                        next = b1_peer_gather_expire(targets, n_targets, &n_waiting, now);
+                                        continue;
+                                }
+
+                                timeout = c_min(next - now, (uint64_t)INT_MAX);
+                        }
+
+                        if (poll(&pfd, 1, timeout) < 0 && errno != EINTR)
+                                return -errno;
+
+                        continue;
+                } else if (r < 0) {
+                        return r;
+                }
+
+                for (i = 0; i < n_targets; i++)
+                        if (recv.msg.destination == targets[i].reply_node->id)
+                                break;
+
+                if (i == n_targets) {
+                        r = b1_peer_queue(peer, &recv);
+                        if (r < 0) {
+                                b1_peer_discard(peer, &recv);
+                                return r;
+                        }
+                } else if (recv.msg.type == BUS1_MSG_DATA && targets[i].waiting) {
+                        r = b1_peer_materialize(peer, &recv, &replies[i], __builtin_return_address(0));
+                        if (r < 0)
+                                return r;
+
+                        targets[i].waiting = false;
+                        --n_waiting;
+                        ++*n_repliesp;
+                } else {
+                        /* late or surplus replies, the reply node is gone after the call */
+                        b1_peer_discard(peer, &recv);
+                }
+
+                /* the clock is only read once a deadline may have passed */
+                if (next < UINT64_MAX && (now = b1_peer_now_ms()) >= next)
+                        next = b1_peer_gather_expire(targets, n_targets, &n_waiting, now);
+        }
+
+        return 0;
+}
+
+/**
+ * b1_peer_gather() - send a request to many destinations and collect the replies
+ * @peer:               the sending and receiving peer
+ * @request:            the request to send
+ * @dests:              the destinations of @request
+ * @n_dests:            the number of destinations
+ * @timeouts_ms:        time to wait for the reply of each destination, or NULL
+ * @replies:            array of @n_dests replies, indexed like @dests
+ * @n_repliesp:         pointer to the number of replies
+ *
+ * This sends @request to each of @dests in a single batch (see
+ * b1_messages_send()), and collects one reply per destination. Each
+ * destination gets its own reply node, whose handle is appended to the
+ * handles of @request, so its reply is the one sent to the last handle of
+ * the request. The reply of dests[i] is stored in replies[i], or NULL if none
+ * arrived within timeouts_ms[i] milliseconds. A timeout of -1 waits forever,
+ * as do all destinations if @timeouts_ms is NULL. The reply nodes are
+ * destroyed before returning, so destinations replying later than that
+ * fail to send their reply.
+ *
+ * Any other message received meanwhile is queued on @peer, and returned by
+ * subsequent calls to b1_peer_recv(). Notifications are dispatched to the
+ * notification callback as usual, if set. Messages dropped by the kernel
+ * meanwhile do not abort the call, they are only counted (see
+ * b1_peer_get_n_dropped()).
+ *
+ * The caller owns the returned replies. Timeouts are not an error, it is up
+ * to the caller to decide what to do about missing replies. If an error
+ * occurs while collecting, the replies received until then are returned
+ * nevertheless, together with the error.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_peer_gather(B1Peer *peer,
+                              B1Message *request,
+                              B1Handle **dests,
+                              size_t n_dests,
+                              const int *timeouts_ms,
+                              B1Message **replies,
+                              size_t *n_repliesp) {
+        B1PeerGatherTarget *targets = NULL;
+        B1MessageSend *sends = NULL;
+        B1Handle **handles = NULL;
+        size_t i, n_sent = 0;
+        uint64_t now;
+        int r, r_collect;
+
+        assert(request->peer == peer);
+        assert(!n_dests || (dests && replies));
+
+        *n_repliesp = 0;
+        for (i = 0; i < n_dests; i++)
+                replies[i] = NULL;
+
+        if (!n_dests)
+                return 0;
+
+        targets = calloc(n_dests, sizeof(*targets));
+        sends = calloc(n_dests, sizeof(*sends));
+        handles = calloc(request->n_handles + 1, sizeof(*handles));
+        if (!targets || !sends || !handles) {
+                r = -ENOMEM;
+                goto exit;
+        }
+
+        if (request->n_handles)
+                memcpy(handles, request->handles, request->n_handles * sizeof(*handles));
+
+        for (i = 0; i < n_dests; i++) {
+                r = b1_node_new(peer, &targets[i].reply_node);
+                if (r < 0)
+                        goto exit;
+
+                r = b1_message_clone(request, &targets[i].request);
+                if (r < 0)
+                        goto exit;
+
+                handles[request->n_handles] = targets[i].reply_node->handle;
+                r = b1_message_set_handles(targets[i].request, handles, request->n_handles + 1);
+                if (r < 0)
+                        goto exit;
+
+                sends[i] = (B1MessageSend){
+                        .message = targets[i].request,
+                        .destinations = &dests[i],
+                        .n_destinations = 1,
+                };
+        }
+
+        now = b1_peer_now_ms();
+        r = b1_messages_send(sends, n_dests, &n_sent);
+
+        /* if sending failed midway, the replies to the sent requests are still collected */
+        for (i = 0; i < n_sent; i++) {
+                targets[i].waiting = true;
+                targets[i].deadline = (timeouts_ms && timeouts_ms[i] >= 0) ? now + timeouts_ms[i] : UINT64_MAX;
+        }
+
+        if (n_sent) {
+                r_collect = b1_peer_gather_collect(peer, targets, n_dests, n_sent, replies, n_repliesp);
+                if (r >= 0)
+                        r = r_collect;
+        }
+
+exit:
+        if (targets) {
+                for (i = 0; i < n_dests; i++) {
+                        b1_message_unref(targets[i].request);
+                        b1_node_free(targets[i].reply_node);
+                }
+        }
+        free(handles);
+        free(sends);
+        free(targets);
+
+        return r;
+}
 
-        return b1_message_new_from_slice(peer,
-                                         messagep,
-                                         bus1_peer_slice_from_offset(peer->peer, recv.msg.offset),
-                                         recv.msg.type,
-                                         recv.msg.destination,
-                                         recv.msg.uid,
-                                         recv.msg.gid,
-                                         recv.msg.pid,
-                                         recv.msg.tid,
-                                         recv.msg.n_bytes,
-                                         recv.msg.n_handles,
-                                         recv.msg.n_fds);
+static int b1_peer_call(B1Node *node, B1Message *message, void *userdata) {
+        if (node->object_fn)
+                return node->object_fn(node, message->object.id, message, userdata);
 
-        return -EIO;
+        return node->fn(node, message, userdata);
+}
+
+/**
+ * b1_peer_dispatch() - receive one message and pass it to its handler
+ * @peer:               the receiving peer
+ * @messagep:           pointer to the unhandled message
+ *
+ * Like b1_peer_recv(), but if the destination node of the received message has
+ * a handler (see b1_node_set_handler()), the message is passed to it, rather
+ * than returned, and @messagep is set to NULL. Messages for objects multiplexed
+ * over a node are passed to its object handler instead, if the object exists
+ * (see b1_node_set_object_handler()). If profiling is enabled (see
+ * b1_peer_set_profiling()), the time spent in the handler is accounted on the
+ * node. If a watchdog is set (see b1_peer_set_watchdog()), handlers exceeding
+ * its budget are reported.
+ *
+ * Return: 0 on success, the negative error code returned by the handler, or a
+ *         negative error code on failure.
+ */
+_c_public_ int b1_peer_dispatch(B1Peer *peer, B1Message **messagep) {
+        struct timespec start, end;
+        B1Message *message;
+        B1Node *node;
+        void *userdata;
+        int r;
+
+        r = b1_peer_recv(peer, &message);
+        if (r < 0)
+                return r;
+
+        node = b1_message_get_destination_node(message);
+        if (node && node->object_fn) {
+                if (b1_node_get_object(node, message->object.id, &userdata) < 0)
+                        node = NULL;
+        } else if (node && node->fn) {
+                userdata = node->userdata;
+        } else {
+                node = NULL;
+        }
+
+        if (!node) {
+                *messagep = message;
+                return 0;
+        }
+
+        if (_c_unlikely_(peer->watchdog))
+                b1_watchdog_begin(peer->watchdog, node, message->type);
+
+        if (_c_unlikely_(peer->profiling)) {
+                clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+                r = b1_peer_call(node, message, userdata);
+                clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+
+                b1_node_profile(node,
+                                message->type,
+                                (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec);
+        } else {
+                r = b1_peer_call(node, message, userdata);
+        }
+
+        if (_c_unlikely_(peer->watchdog))
+                b1_watchdog_end(peer->watchdog);
+
+        b1_message_unref(message);
+        *messagep = NULL;
+
+        return r;
+}
+
+/**
+ * b1_peer_set_profiling() - measure node handlers
+ * @peer:               the peer
+ * @enable:             whether to measure
+ *
+ * If enabled, b1_peer_dispatch() measures the time spent in each node handler
+ * with CLOCK_MONOTONIC_RAW, and aggregates it per node and message type (see
+ * b1_node_get_profile()). This costs two clock reads per handled message.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_peer_set_profiling(B1Peer *peer, bool enable) {
+        peer->profiling = enable;
+
+        return 0;
+}
+
+/**
+ * b1_peer_set_watchdog() - report node handlers that stall
+ * @peer:               the peer
+ * @budget_ns:          the time a handler may take, in ns
+ * @fn:                 the report callback, or NULL to disable the watchdog
+ * @userdata:           userdata passed to @fn
+ *
+ * This starts a watchdog thread, which reports every node handler invoked by
+ * b1_peer_dispatch() that runs for longer than @budget_ns. The report is
+ * passed to @fn on the watchdog thread, while the handler keeps running, with
+ * the node and message type being handled, the time it has run so far, and a
+ * backtrace of the stalled thread, as returned by backtrace(), if it could be
+ * captured. @fn must not call into @peer, and must not assume that @node
+ * stays valid, unless it synchronizes with the dispatching thread.
+ *
+ * The backtrace is captured by interrupting the stalled thread with SIGRTMIN,
+ * for which a handler is installed on first use. If the application installed
+ * a handler for SIGRTMIN before, it is left alone, and -EBUSY is returned
+ * instead, for this and all later calls. System calls of the stalled handler
+ * that are not restarted after signals, such as poll() or nanosleep(), fail
+ * with EINTR.
+ *
+ * Any previously set watchdog of @peer is stopped.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_peer_set_watchdog(B1Peer *peer, uint64_t budget_ns, B1WatchdogFn fn, void *userdata) {
+        peer->watchdog = b1_watchdog_free(peer->watchdog);
+
+        if (!fn)
+                return 0;
+
+        return b1_watchdog_new(peer, &peer->watchdog, budget_ns, fn, userdata);
 }
 
 /**
@@ -184,6 +1870,7 @@ _c_public_ int b1_peer_get_seed(B1Peer *peer, B1Message **seedp) {
         struct bus1_cmd_recv recv = {
                 .flags = BUS1_RECV_FLAG_SEED,
         };
+        B1Message *seed;
         int r;
 
         r = bus1_peer_recv(peer->peer, &recv);
@@ -196,16 +1883,23 @@ _c_public_ int b1_peer_get_seed(B1Peer *peer, B1Message **seedp) {
         if (recv.n_dropped)
                 return -ENOBUFS;
 
-        return b1_message_new_from_slice(peer,
-                                         seedp,
-                                         bus1_peer_slice_from_offset(peer->peer, recv.msg.offset),
-                                         recv.msg.type,
-                                         recv.msg.destination,
-                                         recv.msg.uid,
-                                         recv.msg.gid,
-                                         recv.msg.pid,
-                                         recv.msg.tid,
-                                         recv.msg.n_bytes,
-                                         recv.msg.n_handles,
-                                         recv.msg.n_fds);
+        r = b1_message_new_from_slice(peer,
+                                      &seed,
+                                      bus1_peer_slice_from_offset(peer->peer, recv.msg.offset),
+                                      recv.msg.type,
+                                      recv.msg.destination,
+                                      recv.msg.uid,
+                                      recv.msg.gid,
+                                      recv.msg.pid,
+                                      recv.msg.tid,
+                                      recv.msg.n_bytes,
+                                      recv.msg.n_handles,
+                                      recv.msg.n_fds);
+        if (r < 0)
+                return r;
+
+        b1_message_track(seed, __builtin_return_address(0));
+
+        *seedp = seed;
+        return 0;
 }
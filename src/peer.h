@@ -9,14 +9,109 @@
 
 #include <c-rbtree.h>
 #include <c-ref.h>
+#include <pthread.h>
 #include "bus1-peer.h"
 #include "org.bus1/b1-peer.h"
 
+/*
+ * Counters read by b1_peer_dump() on other threads. Only the thread using the
+ * peer changes them, so a relaxed load and store is enough to update them.
+ */
+#define B1_COUNTER_GET(_x) __atomic_load_n(&(_x), __ATOMIC_RELAXED)
+#define B1_COUNTER_SET(_x, _v) __atomic_store_n(&(_x), (_v), __ATOMIC_RELAXED)
+#define B1_COUNTER_ADD(_x, _n) B1_COUNTER_SET((_x), (_x) + (_n))
+#define B1_COUNTER_SUB(_x, _n) B1_COUNTER_SET((_x), (_x) - (_n))
+
+typedef struct B1PeerBudget B1PeerBudget;
+typedef struct B1Site B1Site;
+typedef struct B1Hook B1Hook;
+typedef struct B1HookRun B1HookRun;
+
+struct B1PeerBudget {
+        size_t max;
+        size_t usage;
+        uint64_t n_exceeded;
+};
+
+struct B1Site {
+        const void *address;
+        unsigned int type; /* B1_PEER_LIMIT_* of the tracked objects */
+        size_t n_live;
+        uint64_t n_total;
+        CRBNode rb;
+};
+
+struct B1Hook {
+        B1HookFn fn;
+        void *userdata;
+};
+
+/* a running hook chain, so removals can adjust its position */
+struct B1HookRun {
+        unsigned int hook;
+        size_t i; /* index of the next hook to run */
+        B1HookRun *next;
+};
+
 struct B1Peer {
         CRef ref;
 
         struct bus1_peer *peer;
 
+        pthread_mutex_t lock; /* serializes changes of nodes, handles, slices and sites with b1_peer_dump() */
         CRBTree nodes;
         CRBTree handles;
+        CRBTree slices;
+        size_t n_slices;
+        size_t n_slice_bytes;
+        CRBTree regions;
+        CRBTree credentials;
+        size_t n_credentials;
+        uint64_t credentials_clock; /* bumped on every cache lookup */
+
+        B1PeerBudget budgets[_B1_PEER_LIMIT_N];
+
+        void *scratch;
+        size_t n_scratch;
+
+        unsigned int n_idle_max;
+        unsigned int n_idle;
+
+        bool track_sites;
+        CRBTree sites;
+
+        B1Hook *hooks[_B1_HOOK_N];
+        size_t n_hooks[_B1_HOOK_N];
+        B1HookRun *hook_runs; /* innermost first */
+
+        B1NotifyFn notify_fn;
+        void *notify_userdata;
+
+        struct bus1_cmd_recv *pending; /* received, but not yet returned */
+        size_t i_pending; /* index of the next pending message */
+        size_t n_pending;
+        size_t n_pending_max;
+
+        bool profiling; /* measure node handlers in b1_peer_dispatch() */
+        struct B1Watchdog *watchdog;
+
+        B1Policy *policy;
+        size_t n_node_policies; /* number of nodes with a policy of their own */
+        size_t n_object_nodes; /* number of nodes with an object handler */
+        uint64_t n_denied;
+        uint64_t n_dropped; /* messages dropped by the kernel */
 };
+
+int b1_peer_charge(B1Peer *peer, unsigned int limit, size_t n);
+void b1_peer_uncharge(B1Peer *peer, unsigned int limit, size_t n);
+
+int b1_peer_reserve_scratch(B1Peer *peer, size_t size, void **scratchp);
+
+void b1_peer_track(B1Peer *peer, B1Site **sitep, unsigned int type, const void *address);
+void b1_peer_untrack(B1Peer *peer, B1Site **sitep);
+
+int b1_peer_run_hooks(B1Peer *peer,
+                      unsigned int hook,
+                      B1Message *message,
+                      B1Handle **destinations,
+                      size_t n_destinations);
@@ -0,0 +1,325 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+/*
+ * Access Policies
+ *
+ * A policy is an ordered list of rules, each of which either allows or denies
+ * data messages whose metadata lies in the given ranges. The first matching
+ * rule decides, and messages not matched by any rule are denied. Policies are
+ * written in a simple line-based format:
+ *
+ *     # comment
+ *     deny uid 1000-1999 fds 1-
+ *     allow uid 1000-1999
+ *     allow uid 0 bytes -4096
+ *
+ * Each rule is 'allow' or 'deny', followed by any number of constraints of
+ * the form '<field> <min>[-[<max>]]' or '<field> -<max>', where <field> is
+ * one of uid, gid, pid, bytes, handles or fds. All constraints of a rule must
+ * hold for the rule to match.
+ *
+ * Policies are compiled into a flat table of ranges, and evaluated on the
+ * header returned by the kernel, before any message is materialized, so
+ * denied messages are dropped without any allocation.
+ */
+
+#include <assert.h>
+#include <c-macro.h>
+#include <c-rbtree.h>
+#include <ctype.h>
+#include <errno.h>
+#include "linux/bus1.h"
+#include "node.h"
+#include "peer.h"
+#include "policy.h"
+#include <stdlib.h>
+#include <string.h>
+
+static const char * const b1_policy_field_names[_B1_POLICY_N] = {
+        [B1_POLICY_UID]         = "uid",
+        [B1_POLICY_GID]         = "gid",
+        [B1_POLICY_PID]         = "pid",
+        [B1_POLICY_BYTES]       = "bytes",
+        [B1_POLICY_HANDLES]     = "handles",
+        [B1_POLICY_FDS]         = "fds",
+};
+
+static const char *b1_policy_skip_space(const char *p) {
+        while (*p == ' ' || *p == '\t')
+                ++p;
+
+        return p;
+}
+
+static const char *b1_policy_parse_word(const char *p, const char *word) {
+        size_t n = strlen(word);
+
+        if (strncmp(p, word, n) || (p[n] && !isspace((unsigned char)p[n])))
+                return NULL;
+
+        return p + n;
+}
+
+static const char *b1_policy_parse_number(const char *p, uint64_t *numberp) {
+        unsigned long long number;
+        char *end;
+
+        if (!isdigit((unsigned char)*p))
+                return NULL;
+
+        /* only plain decimals, "010" or "0x10" must not silently change base */
+        if (p[0] == '0' && isalnum((unsigned char)p[1]))
+                return NULL;
+
+        errno = 0;
+        number = strtoull(p, &end, 10);
+        if (errno)
+                return NULL;
+
+        *numberp = number;
+        return end;
+}
+
+static int b1_policy_parse_rule(const char *p, B1PolicyRule *rule) {
+        const char *q;
+
+        for (unsigned int i = 0; i < _B1_POLICY_N; i++) {
+                rule->min[i] = 0;
+                rule->range[i] = UINT64_MAX;
+        }
+
+        p = b1_policy_skip_space(p);
+
+        if ((q = b1_policy_parse_word(p, "allow")))
+                rule->allow = true;
+        else if ((q = b1_policy_parse_word(p, "deny")))
+                rule->allow = false;
+        else
+                return -EINVAL;
+
+        for (p = b1_policy_skip_space(q); *p && *p != '\n' && *p != '#'; p = b1_policy_skip_space(p)) {
+                uint64_t min = 0, max = UINT64_MAX;
+                unsigned int i;
+
+                for (i = 0; i < _B1_POLICY_N; i++)
+                        if ((q = b1_policy_parse_word(p, b1_policy_field_names[i])))
+                                break;
+
+                if (i >= _B1_POLICY_N)
+                        return -EINVAL;
+
+                p = b1_policy_skip_space(q);
+
+                if (*p != '-') {
+                        p = b1_policy_parse_number(p, &min);
+                        if (!p)
+                                return -EINVAL;
+
+                        if (*p == '-')
+                                ++p;
+                        else
+                                max = min;
+                } else {
+                        ++p;
+                }
+
+                /* an open upper bound is followed by whitespace or the end of the line */
+                if (isdigit((unsigned char)*p)) {
+                        p = b1_policy_parse_number(p, &max);
+                        if (!p)
+                                return -EINVAL;
+                }
+
+                if (*p && !isspace((unsigned char)*p))
+                        return -EINVAL;
+
+                if (min > max)
+                        return -EINVAL;
+
+                /* constraints on the same field intersect */
+                if (min < rule->min[i])
+                        min = rule->min[i];
+                if (max > rule->min[i] + rule->range[i])
+                        max = rule->min[i] + rule->range[i];
+                if (min > max)
+                        return -EINVAL;
+
+                rule->min[i] = min;
+                rule->range[i] = max - min;
+        }
+
+        return 0;
+}
+
+/**
+ * b1_policy_new_from_string() - compile an access policy
+ * @policyp:            pointer to the new policy
+ * @string:             the policy in text form
+ *
+ * This parses @string, which contains one rule per line, and compiles it into
+ * a policy which can be installed on a peer or a node. Empty lines and
+ * everything following a '#' are ignored. A policy without any rules denies
+ * all data messages.
+ *
+ * Return: 0 on success, -EBADMSG if @string is malformed, or a negative error
+ *         code on failure.
+ */
+_c_public_ int b1_policy_new_from_string(B1Policy **policyp, const char *string) {
+        _c_cleanup_(b1_policy_unrefp) B1Policy *policy = NULL;
+        size_t n_rules = 0;
+        const char *p;
+        int r;
+
+        for (p = string; p; p = strchr(p, '\n'), p = p ? p + 1 : NULL)
+                ++n_rules;
+
+        policy = calloc(1, sizeof(*policy) + n_rules * sizeof(*policy->rules));
+        if (!policy)
+                return -ENOMEM;
+
+        policy->ref = (CRef)C_REF_INIT;
+
+        for (p = string; p; p = strchr(p, '\n'), p = p ? p + 1 : NULL) {
+                const char *q = b1_policy_skip_space(p);
+
+                if (!*q || *q == '\n' || *q == '#')
+                        continue;
+
+                r = b1_policy_parse_rule(q, &policy->rules[policy->n_rules]);
+                if (r < 0)
+                        return -EBADMSG;
+
+                ++policy->n_rules;
+        }
+
+        *policyp = policy;
+        policy = NULL;
+        return 0;
+}
+
+/**
+ * b1_policy_ref() - acquire reference
+ * @policy:             policy to acquire reference to, or NULL
+ *
+ * Return: @policy is returned.
+ */
+_c_public_ B1Policy *b1_policy_ref(B1Policy *policy) {
+        if (policy)
+                c_ref_inc(&policy->ref);
+
+        return policy;
+}
+
+static void b1_policy_free(CRef *ref, void *userdata) {
+        free(userdata);
+}
+
+/**
+ * b1_policy_unref() - release reference
+ * @policy:             policy to release reference to, or NULL
+ *
+ * Return: NULL is returned.
+ */
+_c_public_ B1Policy *b1_policy_unref(B1Policy *policy) {
+        if (policy)
+                c_ref_dec(&policy->ref, b1_policy_free, policy);
+
+        return NULL;
+}
+
+bool b1_policy_check(B1Policy *policy, const struct bus1_cmd_recv *recv) {
+        const uint64_t values[_B1_POLICY_N] = {
+                [B1_POLICY_UID]         = recv->msg.uid,
+                [B1_POLICY_GID]         = recv->msg.gid,
+                [B1_POLICY_PID]         = recv->msg.pid,
+                [B1_POLICY_BYTES]       = recv->msg.n_bytes,
+                [B1_POLICY_HANDLES]     = recv->msg.n_handles,
+                [B1_POLICY_FDS]         = recv->msg.n_fds,
+        };
+
+        for (size_t i = 0; i < policy->n_rules; i++) {
+                const B1PolicyRule *rule = &policy->rules[i];
+                unsigned int j;
+
+                for (j = 0; j < _B1_POLICY_N; j++)
+                        if (values[j] - rule->min[j] > rule->range[j])
+                                break;
+
+                if (j == _B1_POLICY_N)
+                        return rule->allow;
+        }
+
+        return false;
+}
+
+bool b1_peer_check_policy(B1Peer *peer, const struct bus1_cmd_recv *recv) {
+        B1Policy *policy = peer->policy;
+
+        if (peer->n_node_policies) {
+                B1Node *node = b1_node_lookup(peer, recv->msg.destination);
+
+                if (node && node->policy)
+                        policy = node->policy;
+        }
+
+        return !policy || b1_policy_check(policy, recv);
+}
+
+/**
+ * b1_peer_set_policy() - set the access policy of a peer
+ * @peer:               the peer
+ * @policy:             the policy to install, or NULL
+ *
+ * Installs @policy on @peer. From then on, data messages received on any node
+ * of @peer without a policy of its own (see b1_node_set_policy()) are checked
+ * against @policy, and silently dropped if denied. Notifications are never
+ * subject to policies. The peer takes its own reference to @policy.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_peer_set_policy(B1Peer *peer, B1Policy *policy) {
+        b1_policy_unref(peer->policy);
+        peer->policy = b1_policy_ref(policy);
+
+        return 0;
+}
+
+/**
+ * b1_node_set_policy() - set the access policy of a node
+ * @node:               the node
+ * @policy:             the policy to install, or NULL
+ *
+ * Like b1_peer_set_policy(), but applies only to messages destined for @node,
+ * overriding the policy of its peer.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_node_set_policy(B1Node *node, B1Policy *policy) {
+        if (node->policy)
+                --node->owner->n_node_policies;
+        if (policy)
+                ++node->owner->n_node_policies;
+
+        b1_policy_unref(node->policy);
+        node->policy = b1_policy_ref(policy);
+
+        return 0;
+}
+
+/**
+ * b1_peer_get_n_denied() - get the number of messages denied by policy
+ * @peer:               the peer
+ *
+ * Return: the number of data messages dropped by the policies of @peer and its
+ *         nodes so far.
+ */
+_c_public_ uint64_t b1_peer_get_n_denied(B1Peer *peer) {
+        return peer->n_denied;
+}
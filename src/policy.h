@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <c-ref.h>
+#include "org.bus1/b1-peer.h"
+
+struct bus1_cmd_recv;
+
+enum {
+        B1_POLICY_UID,
+        B1_POLICY_GID,
+        B1_POLICY_PID,
+        B1_POLICY_BYTES,
+        B1_POLICY_HANDLES,
+        B1_POLICY_FDS,
+        _B1_POLICY_N,
+};
+
+typedef struct B1PolicyRule B1PolicyRule;
+
+/*
+ * A rule matches if, for every field, (value - min) <= range holds in
+ * unsigned arithmetic. Fields not restricted by a rule match [0, UINT64_MAX].
+ */
+struct B1PolicyRule {
+        uint64_t min[_B1_POLICY_N];
+        uint64_t range[_B1_POLICY_N];
+        bool allow;
+};
+
+struct B1Policy {
+        CRef ref;
+        size_t n_rules;
+        B1PolicyRule rules[];
+};
+
+bool b1_policy_check(B1Policy *policy, const struct bus1_cmd_recv *recv);
+bool b1_peer_check_policy(B1Peer *peer, const struct bus1_cmd_recv *recv);
@@ -0,0 +1,623 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+/*
+ * Shared Memory Regions
+ *
+ * A region is a sealed memfd, mapped once and exchanged once between two
+ * peers. The receiving side binds it under a sender-chosen id, and any further
+ * message from the same sender can refer to data in the region by (id,
+ * offset, length), which is resolved to a pointer into the existing mapping,
+ * rather than passing a file descriptor with every message. Ids are scoped to
+ * the node and the sending process, as reported by the kernel, so senders
+ * cannot refer to, or bind over, the regions of each other.
+ *
+ * A region pool keeps such memfds around in power-of-two size classes, so
+ * large payloads can be placed into a pre-created, pre-mapped region, which
+ * is handed back to the pool once the receiver sends a release message for it.
+ * Pool ids are sequential and easily guessed, so a release is only accepted
+ * together with a handle to the node the region was handed to. Handles are
+ * unique per node and holder, and a peer can only pass handles it holds, so
+ * no other receiver can release a region it was not given.
+ */
+
+#include <assert.h>
+#include <c-macro.h>
+#include <c-rbtree.h>
+#include <errno.h>
+#include <fcntl.h>
+#include "message.h"
+#include "node.h"
+#include "peer.h"
+#include "region.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static int regions_compare(CRBTree *t, void *k, CRBNode *n) {
+        B1Region *region = c_container_of(n, B1Region, rb);
+        B1Region *key = k;
+
+        if (key->handle < region->handle)
+                return -1;
+        else if (key->handle > region->handle)
+                return 1;
+        else if (key->sender < region->sender)
+                return -1;
+        else if (key->sender > region->sender)
+                return 1;
+        else if (key->id < region->id)
+                return -1;
+        else if (key->id > region->id)
+                return 1;
+        else
+                return 0;
+}
+
+static int b1_region_new_internal(B1Peer *peer, B1Region **regionp, int fd, size_t size, int prot) {
+        _c_cleanup_(b1_region_unrefp) B1Region *region = NULL;
+        void *data;
+
+        region = calloc(1, sizeof(*region));
+        if (!region)
+                return -ENOMEM;
+
+        region->ref = (CRef)C_REF_INIT;
+        region->peer = b1_peer_ref(peer);
+        region->fd = -1;
+        region->data = MAP_FAILED;
+        c_rbnode_init(&region->rb);
+        c_rbnode_init(&region->rb_pool);
+
+        region->fd = fcntl(fd, F_DUPFD_CLOEXEC, 3);
+        if (region->fd < 0)
+                return -errno;
+
+        data = mmap(NULL, size, prot, MAP_SHARED, region->fd, 0);
+        if (data == MAP_FAILED)
+                return -errno;
+
+        region->data = data;
+        region->size = size;
+
+        *regionp = region;
+        region = NULL;
+        return 0;
+}
+
+/**
+ * b1_region_new() - create a new shared memory region
+ * @peer:               the owning peer
+ * @regionp:            pointer to the new region
+ * @size:               the size of the region in bytes
+ *
+ * This creates a memfd of @size bytes, seals its size and maps it writable.
+ * The file descriptor returned by b1_region_get_fd() is meant to be passed to
+ * other peers once, who then map it via b1_region_new_from_fd().
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_region_new(B1Peer *peer, B1Region **regionp, size_t size) {
+        int fd, r;
+
+        if (!size)
+                return -EINVAL;
+
+        fd = memfd_create("bus1-region", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (fd < 0)
+                return -errno;
+
+        if (ftruncate(fd, size) < 0 ||
+            fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+                r = -errno;
+                close(fd);
+                return r;
+        }
+
+        r = b1_region_new_internal(peer, regionp, fd, size, PROT_READ | PROT_WRITE);
+        close(fd);
+        return r;
+}
+
+/**
+ * b1_region_new_from_fd() - map a shared memory region
+ * @peer:               the owning peer
+ * @regionp:            pointer to the new region
+ * @fd:                 the memfd backing the region
+ *
+ * This maps the memfd @fd read-only. The memfd must be sealed against
+ * shrinking, so the owner cannot truncate it under the mapping. The caller
+ * keeps ownership of @fd, the region uses its own duplicate.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_region_new_from_fd(B1Peer *peer, B1Region **regionp, int fd) {
+        struct stat st;
+        int seals;
+
+        seals = fcntl(fd, F_GET_SEALS);
+        if (seals < 0)
+                return -errno;
+
+        if (!(seals & F_SEAL_SHRINK))
+                return -EPERM;
+
+        if (fstat(fd, &st) < 0)
+                return -errno;
+
+        if (st.st_size <= 0)
+                return -EINVAL;
+
+        return b1_region_new_internal(peer, regionp, fd, st.st_size, PROT_READ);
+}
+
+/**
+ * b1_region_ref() - acquire reference
+ * @region:             region to acquire reference to, or NULL
+ *
+ * Return: @region is returned.
+ */
+_c_public_ B1Region *b1_region_ref(B1Region *region) {
+        if (region)
+                c_ref_inc(&region->ref);
+
+        return region;
+}
+
+static void b1_region_free(CRef *ref, void *userdata) {
+        B1Region *region = userdata;
+
+        assert(!region->handle);
+
+        if (region->data != MAP_FAILED)
+                munmap(region->data, region->size);
+        if (region->fd >= 0)
+                close(region->fd);
+
+        b1_peer_unref(region->peer);
+        free(region);
+}
+
+/**
+ * b1_region_unref() - release reference
+ * @region:             region to release reference to, or NULL
+ *
+ * Return: NULL is returned.
+ */
+_c_public_ B1Region *b1_region_unref(B1Region *region) {
+        if (region)
+                c_ref_dec(&region->ref, b1_region_free, region);
+
+        return NULL;
+}
+
+/**
+ * b1_region_get_fd() - get the file descriptor backing a region
+ * @region:             the region
+ *
+ * The file descriptor remains owned by the region.
+ *
+ * Return: the file descriptor.
+ */
+_c_public_ int b1_region_get_fd(B1Region *region) {
+        return region->fd;
+}
+
+/**
+ * b1_region_get_data() - get the mapping of a region
+ * @region:             the region
+ *
+ * Return: pointer to the start of the mapping.
+ */
+_c_public_ void *b1_region_get_data(B1Region *region) {
+        return region->data;
+}
+
+/**
+ * b1_region_get_size() - get the size of a region
+ * @region:             the region
+ *
+ * Return: the size in bytes.
+ */
+_c_public_ size_t b1_region_get_size(B1Region *region) {
+        return region->size;
+}
+
+/**
+ * b1_region_bind() - register a region on its peer
+ * @region:             the region to bind
+ * @message:            the message the region was received with
+ * @id:                 the id to bind as
+ *
+ * This registers @region in the region registry of its peer under @id, scoped
+ * to the node @message was received on and to the process that sent it. Only
+ * later messages from that process to that node resolve @id to @region (see
+ * b1_message_resolve_region()), so other senders can neither access @region
+ * nor bind another region as @id for this sender. While bound, the registry
+ * holds a reference to both @region and the handle of the node.
+ *
+ * Return: 0 on success, -EINVAL if @message was not received on a node of
+ *         the peer of @region, -ENOTUNIQ if @id is already bound for the
+ *         sender, or a negative error code on failure.
+ */
+_c_public_ int b1_region_bind(B1Region *region, B1Message *message, uint64_t id) {
+        B1Region key = { .id = id };
+        B1Handle *handle;
+        CRBNode **slot, *p;
+        B1Node *node;
+
+        if (region->handle)
+                return -EALREADY;
+
+        node = b1_message_get_destination_node(message);
+        if (!node || node->owner != region->peer)
+                return -EINVAL;
+
+        handle = node->handle;
+        key.handle = handle;
+        key.sender = message->pid;
+
+        slot = c_rbtree_find_slot(&region->peer->regions, regions_compare, &key, &p);
+        if (!slot)
+                return -ENOTUNIQ;
+
+        region->handle = b1_handle_ref(handle);
+        region->sender = message->pid;
+        region->id = id;
+        c_rbtree_add(&region->peer->regions, p, slot, &region->rb);
+        b1_region_ref(region);
+
+        return 0;
+}
+
+/**
+ * b1_region_unbind() - unregister a region
+ * @region:             the region to unbind
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_region_unbind(B1Region *region) {
+        if (!region->handle)
+                return -ENOENT;
+
+        c_rbtree_remove_init(&region->peer->regions, &region->rb);
+        region->handle = b1_handle_unref(region->handle);
+        b1_region_unref(region);
+
+        return 0;
+}
+
+B1Region *b1_region_lookup(B1Peer *peer, B1Handle *handle, pid_t sender, uint64_t id) {
+        B1Region key = { .handle = handle, .sender = sender, .id = id };
+        CRBNode *n;
+
+        n = c_rbtree_find_node(&peer->regions, regions_compare, &key);
+        if (!n)
+                return NULL;
+
+        return c_container_of(n, B1Region, rb);
+}
+
+/**
+ * b1_region_resolve() - resolve a range of a region
+ * @region:             the region
+ * @offset:             the offset of the range
+ * @length:             the length of the range
+ * @datap:              pointer to the resolved data
+ *
+ * Return: 0 on success, -ERANGE if the range is not within the region.
+ */
+_c_public_ int b1_region_resolve(B1Region *region, uint64_t offset, uint64_t length, const void **datap) {
+        if (offset > region->size || length > region->size - offset)
+                return -ERANGE;
+
+        *datap = (const uint8_t *)region->data + offset;
+        return 0;
+}
+
+/**
+ * b1_message_resolve_region() - resolve a region reference of a message
+ * @message:            the received message
+ * @id:                 the id of the region
+ * @offset:             the offset of the range
+ * @length:             the length of the range
+ * @datap:              pointer to the resolved data
+ *
+ * This looks up the region bound as @id by the sender of @message, on the node
+ * @message was received on, and resolves the given range in it. The pointer remains
+ * valid as long as the region is bound.
+ *
+ * Return: 0 on success, -ENOENT if no such region is bound, -ERANGE if the
+ *         range is not within the region.
+ */
+_c_public_ int b1_message_resolve_region(B1Message *message,
+                                         uint64_t id,
+                                         uint64_t offset,
+                                         uint64_t length,
+                                         const void **datap) {
+        B1Region *region;
+        B1Node *node;
+
+        node = b1_message_get_destination_node(message);
+        if (!node)
+                return -ENOENT;
+
+        region = b1_region_lookup(message->peer, node->handle, message->pid, id);
+        if (!region)
+                return -ENOENT;
+
+        return b1_region_resolve(region, offset, length, datap);
+}
+
+static int pool_compare(CRBTree *t, void *k, CRBNode *n) {
+        B1Region *region = c_container_of(n, B1Region, rb_pool);
+        uint64_t id = *(uint64_t *)k;
+
+        if (id < region->pool_id)
+                return -1;
+        else if (id > region->pool_id)
+                return 1;
+        else
+                return 0;
+}
+
+/**
+ * b1_region_pool_new() - create a new region pool
+ * @peer:               the owning peer
+ * @poolp:              pointer to the new pool
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_region_pool_new(B1Peer *peer, B1RegionPool **poolp) {
+        B1RegionPool *pool;
+
+        pool = calloc(1, sizeof(*pool));
+        if (!pool)
+                return -ENOMEM;
+
+        pool->peer = b1_peer_ref(peer);
+
+        *poolp = pool;
+        return 0;
+}
+
+static void b1_region_pool_drop(B1RegionPool *pool, B1Region *region) {
+        c_rbtree_remove_init(&pool->regions, &region->rb_pool);
+        region->pool_destination = b1_handle_unref(region->pool_destination);
+        b1_peer_uncharge(pool->peer, B1_PEER_LIMIT_BUFFERS, region->size);
+        b1_region_unref(region);
+}
+
+/**
+ * b1_region_pool_free() - destroy a region pool
+ * @pool:               the pool to destroy, or NULL
+ *
+ * This drops the references of the pool to all its regions. Regions still
+ * referenced by the caller remain valid, but are no longer pooled.
+ *
+ * Return: NULL is returned.
+ */
+_c_public_ B1RegionPool *b1_region_pool_free(B1RegionPool *pool) {
+        CRBNode *n;
+
+        if (!pool)
+                return NULL;
+
+        while ((n = c_rbtree_first(&pool->regions)))
+                b1_region_pool_drop(pool, c_container_of(n, B1Region, rb_pool));
+
+        b1_peer_unref(pool->peer);
+        free(pool);
+
+        return NULL;
+}
+
+/**
+ * b1_region_pool_acquire() - get a region from the pool
+ * @pool:               the pool
+ * @size:               the minimum size of the region
+ * @destination:        the handle the region is handed to
+ * @regionp:            pointer to the region
+ * @idp:                pointer to the pool id of the region
+ *
+ * This returns a region of at least @size bytes, and marks it as busy.
+ * Regions are re-used, if available, otherwise a new one is created.
+ * Regions are sealed against shrinking and growing, but not against writes,
+ * as they are meant to be re-used: receivers must not expect the data to be
+ * immutable once they released it.
+ *
+ * The caller gets a reference to the region, and usually passes its file
+ * descriptor via b1_message_set_fds() together with @idp to @destination. The
+ * region stays busy until b1_region_pool_release() is called with @idp and
+ * @destination, typically when the release message of the receiver arrives
+ * (see b1_message_get_region_release()).
+ *
+ * Return: 0 on success, -EINVAL if @destination is not held by the owner of
+ *         @pool, or a negative error code on failure.
+ */
+_c_public_ int b1_region_pool_acquire(B1RegionPool *pool,
+                                      size_t size,
+                                      B1Handle *destination,
+                                      B1Region **regionp,
+                                      uint64_t *idp) {
+        _c_cleanup_(b1_region_unrefp) B1Region *region = NULL;
+        unsigned int class = 0;
+        CRBNode **slot, *p;
+        uint64_t id;
+        int r;
+
+        if (destination->holder != pool->peer)
+                return -EINVAL;
+
+        while (((size_t)B1_REGION_POOL_SIZE_MIN << class) < size)
+                if (++class >= B1_REGION_POOL_N_CLASSES)
+                        return -EMSGSIZE;
+
+        if (pool->free[class]) {
+                region = b1_region_ref(pool->free[class]);
+                pool->free[class] = region->pool_next;
+                region->pool_next = NULL;
+        } else {
+                r = b1_peer_charge(pool->peer, B1_PEER_LIMIT_BUFFERS, (size_t)B1_REGION_POOL_SIZE_MIN << class);
+                if (r < 0)
+                        return r;
+
+                r = b1_region_new(pool->peer, &region, (size_t)B1_REGION_POOL_SIZE_MIN << class);
+                if (r < 0) {
+                        b1_peer_uncharge(pool->peer, B1_PEER_LIMIT_BUFFERS, (size_t)B1_REGION_POOL_SIZE_MIN << class);
+                        return r;
+                }
+
+                id = ++pool->ids;
+                slot = c_rbtree_find_slot(&pool->regions, pool_compare, &id, &p);
+                assert(slot);
+
+                region->pool_id = id;
+                region->pool_class = class;
+                c_rbtree_add(&pool->regions, p, slot, &region->rb_pool);
+                b1_region_ref(region);
+        }
+
+        region->pool_busy = true;
+        region->pool_destination = b1_handle_ref(destination);
+
+        *idp = region->pool_id;
+        *regionp = region;
+        region = NULL;
+        return 0;
+}
+
+/**
+ * b1_region_pool_release() - return a region to the pool
+ * @pool:               the pool
+ * @id:                 the pool id of the region
+ * @destination:        the handle the region was handed to
+ *
+ * Marks the region with the pool id @id as no longer busy, so it can be
+ * handed out again by b1_region_pool_acquire(). @destination must be the
+ * handle the region was acquired for, as returned with the release message
+ * by b1_message_get_region_release(), so receivers cannot release regions
+ * handed to others.
+ *
+ * Return: 0 on success, -ENOENT if no such region exists, -EALREADY if it
+ *         was not busy, or -EPERM if it was handed to another destination.
+ */
+_c_public_ int b1_region_pool_release(B1RegionPool *pool, uint64_t id, B1Handle *destination) {
+        B1Region *region;
+        CRBNode *n;
+
+        n = c_rbtree_find_node(&pool->regions, pool_compare, &id);
+        if (!n)
+                return -ENOENT;
+
+        region = c_container_of(n, B1Region, rb_pool);
+        if (!region->pool_busy)
+                return -EALREADY;
+        if (region->pool_destination != destination)
+                return -EPERM;
+
+        region->pool_busy = false;
+        region->pool_destination = b1_handle_unref(region->pool_destination);
+        region->pool_next = pool->free[region->pool_class];
+        pool->free[region->pool_class] = region;
+
+        return 0;
+}
+
+/**
+ * b1_region_pool_trim() - drop all idle regions of a pool
+ * @pool:               the pool
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_region_pool_trim(B1RegionPool *pool) {
+        for (unsigned int i = 0; i < B1_REGION_POOL_N_CLASSES; i++) {
+                while (pool->free[i]) {
+                        B1Region *region = pool->free[i];
+
+                        pool->free[i] = region->pool_next;
+                        region->pool_next = NULL;
+                        b1_region_pool_drop(pool, region);
+                }
+        }
+
+        return 0;
+}
+
+/**
+ * b1_region_send_release() - send a region release message
+ * @destination:        the handle to send the release message to
+ * @node:               the node the region was received on
+ * @id:                 the pool id of the released region
+ *
+ * This sends a minimal message to @destination, telling the owner of a region
+ * pool that the receiver no longer uses the region with pool id @id. The
+ * handle of @node is passed along, to prove that the region was handed to
+ * @node.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+_c_public_ int b1_region_send_release(B1Handle *destination, B1Node *node, uint64_t id) {
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        uint64_t payload[2] = { B1_REGION_RELEASE_MAGIC, id };
+        struct iovec vec = {
+                .iov_base = payload,
+                .iov_len = sizeof(payload),
+        };
+        int r;
+
+        if (node->owner != destination->holder)
+                return -EINVAL;
+
+        r = b1_message_new(destination->holder, &message);
+        if (r < 0)
+                return r;
+
+        r = b1_message_set_payload(message, &vec, 1);
+        if (r < 0)
+                return r;
+
+        r = b1_message_set_handles(message, &node->handle, 1);
+        if (r < 0)
+                return r;
+
+        return b1_message_send(message, &destination, 1);
+}
+
+/**
+ * b1_message_get_region_release() - parse a region release message
+ * @message:            the received message
+ * @idp:                pointer to the released pool id
+ * @destinationp:       pointer to the handle of the releasing node
+ *
+ * The returned handle is owned by @message, and is to be passed on to
+ * b1_region_pool_release() together with the id.
+ *
+ * Return: 0 on success, or -EBADMSG if @message is not a release message.
+ */
+_c_public_ int b1_message_get_region_release(B1Message *message, uint64_t *idp, B1Handle **destinationp) {
+        uint64_t payload[2];
+
+        if (message->type != BUS1_MSG_DATA ||
+            message->n_handles != 1 ||
+            !message->handles[0] ||
+            message->n_vecs != 1 ||
+            message->vecs[0].iov_len != sizeof(payload))
+                return -EBADMSG;
+
+        memcpy(payload, message->vecs[0].iov_base, sizeof(payload));
+        if (payload[0] != B1_REGION_RELEASE_MAGIC)
+                return -EBADMSG;
+
+        *idp = payload[1];
+        *destinationp = message->handles[0];
+        return 0;
+}
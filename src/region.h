@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <c-rbtree.h>
+#include <c-ref.h>
+#include "org.bus1/b1-peer.h"
+
+#define B1_REGION_RELEASE_MAGIC UINT64_C(0x4231524752454c53) /* "B1RGRELS" */
+#define B1_REGION_POOL_SIZE_MIN (4096)
+#define B1_REGION_POOL_N_CLASSES (19) /* up to 1GiB */
+
+struct B1Region {
+        CRef ref;
+        B1Peer *peer;
+
+        int fd;
+        void *data;
+        size_t size;
+
+        B1Handle *handle; /* the handle the region is bound to, or NULL */
+        pid_t sender; /* the process that may refer to the region */
+        uint64_t id;
+        CRBNode rb;
+
+        /* set if the region belongs to a pool */
+        uint64_t pool_id;
+        unsigned int pool_class;
+        bool pool_busy;
+        B1Handle *pool_destination; /* the handle the region was handed to, if busy */
+        B1Region *pool_next; /* free list, only if not busy */
+        CRBNode rb_pool;
+};
+
+struct B1RegionPool {
+        B1Peer *peer;
+        uint64_t ids;
+        CRBTree regions; /* all regions of the pool, keyed by pool id */
+        B1Region *free[B1_REGION_POOL_N_CLASSES];
+};
+
+B1Region *b1_region_lookup(B1Peer *peer, B1Handle *handle, pid_t sender, uint64_t id);
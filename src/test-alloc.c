@@ -0,0 +1,225 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+/*
+ * Allocation Budget Test
+ * Linked with the allocator wrapped (see Makefile.am), so the number of heap
+ * allocations of each hot path can be asserted exactly. If any of these
+ * fail, an allocation was added to a hot path, and the budget here must only
+ * be raised deliberately.
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <c-macro.h>
+#include <errno.h>
+#include <linux/bus1.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "org.bus1/b1-peer.h"
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+void *__wrap_malloc(size_t size);
+void *__wrap_calloc(size_t n, size_t size);
+void *__wrap_realloc(void *p, size_t size);
+
+static size_t n_allocs;
+
+void *__wrap_malloc(size_t size) {
+        ++n_allocs;
+        return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+        ++n_allocs;
+        return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+        ++n_allocs;
+        return __real_realloc(p, size);
+}
+
+#define assert_allocs(_n, _expr) do {                           \
+                size_t _c = n_allocs;                           \
+                                                                \
+                assert((_expr) >= 0);                           \
+                assert(n_allocs - _c == (_n));                  \
+        } while (0)
+
+static int notify_noop(B1Peer *peer, unsigned int type, B1Node *node, B1Handle *handle, void *userdata) {
+        return 0;
+}
+
+static void test_message(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *peer = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL, *clone = NULL;
+        uint64_t payload = 0;
+        struct iovec vec = {
+                .iov_base = &payload,
+                .iov_len = sizeof(payload),
+        };
+        int r;
+
+        r = b1_peer_new(&peer);
+        assert(r >= 0);
+
+        /* the message object itself */
+        assert_allocs(1, b1_message_new(peer, &message));
+
+        /* the copy of the iovec array */
+        assert_allocs(1, b1_message_set_payload(message, &vec, 1));
+
+        /* clones share everything but the message object */
+        assert_allocs(1, b1_message_clone(message, &clone));
+}
+
+static void test_node(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *peer = NULL;
+        B1Node *node;
+        int r;
+
+        r = b1_peer_new(&peer);
+        assert(r >= 0);
+
+        for (unsigned int i = 0; i < 16; i++) {
+                /* the node and its handle */
+                assert_allocs(2, b1_node_new(peer, &node));
+                b1_node_free(node);
+        }
+}
+
+static void test_send_recv(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        B1MessageSend sends[2];
+        uint64_t payload = 0;
+        struct iovec vec = {
+                .iov_base = &payload,
+                .iov_len = sizeof(payload),
+        };
+        int r;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
+        assert(r >= 0);
+
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        r = b1_message_set_payload(message, &vec, 1);
+        assert(r >= 0);
+
+        r = b1_message_set_handles(message, &handle, 1);
+        assert(r >= 0);
+
+        /* warm up the scratch space */
+        r = b1_message_send(message, &handle, 1);
+        assert(r >= 0);
+
+        for (unsigned int i = 0; i < 16; i++)
+                assert_allocs(0, b1_message_send(message, &handle, 1));
+
+        /* batches of the same size reuse the scratch space as well */
+        sends[0] = sends[1] = (B1MessageSend){
+                .message = message,
+                .destinations = &handle,
+                .n_destinations = 1,
+        };
+
+        r = b1_messages_send(sends, 2, NULL);
+        assert(r >= 0);
+
+        for (unsigned int i = 0; i < 7; i++)
+                assert_allocs(0, b1_messages_send(sends, 2, NULL));
+
+        message = b1_message_unref(message);
+
+        for (unsigned int i = 0; i < 33; i++) {
+                /*
+                 * The message, its iovec and its handle array. The passed
+                 * handle is already known to @dst, so acquiring it is free.
+                 */
+                assert_allocs(3, b1_peer_recv(dst, &message));
+                message = b1_message_unref(message);
+        }
+
+        r = b1_peer_recv(dst, &message);
+        assert(r == -EAGAIN);
+}
+
+static void test_notify(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle1 = NULL, *handle2 = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node1 = NULL, *node2 = NULL;
+        B1Message *message;
+        size_t n;
+        int r;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node1);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node2);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node1), src, &handle1);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node2), src, &handle2);
+        assert(r >= 0);
+
+        r = b1_node_destroy(node1);
+        assert(r >= 0);
+
+        /* notifications as messages need nothing but the message object */
+        assert_allocs(1, b1_peer_recv(src, &message));
+        b1_message_unref(message);
+
+        r = b1_peer_set_notify_fn(src, notify_noop, NULL);
+        assert(r >= 0);
+
+        r = b1_node_destroy(node2);
+        assert(r >= 0);
+
+        /* ...and with a callback, nothing at all */
+        n = n_allocs;
+        r = b1_peer_recv(src, &message);
+        assert(r == -EAGAIN);
+        assert(n_allocs == n);
+}
+
+int main(int argc, char **argv) {
+        if (access("/dev/bus1", F_OK) < 0 && errno == ENOENT)
+                return 77;
+
+        test_message();
+        test_node();
+        test_send_recv();
+        test_notify();
+
+        return 0;
+}
@@ -16,10 +16,17 @@
 #include <assert.h>
 #include <c-macro.h>
 #include <c-syscall.h>
+#include <fcntl.h>
 #include <linux/bus1.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include "org.bus1/b1-peer.h"
 
@@ -131,6 +138,2019 @@ static void test_message(void) {
         assert(fd != b1_peer_get_fd(peer));
 }
 
+static void test_clone(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *peer = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL, *clone1 = NULL, *clone2 = NULL;
+        const char *payload = "WOOF";
+        struct iovec vec = {
+                .iov_base = (void *)payload,
+                .iov_len = strlen(payload) + 1,
+        };
+        struct iovec *vecs;
+        size_t n_vecs;
+        B1Handle *handle;
+        int r, fd;
+
+        r = b1_peer_new(&peer);
+        assert(r >= 0);
+
+        r = b1_node_new(peer, &node);
+        assert(r >= 0);
+
+        r = b1_message_new(peer, &message);
+        assert(r >= 0);
+
+        r = b1_message_set_payload(message, &vec, 1);
+        assert(r >= 0);
+
+        handle = b1_node_get_handle(node);
+
+        r = b1_message_set_handles(message, &handle, 1);
+        assert(r >= 0);
+
+        fd = b1_peer_get_fd(peer);
+
+        r = b1_message_set_fds(message, &fd, 1);
+        assert(r >= 0);
+
+        r = b1_message_clone(message, &clone1);
+        assert(r >= 0);
+        assert(clone1 != message);
+
+        r = b1_message_clone(clone1, &clone2);
+        assert(r >= 0);
+
+        /* the origin is pinned, while it has clones */
+        r = b1_message_set_payload(message, &vec, 1);
+        assert(r == -EBUSY);
+        message = b1_message_unref(message);
+
+        r = b1_message_get_payload(clone2, &vecs, &n_vecs);
+        assert(r >= 0);
+        assert(n_vecs == 1);
+        assert(!strcmp(vecs->iov_base, payload));
+
+        r = b1_message_get_handle(clone2, 0, &handle);
+        assert(r >= 0);
+        assert(handle == b1_node_get_handle(node));
+
+        r = b1_message_get_fd(clone2, 0, &fd);
+        assert(r >= 0);
+        assert(fd >= 0);
+
+        /* clones replace what they borrowed with their own */
+        r = b1_message_set_fds(clone2, NULL, 0);
+        assert(r >= 0);
+
+        r = b1_message_get_fd(clone2, 0, &fd);
+        assert(r == -ERANGE);
+
+        r = b1_message_get_fd(clone1, 0, &fd);
+        assert(r >= 0);
+
+        clone1 = b1_message_unref(clone1);
+        assert(b1_message_get_type(clone2) == BUS1_MSG_DATA);
+}
+
+static void test_write(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        struct iovec vecs[] = {
+                { .iov_base = (void *)"WOOF", .iov_len = 4 },
+                { .iov_base = (void *)"MEOW", .iov_len = 5 },
+        };
+        struct iovec *vecs_out;
+        size_t n_vecs;
+        char buffer[16];
+        int r, fds[2];
+
+        r = pipe2(fds, O_CLOEXEC);
+        assert(r >= 0);
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
+        assert(r >= 0);
+
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        r = b1_message_set_payload(message, vecs, C_ARRAY_SIZE(vecs));
+        assert(r >= 0);
+
+        /* local payloads are written, but stay in place */
+        r = b1_message_write(message, fds[1]);
+        assert(r >= 0);
+        assert(read(fds[0], buffer, sizeof(buffer)) == 9);
+        assert(!memcmp(buffer, "WOOFMEOW", 9));
+
+        r = b1_message_get_payload(message, &vecs_out, &n_vecs);
+        assert(r >= 0);
+        assert(n_vecs == 2);
+
+        r = b1_message_send(message, &handle, 1);
+        assert(r >= 0);
+
+        message = b1_message_unref(message);
+
+        r = b1_peer_recv(dst, &message);
+        assert(r >= 0);
+
+        /* received payloads are written from the pool, and released */
+        r = b1_message_write(message, fds[1]);
+        assert(r >= 0);
+        assert(read(fds[0], buffer, sizeof(buffer)) == 9);
+        assert(!memcmp(buffer, "WOOFMEOW", 9));
+
+        r = b1_message_get_payload(message, &vecs_out, &n_vecs);
+        assert(r >= 0);
+        assert(n_vecs == 0);
+
+        close(fds[1]);
+        close(fds[0]);
+}
+
+static void test_send_batch(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL, *src_node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        B1Message *messages[3] = {};
+        B1Handle *src_handle, *received[3], *duplicates[2];
+        B1MessageSend sends[3];
+        struct iovec vec;
+        struct iovec *vecs;
+        size_t n_vecs, n_sent;
+        char payloads[3] = { 'a', 'b', 'c' };
+        int r;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node);
+        assert(r >= 0);
+
+        r = b1_node_new(src, &src_node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
+        assert(r >= 0);
+
+        src_handle = b1_node_get_handle(src_node);
+
+        for (unsigned int i = 0; i < C_ARRAY_SIZE(messages); i++) {
+                r = b1_message_new(src, &messages[i]);
+                assert(r >= 0);
+
+                vec.iov_base = &payloads[i];
+                vec.iov_len = 1;
+
+                r = b1_message_set_payload(messages[i], &vec, 1);
+                assert(r >= 0);
+
+                /* the node id is allocated by the first message only */
+                r = b1_message_set_handles(messages[i], &src_handle, 1);
+                assert(r >= 0);
+
+                sends[i] = (B1MessageSend){
+                        .message = messages[i],
+                        .destinations = &handle,
+                        .n_destinations = 1,
+                };
+        }
+
+        /* nothing is sent if any message is invalid */
+        received[0] = b1_node_get_handle(node);
+        sends[2].destinations = &received[0];
+        r = b1_messages_send(sends, 3, &n_sent);
+        assert(r == -EINVAL);
+        assert(n_sent == 0);
+        assert(b1_node_get_id(src_node) == BUS1_HANDLE_INVALID);
+        sends[2].destinations = &handle;
+
+        /* duplicate handles are caught before anything is sent, too */
+        duplicates[0] = duplicates[1] = src_handle;
+        r = b1_message_set_handles(messages[2], duplicates, 2);
+        assert(r >= 0);
+        r = b1_messages_send(sends, 3, &n_sent);
+        assert(r == -ENOTUNIQ);
+        assert(n_sent == 0);
+        assert(b1_node_get_id(src_node) == BUS1_HANDLE_INVALID);
+        r = b1_message_set_handles(messages[2], &src_handle, 1);
+        assert(r >= 0);
+
+        r = b1_messages_send(sends, 3, &n_sent);
+        assert(r >= 0);
+        assert(n_sent == 3);
+        assert(b1_node_get_id(src_node) != BUS1_HANDLE_INVALID);
+
+        for (unsigned int i = 0; i < C_ARRAY_SIZE(messages); i++) {
+                r = b1_peer_recv(dst, &message);
+                assert(r >= 0);
+
+                r = b1_message_get_payload(message, &vecs, &n_vecs);
+                assert(r >= 0);
+                assert(n_vecs == 1);
+                assert(*(char *)vecs->iov_base == payloads[i]);
+
+                r = b1_message_get_handle(message, 0, &received[i]);
+                assert(r >= 0);
+                assert(received[i] == received[0]);
+
+                message = b1_message_unref(message);
+        }
+
+        r = b1_peer_recv(dst, &message);
+        assert(r == -EAGAIN);
+
+        for (unsigned int i = 0; i < C_ARRAY_SIZE(messages); i++)
+                b1_message_unref(messages[i]);
+}
+
+static void test_limits(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *peer = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node1 = NULL, *node2 = NULL;
+        size_t max, usage;
+        uint64_t n_exceeded;
+        int r;
+
+        r = b1_peer_new(&peer);
+        assert(r >= 0);
+
+        r = b1_peer_set_limit(peer, _B1_PEER_LIMIT_N, 1);
+        assert(r == -EINVAL);
+
+        r = b1_peer_set_limit(peer, B1_PEER_LIMIT_NODES, 1);
+        assert(r >= 0);
+
+        r = b1_node_new(peer, &node1);
+        assert(r >= 0);
+
+        r = b1_node_new(peer, &node2);
+        assert(r == -EDQUOT);
+        assert(!node2);
+
+        r = b1_peer_get_limit(peer, B1_PEER_LIMIT_NODES, &max, &usage, &n_exceeded);
+        assert(r >= 0);
+        assert(max == 1);
+        assert(usage == 1);
+        assert(n_exceeded == 1);
+
+        r = b1_peer_get_limit(peer, B1_PEER_LIMIT_HANDLES, NULL, &usage, NULL);
+        assert(r >= 0);
+        assert(usage == 1);
+
+        node1 = b1_node_free(node1);
+
+        r = b1_peer_get_limit(peer, B1_PEER_LIMIT_NODES, NULL, &usage, NULL);
+        assert(r >= 0);
+        assert(usage == 0);
+}
+
+/* resident size of the mapping containing @p, in pages */
+static size_t mapping_resident(const void *p) {
+        unsigned long start, end, rss = -1;
+        int found = 0;
+        char line[512];
+        FILE *f;
+
+        f = fopen("/proc/self/smaps", "re");
+        assert(f);
+
+        while (fgets(line, sizeof(line), f)) {
+                if (sscanf(line, "%lx-%lx ", &start, &end) == 2)
+                        found = (uintptr_t)p >= start && (uintptr_t)p < end;
+                else if (found && sscanf(line, "Rss: %lu kB", &rss) == 1)
+                        break;
+        }
+
+        fclose(f);
+        assert(rss != (unsigned long)-1);
+
+        return rss * 1024 / sysconf(_SC_PAGESIZE);
+}
+
+static void test_compact_one(unsigned int n_idle) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *peer = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL;
+        B1Message *message = NULL;
+        size_t n_pages = 16, size = n_pages * sysconf(_SC_PAGESIZE);
+        struct iovec vec = {}, *vec_out;
+        char *payload;
+        const void *pool;
+        size_t n_vec, n_resident;
+        int r;
+
+        payload = malloc(size);
+        assert(payload);
+        memset(payload, 'x', size);
+        vec.iov_base = payload;
+        vec.iov_len = size;
+
+        r = b1_peer_new(&peer);
+        assert(r >= 0);
+
+        r = b1_node_new(peer, &node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), peer, &handle);
+        assert(r >= 0);
+
+        r = b1_peer_set_auto_compact(peer, n_idle);
+        assert(r >= 0);
+
+        /* fault in the slice of a large message, and keep only its pages */
+        r = b1_message_new(peer, &message);
+        assert(r >= 0);
+        r = b1_message_set_payload(message, &vec, 1);
+        assert(r >= 0);
+        r = b1_message_send(message, &handle, 1);
+        assert(r >= 0);
+        message = b1_message_unref(message);
+
+        r = b1_peer_recv(peer, &message);
+        assert(r >= 0);
+        r = b1_message_get_payload(message, &vec_out, &n_vec);
+        assert(r >= 0);
+        assert(n_vec == 1 && vec_out->iov_len == size);
+        assert(memchr(vec_out->iov_base, 'y', size) == NULL);
+
+        pool = vec_out->iov_base;
+        n_resident = mapping_resident(pool);
+        assert(n_resident >= n_pages - 1);
+
+        /* slices still owned by a message survive */
+        r = b1_peer_compact(peer);
+        assert(r >= 0);
+        assert(mapping_resident(pool) >= n_pages - 1);
+        assert(((const char *)vec_out->iov_base)[size - 1] == 'x');
+        message = b1_message_unref(message);
+
+        if (!n_idle) {
+                r = b1_peer_compact(peer);
+                assert(r >= 0);
+        } else {
+                /* only the n_idle-th empty receive attempt compacts */
+                for (unsigned int i = 1; i < n_idle; i++) {
+                        r = b1_peer_recv(peer, &message);
+                        assert(r == -EAGAIN);
+                        assert(mapping_resident(pool) >= n_pages - 1);
+                }
+
+                r = b1_peer_recv(peer, &message);
+                assert(r == -EAGAIN);
+                assert(!message);
+        }
+
+        assert(mapping_resident(pool) <= 1);
+
+        free(payload);
+}
+
+static void test_compact(void) {
+        test_compact_one(0);
+        test_compact_one(2);
+}
+
+static void test_shutdown(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL, *src_node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL, *src_handle = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        B1Message *reply;
+        size_t n_replies;
+        int r, fds[2], timeout = 10;
+        char c;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
+        assert(r >= 0);
+
+        r = b1_peer_shutdown(dst);
+        assert(r >= 0);
+
+        r = b1_peer_recv(src, &message);
+        assert(r >= 0);
+        assert(b1_message_get_type(message) == BUS1_MSG_NODE_DESTROY);
+        assert(b1_message_get_destination_handle(message) == handle);
+        message = b1_message_unref(message);
+
+        r = b1_peer_shutdown(src);
+        assert(r >= 0);
+
+        r = b1_peer_recv(dst, &message);
+        assert(r == -EAGAIN);
+
+        /* messages set aside by a gather hold fds, which are closed, too */
+        node = b1_node_free(node);
+        handle = b1_handle_unref(handle);
+
+        r = b1_node_new(dst, &node);
+        assert(r >= 0);
+
+        r = b1_node_new(src, &src_node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(src_node), dst, &src_handle);
+        assert(r >= 0);
+
+        r = pipe2(fds, O_CLOEXEC | O_NONBLOCK);
+        assert(r >= 0);
+
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        r = b1_message_set_fds(message, &fds[1], 1);
+        assert(r >= 0);
+
+        r = b1_message_send(message, &handle, 1);
+        assert(r >= 0);
+
+        message = b1_message_unref(message);
+        close(fds[1]);
+
+        r = b1_message_new(dst, &message);
+        assert(r >= 0);
+
+        r = b1_peer_gather(dst, message, &src_handle, 1, &timeout, &reply, &n_replies);
+        assert(r >= 0);
+        assert(n_replies == 0);
+
+        message = b1_message_unref(message);
+
+        /* the write end is still open in the queued message */
+        assert(read(fds[0], &c, 1) < 0 && errno == EAGAIN);
+
+        r = b1_peer_shutdown(dst);
+        assert(r >= 0);
+
+        assert(read(fds[0], &c, 1) == 0);
+        close(fds[0]);
+}
+
+static void test_dump(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *peer = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        char buf[4096] = {};
+        int fd, r;
+
+        r = b1_peer_new(&peer);
+        assert(r >= 0);
+
+        r = b1_peer_set_track_sites(peer, true);
+        assert(r >= 0);
+
+        r = b1_node_new(peer, &node);
+        assert(r >= 0);
+
+        fd = memfd_create("dump", MFD_CLOEXEC);
+        assert(fd >= 0);
+
+        r = b1_peer_dump(peer, fd, B1_PEER_DUMP_DETAILS | B1_PEER_DUMP_SITES);
+        assert(r >= 0);
+
+        r = b1_peer_dump(peer, fd, B1_PEER_DUMP_DETAILS | B1_PEER_DUMP_JSON);
+        assert(r >= 0);
+
+        r = pread(fd, buf, sizeof(buf) - 1, 0);
+        assert(r > 0);
+        assert(!strncmp(buf, "peer ", strlen("peer ")));
+        assert(strstr(buf, "budget nodes usage=1 "));
+        assert(strstr(buf, " type=nodes live=1 total=1\n"));
+        assert(strstr(buf, "\n{\"fd\":"));
+
+        close(fd);
+}
+
+struct dump_thread {
+        B1Peer *peer;
+        int fd;
+        bool done;
+};
+
+static void *dump_thread_fn(void *userdata) {
+        struct dump_thread *d = userdata;
+        int r;
+
+        while (!__atomic_load_n(&d->done, __ATOMIC_RELAXED)) {
+                r = b1_peer_dump(d->peer, d->fd, B1_PEER_DUMP_DETAILS | B1_PEER_DUMP_SITES);
+                assert(r >= 0);
+
+                r = b1_peer_dump(d->peer, d->fd, B1_PEER_DUMP_JSON);
+                assert(r >= 0);
+        }
+
+        return NULL;
+}
+
+static void test_dump_thread(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *peer = NULL;
+        struct dump_thread d = {};
+        pthread_t thread;
+        int r;
+
+        r = b1_peer_new(&peer);
+        assert(r >= 0);
+
+        r = b1_peer_set_track_sites(peer, true);
+        assert(r >= 0);
+
+        d.peer = peer;
+        d.fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        assert(d.fd >= 0);
+
+        r = pthread_create(&thread, NULL, dump_thread_fn, &d);
+        assert(r == 0);
+
+        /* create and drop nodes, handles and slices while they are dumped */
+        for (unsigned int i = 0; i < 1000; i++) {
+                _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+                _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL;
+                _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+
+                r = b1_node_new(peer, &node);
+                assert(r >= 0);
+
+                r = b1_handle_transfer(b1_node_get_handle(node), peer, &handle);
+                assert(r >= 0);
+
+                r = b1_message_new(peer, &message);
+                assert(r >= 0);
+
+                r = b1_message_set_handles(message, &handle, 1);
+                assert(r >= 0);
+
+                r = b1_message_send(message, &handle, 1);
+                assert(r >= 0);
+                message = b1_message_unref(message);
+
+                r = b1_peer_recv(peer, &message);
+                assert(r >= 0);
+        }
+
+        __atomic_store_n(&d.done, true, __ATOMIC_RELAXED);
+
+        r = pthread_join(thread, NULL);
+        assert(r == 0);
+
+        close(d.fd);
+}
+
+static int hook_deny(B1Message *message, B1Handle **destinations, size_t n_destinations, void *userdata) {
+        ++*(unsigned int *)userdata;
+
+        return -EPERM;
+}
+
+static int hook_count(B1Message *message, B1Handle **destinations, size_t n_destinations, void *userdata) {
+        ++*(unsigned int *)userdata;
+
+        return 0;
+}
+
+struct hook_mutate {
+        B1Peer *peer;
+        unsigned int n_mutate, n_removed, n_kept, n_added;
+};
+
+static int hook_mutate(B1Message *message, B1Handle **destinations, size_t n_destinations, void *userdata) {
+        struct hook_mutate *m = userdata;
+        int r;
+
+        ++m->n_mutate;
+
+        /* drop ourselves and the hook following us, and add a new one */
+        r = b1_peer_remove_hook(m->peer, B1_HOOK_SEND, hook_mutate, m);
+        assert(r >= 0);
+
+        r = b1_peer_remove_hook(m->peer, B1_HOOK_SEND, hook_count, &m->n_removed);
+        assert(r >= 0);
+
+        r = b1_peer_add_hook(m->peer, B1_HOOK_SEND, hook_count, &m->n_added);
+        assert(r >= 0);
+
+        return 0;
+}
+
+static void test_hooks(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *peer = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL;
+        unsigned int n_send = 0, n_recv = 0;
+        int r;
+
+        r = b1_peer_new(&peer);
+        assert(r >= 0);
+
+        r = b1_node_new(peer, &node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), peer, &handle);
+        assert(r >= 0);
+
+        r = b1_peer_add_hook(peer, _B1_HOOK_N, hook_count, NULL);
+        assert(r == -EINVAL);
+
+        r = b1_peer_add_hook(peer, B1_HOOK_SEND, hook_deny, &n_send);
+        assert(r >= 0);
+
+        r = b1_peer_add_hook(peer, B1_HOOK_RECV, hook_count, &n_recv);
+        assert(r >= 0);
+
+        r = b1_message_new(peer, &message);
+        assert(r >= 0);
+
+        r = b1_message_send(message, &handle, 1);
+        assert(r == -EPERM);
+        assert(n_send == 1);
+
+        r = b1_peer_remove_hook(peer, B1_HOOK_SEND, hook_deny, &n_send);
+        assert(r >= 0);
+
+        r = b1_peer_remove_hook(peer, B1_HOOK_SEND, hook_deny, &n_send);
+        assert(r == -ENOENT);
+
+        r = b1_message_send(message, &handle, 1);
+        assert(r >= 0);
+        assert(n_send == 1);
+        message = b1_message_unref(message);
+
+        r = b1_peer_recv(peer, &message);
+        assert(r >= 0);
+        assert(n_recv == 1);
+}
+
+static void test_hooks_mutate(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *peer = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL;
+        struct hook_mutate m = {};
+        int r;
+
+        r = b1_peer_new(&peer);
+        assert(r >= 0);
+
+        r = b1_node_new(peer, &node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), peer, &handle);
+        assert(r >= 0);
+
+        m.peer = peer;
+
+        r = b1_peer_add_hook(peer, B1_HOOK_SEND, hook_mutate, &m);
+        assert(r >= 0);
+
+        r = b1_peer_add_hook(peer, B1_HOOK_SEND, hook_count, &m.n_removed);
+        assert(r >= 0);
+
+        r = b1_peer_add_hook(peer, B1_HOOK_SEND, hook_count, &m.n_kept);
+        assert(r >= 0);
+
+        r = b1_message_new(peer, &message);
+        assert(r >= 0);
+
+        /* removed hooks are skipped, neither kept nor added ones are */
+        r = b1_message_send(message, &handle, 1);
+        assert(r >= 0);
+        assert(m.n_mutate == 1);
+        assert(m.n_removed == 0);
+        assert(m.n_kept == 1);
+        assert(m.n_added == 1);
+
+        r = b1_message_send(message, &handle, 1);
+        assert(r >= 0);
+        assert(m.n_mutate == 1);
+        assert(m.n_removed == 0);
+        assert(m.n_kept == 2);
+        assert(m.n_added == 2);
+}
+
+static void test_region(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL, *other = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL, *handle_other = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        _c_cleanup_(b1_region_unrefp) B1Region *region_src = NULL, *region_dst = NULL;
+        uint64_t ref[3] = { 7, 4096, 5 };
+        struct iovec vec = {
+                .iov_base = ref,
+                .iov_len = sizeof(ref),
+        };
+        struct iovec *vec_out;
+        size_t n_vec;
+        const void *data;
+        pid_t pid;
+        int r, fd;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&other);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
+        assert(r >= 0);
+
+        r = b1_region_new(src, &region_src, 1024 * 1024);
+        assert(r >= 0);
+        assert(b1_region_get_size(region_src) == 1024 * 1024);
+        memcpy((uint8_t *)b1_region_get_data(region_src) + 4096, "WOOF", 5);
+
+        /* pass the region once */
+        fd = b1_region_get_fd(region_src);
+
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        r = b1_message_set_fds(message, &fd, 1);
+        assert(r >= 0);
+
+        r = b1_message_send(message, &handle, 1);
+        assert(r >= 0);
+        message = b1_message_unref(message);
+
+        r = b1_peer_recv(dst, &message);
+        assert(r >= 0);
+
+        r = b1_message_get_fd(message, 0, &fd);
+        assert(r >= 0);
+
+        r = b1_region_new_from_fd(dst, &region_dst, fd);
+        assert(r >= 0);
+
+        r = b1_region_bind(region_dst, message, 7);
+        assert(r >= 0);
+        message = b1_message_unref(message);
+
+        /* refer to it without passing any fd */
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        r = b1_message_set_payload(message, &vec, 1);
+        assert(r >= 0);
+
+        r = b1_message_send(message, &handle, 1);
+        assert(r >= 0);
+        message = b1_message_unref(message);
+
+        r = b1_peer_recv(dst, &message);
+        assert(r >= 0);
+
+        r = b1_message_get_payload(message, &vec_out, &n_vec);
+        assert(r >= 0);
+        assert(vec_out->iov_len == sizeof(ref));
+        memcpy(ref, vec_out->iov_base, sizeof(ref));
+
+        r = b1_message_resolve_region(message, ref[0], ref[1], ref[2], &data);
+        assert(r >= 0);
+        assert(!strcmp(data, "WOOF"));
+
+        r = b1_message_resolve_region(message, 8, 0, 0, &data);
+        assert(r == -ENOENT);
+
+        r = b1_message_resolve_region(message, 7, 1024 * 1024, 1, &data);
+        assert(r == -ERANGE);
+
+        message = b1_message_unref(message);
+
+        /* ids are scoped to the sender, so other processes cannot resolve them */
+        r = b1_handle_transfer(b1_node_get_handle(node), other, &handle_other);
+        assert(r >= 0);
+
+        pid = fork();
+        assert(pid >= 0);
+        if (pid == 0) {
+                r = b1_message_new(other, &message);
+                assert(r >= 0);
+
+                r = b1_message_set_payload(message, &vec, 1);
+                assert(r >= 0);
+
+                r = b1_message_send(message, &handle_other, 1);
+                assert(r >= 0);
+
+                _exit(0);
+        }
+
+        r = waitpid(pid, NULL, 0);
+        assert(r == pid);
+
+        r = b1_peer_recv(dst, &message);
+        assert(r >= 0);
+
+        r = b1_message_resolve_region(message, 7, 4096, 5, &data);
+        assert(r == -ENOENT);
+
+        r = b1_region_unbind(region_dst);
+        assert(r >= 0);
+}
+
+static void test_region_pool(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL, *dst2 = NULL;
+        _c_cleanup_(b1_region_pool_freep) B1RegionPool *pool = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node_src = NULL, *node_dst = NULL, *node_dst2 = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle_src = NULL, *handle_src2 = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle_dst = NULL, *handle_dst2 = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        B1Region *region1, *region2;
+        B1Handle *releaser;
+        uint64_t id1, id2, id;
+        int r;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst2);
+        assert(r >= 0);
+
+        r = b1_node_new(src, &node_src);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node_dst);
+        assert(r >= 0);
+
+        r = b1_node_new(dst2, &node_dst2);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node_src), dst, &handle_src);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node_src), dst2, &handle_src2);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node_dst), src, &handle_dst);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node_dst2), src, &handle_dst2);
+        assert(r >= 0);
+
+        r = b1_region_pool_new(src, &pool);
+        assert(r >= 0);
+
+        r = b1_region_pool_acquire(pool, 5000, handle_dst, &region1, &id1);
+        assert(r >= 0);
+        assert(b1_region_get_size(region1) == 8192);
+
+        r = b1_region_pool_acquire(pool, 8192, handle_dst2, &region2, &id2);
+        assert(r >= 0);
+        assert(region2 != region1);
+        assert(id2 != id1);
+        region2 = b1_region_unref(region2);
+
+        r = b1_region_pool_acquire(pool, SIZE_MAX, handle_dst, &region2, &id);
+        assert(r == -EMSGSIZE);
+
+        r = b1_region_pool_acquire(pool, 5000, handle_src, &region2, &id);
+        assert(r == -EINVAL);
+
+        /* another receiver cannot release a region it was not given */
+        r = b1_region_send_release(handle_src2, node_dst2, id1);
+        assert(r >= 0);
+
+        r = b1_peer_recv(src, &message);
+        assert(r >= 0);
+
+        r = b1_message_get_region_release(message, &id, &releaser);
+        assert(r >= 0);
+        assert(id == id1);
+        assert(releaser == handle_dst2);
+
+        r = b1_region_pool_release(pool, id, releaser);
+        assert(r == -EPERM);
+        message = b1_message_unref(message);
+
+        /* the receiver hands the region back with a release message */
+        r = b1_region_send_release(handle_src, node_dst, id1);
+        assert(r >= 0);
+
+        r = b1_peer_recv(src, &message);
+        assert(r >= 0);
+
+        r = b1_message_get_region_release(message, &id, &releaser);
+        assert(r >= 0);
+        assert(id == id1);
+        assert(releaser == handle_dst);
+
+        r = b1_region_pool_release(pool, id, releaser);
+        assert(r >= 0);
+
+        r = b1_region_pool_release(pool, id, releaser);
+        assert(r == -EALREADY);
+
+        r = b1_region_pool_release(pool, 1000, releaser);
+        assert(r == -ENOENT);
+        message = b1_message_unref(message);
+
+        /* released regions are re-used */
+        r = b1_region_pool_acquire(pool, 6000, handle_dst, &region2, &id);
+        assert(r >= 0);
+        assert(region2 == region1);
+        assert(id == id1);
+        region1 = b1_region_unref(region1);
+        region2 = b1_region_unref(region2);
+
+        r = b1_region_pool_release(pool, id2, handle_dst2);
+        assert(r >= 0);
+
+        r = b1_region_pool_trim(pool);
+        assert(r >= 0);
+
+        r = b1_region_pool_release(pool, id2, handle_dst2);
+        assert(r == -ENOENT);
+
+        /* ordinary messages are not release messages */
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        r = b1_message_send(message, &handle_dst, 1);
+        assert(r >= 0);
+        message = b1_message_unref(message);
+
+        r = b1_peer_recv(dst, &message);
+        assert(r >= 0);
+
+        r = b1_message_get_region_release(message, &id, &releaser);
+        assert(r == -EBADMSG);
+}
+
+static void test_credentials(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        _c_cleanup_(b1_credentials_unrefp) B1Credentials *credentials = NULL;
+        B1Credentials *c;
+        char exe[4096];
+        ssize_t l;
+        int r;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
+        assert(r >= 0);
+
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        r = b1_message_get_credentials(message, &c);
+        assert(r == -ENODATA);
+
+        for (unsigned int i = 0; i < 3; i++) {
+                r = b1_message_send(message, &handle, 1);
+                assert(r >= 0);
+        }
+
+        message = b1_message_unref(message);
+
+        r = b1_peer_recv(dst, &message);
+        assert(r >= 0);
+
+        r = b1_message_get_credentials(message, &c);
+        assert(r >= 0);
+        assert(b1_credentials_get_pid(c) == getpid());
+        assert(b1_credentials_get_start_time(c) > 0);
+
+        l = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+        assert(l > 0);
+        exe[l] = 0;
+        assert(!strcmp(b1_credentials_get_exe(c), exe));
+
+        credentials = b1_credentials_ref(c);
+        message = b1_message_unref(message);
+
+        /* the second message hits the cache */
+        r = b1_peer_recv(dst, &message);
+        assert(r >= 0);
+
+        r = b1_message_get_credentials(message, &c);
+        assert(r >= 0);
+        assert(c == credentials);
+
+        message = b1_message_unref(message);
+
+        /* invalidated entries are read again */
+        r = b1_peer_invalidate_credentials(dst, getpid());
+        assert(r >= 0);
+
+        r = b1_peer_invalidate_credentials(dst, getpid());
+        assert(r == -ENOENT);
+
+        r = b1_peer_recv(dst, &message);
+        assert(r >= 0);
+
+        r = b1_message_get_credentials(message, &c);
+        assert(r >= 0);
+        assert(c != credentials);
+        assert(!strcmp(b1_credentials_get_exe(c), exe));
+}
+
+static void test_policy(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        _c_cleanup_(b1_policy_unrefp) B1Policy *policy = NULL;
+        int r, fd;
+
+        r = b1_policy_new_from_string(&policy, "allow uid 0-\nallow foo 1\n");
+        assert(r == -EBADMSG);
+        r = b1_policy_new_from_string(&policy, "allow uid 010\n");
+        assert(r == -EBADMSG);
+        r = b1_policy_new_from_string(&policy, "allow uid 0x10\n");
+        assert(r == -EBADMSG);
+
+        r = b1_policy_new_from_string(&policy,
+                                      "# no fds from anyone\n"
+                                      "deny fds 1-\n"
+                                      "allow uid 0- bytes -4096\n");
+        assert(r >= 0);
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        r = b1_peer_set_policy(dst, policy);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
+        assert(r >= 0);
+
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        fd = eventfd(0, 0);
+        assert(fd >= 0);
+
+        r = b1_message_set_fds(message, &fd, 1);
+        assert(r >= 0);
+
+        assert(close(fd) >= 0);
+
+        r = b1_message_send(message, &handle, 1);
+        assert(r >= 0);
+
+        r = b1_message_set_fds(message, NULL, 0);
+        assert(r >= 0);
+
+        r = b1_message_send(message, &handle, 1);
+        assert(r >= 0);
+        message = b1_message_unref(message);
+
+        /* the first message is dropped, the second one delivered */
+        r = b1_peer_recv(dst, &message);
+        assert(r >= 0);
+        assert(b1_message_get_type(message) == BUS1_MSG_DATA);
+        assert(b1_peer_get_n_denied(dst) == 1);
+
+        /* node policies override the peer policy */
+        policy = b1_policy_unref(policy);
+        r = b1_policy_new_from_string(&policy, "deny");
+        assert(r >= 0);
+
+        r = b1_node_set_policy(node, policy);
+        assert(r >= 0);
+
+        message = b1_message_unref(message);
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        r = b1_message_send(message, &handle, 1);
+        assert(r >= 0);
+        message = b1_message_unref(message);
+
+        r = b1_peer_recv(dst, &message);
+        assert(r == -EAGAIN);
+        assert(b1_peer_get_n_denied(dst) == 2);
+}
+
+struct notify_state {
+        unsigned int n_calls;
+        unsigned int type;
+        B1Node *node;
+        B1Handle *handle;
+};
+
+static int notify_record(B1Peer *peer, unsigned int type, B1Node *node, B1Handle *handle, void *userdata) {
+        struct notify_state *state = userdata;
+
+        ++state->n_calls;
+        state->type = type;
+        state->node = node;
+        state->handle = handle;
+
+        return 0;
+}
+
+static void test_notify(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        struct notify_state state = {};
+        int r;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
+        assert(r >= 0);
+
+        r = b1_peer_set_notify_fn(src, notify_record, &state);
+        assert(r >= 0);
+
+        r = b1_node_destroy(node);
+        assert(r >= 0);
+
+        /* the notification is consumed by the callback */
+        r = b1_peer_recv(src, &message);
+        assert(r == -EAGAIN);
+        assert(state.n_calls == 1);
+        assert(state.type == BUS1_MSG_NODE_DESTROY);
+        assert(state.handle == handle);
+        assert(!state.node);
+
+        r = b1_peer_set_notify_fn(src, NULL, NULL);
+        assert(r >= 0);
+}
+
+static int handler_count(B1Node *node, B1Message *message, void *userdata) {
+        ++*(unsigned int *)userdata;
+
+        return 0;
+}
+
+static void test_dispatch(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node1 = NULL, *node2 = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle1 = NULL, *handle2 = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        uint64_t buckets[B1_NODE_PROFILE_N], n_calls, n_ns, n;
+        unsigned int n_handled = 0;
+        int r;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node1);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node2);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node1), src, &handle1);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node2), src, &handle2);
+        assert(r >= 0);
+
+        r = b1_node_set_handler(node1, handler_count, &n_handled);
+        assert(r >= 0);
+
+        r = b1_peer_set_profiling(dst, true);
+        assert(r >= 0);
+
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        r = b1_message_send(message, &handle1, 1);
+        assert(r >= 0);
+
+        r = b1_message_send(message, &handle2, 1);
+        assert(r >= 0);
+
+        r = b1_message_send(message, &handle1, 1);
+        assert(r >= 0);
+
+        message = b1_message_unref(message);
+
+        /* handled messages are consumed, others returned */
+        r = b1_peer_dispatch(dst, &message);
+        assert(r >= 0);
+        assert(!message);
+
+        r = b1_peer_dispatch(dst, &message);
+        assert(r >= 0);
+        assert(b1_message_get_destination_node(message) == node2);
+        message = b1_message_unref(message);
+
+        r = b1_peer_dispatch(dst, &message);
+        assert(r >= 0);
+        assert(!message);
+
+        r = b1_peer_dispatch(dst, &message);
+        assert(r == -EAGAIN);
+
+        assert(n_handled == 2);
+
+        r = b1_node_get_profile(node1, BUS1_MSG_DATA, &n_calls, &n_ns, buckets);
+        assert(r >= 0);
+        assert(n_calls == 2);
+
+        n = 0;
+        for (unsigned int i = 0; i < B1_NODE_PROFILE_N; i++)
+                n += buckets[i];
+        assert(n == 2);
+
+        r = b1_node_get_profile(node2, BUS1_MSG_DATA, &n_calls, &n_ns, buckets);
+        assert(r >= 0);
+        assert(n_calls == 0);
+
+        r = b1_node_get_profile(node1, BUS1_MSG_NONE, &n_calls, &n_ns, buckets);
+        assert(r == -EINVAL);
+}
+
+static int handler_object(B1Node *node, uint64_t object, B1Message *message, void *userdata) {
+        struct iovec *vecs;
+        size_t n_vecs;
+        int r;
+
+        r = b1_message_get_payload(message, &vecs, &n_vecs);
+        assert(r >= 0);
+        assert(n_vecs == 1);
+        assert(vecs->iov_len == sizeof(uint64_t));
+        assert(*(uint64_t *)vecs->iov_base == object);
+
+        ++*(unsigned int *)userdata;
+
+        return 0;
+}
+
+static void test_objects(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        unsigned int n_handled[3] = {};
+        uint64_t objects[3], payload, plain[2];
+        struct iovec vec = {
+                .iov_base = &payload,
+                .iov_len = sizeof(payload),
+        }, plain_vec = {
+                .iov_base = plain,
+                .iov_len = sizeof(plain),
+        }, *vecs;
+        size_t n_vecs;
+        void *userdata;
+        int r;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
+        assert(r >= 0);
+
+        r = b1_node_set_object_handler(node, handler_object);
+        assert(r >= 0);
+
+        for (unsigned int i = 0; i < C_ARRAY_SIZE(objects); i++) {
+                r = b1_node_add_object(node, &n_handled[i], &objects[i]);
+                assert(r >= 0);
+                assert(objects[i]);
+        }
+
+        r = b1_node_get_object(node, objects[1], &userdata);
+        assert(r >= 0);
+        assert(userdata == &n_handled[1]);
+
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        r = b1_message_set_payload(message, &vec, 1);
+        assert(r >= 0);
+
+        /* the payload echoes the object id, so the handler can check it */
+        for (unsigned int i = 0; i < C_ARRAY_SIZE(objects); i++) {
+                payload = objects[i];
+
+                r = b1_message_set_object(message, objects[i]);
+                assert(r >= 0);
+
+                r = b1_message_send(message, &handle, 1);
+                assert(r >= 0);
+        }
+
+        message = b1_message_unref(message);
+
+        /* messages without an object keep their payload, even if it starts with an id */
+        plain[0] = objects[0];
+        plain[1] = objects[1];
+
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        r = b1_message_set_payload(message, &plain_vec, 1);
+        assert(r >= 0);
+
+        r = b1_message_send(message, &handle, 1);
+        assert(r >= 0);
+
+        message = b1_message_unref(message);
+
+        /* messages for removed objects are returned, rather than dispatched */
+        r = b1_node_remove_object(node, objects[2]);
+        assert(r >= 0);
+
+        r = b1_node_get_object(node, objects[2], &userdata);
+        assert(r == -ENOENT);
+
+        for (unsigned int i = 0; i < 2; i++) {
+                r = b1_peer_dispatch(dst, &message);
+                assert(r >= 0);
+                assert(!message);
+        }
+
+        r = b1_peer_dispatch(dst, &message);
+        assert(r >= 0);
+        assert(b1_message_get_destination_node(message) == node);
+        assert(b1_message_get_object(message) == objects[2]);
+        message = b1_message_unref(message);
+
+        r = b1_peer_dispatch(dst, &message);
+        assert(r >= 0);
+        assert(b1_message_get_destination_node(message) == node);
+        assert(b1_message_get_object(message) == 0);
+        r = b1_message_get_payload(message, &vecs, &n_vecs);
+        assert(r >= 0);
+        assert(n_vecs == 1);
+        assert(vecs->iov_len == sizeof(plain));
+        assert(!memcmp(vecs->iov_base, plain, sizeof(plain)));
+        message = b1_message_unref(message);
+
+        r = b1_peer_dispatch(dst, &message);
+        assert(r == -EAGAIN);
+
+        assert(n_handled[0] == 1);
+        assert(n_handled[1] == 1);
+        assert(n_handled[2] == 0);
+}
+
+static int handler_context(B1Node *node, B1Message *message, void *userdata) {
+        __atomic_add_fetch((unsigned int *)userdata, 1, __ATOMIC_RELEASE);
+
+        return 0;
+}
+
+static void context_unhandled(B1Peer *peer, B1Message *message, void *userdata) {
+        __atomic_add_fetch((unsigned int *)userdata, 1, __ATOMIC_RELEASE);
+}
+
+static void timer_count(B1Timer *timer, void *userdata) {
+        __atomic_add_fetch((unsigned int *)userdata, 1, __ATOMIC_RELEASE);
+}
+
+static void test_context(void) {
+        _c_cleanup_(b1_context_freep) B1Context *context = NULL;
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst1 = NULL, *dst2 = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node1 = NULL, *node2 = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle1 = NULL, *handle2 = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        _c_cleanup_(b1_timer_freep) B1Timer *timer = NULL;
+        unsigned int n_handled = 0, n_unhandled = 0, n_fired = 0;
+        int r;
+
+        r = b1_context_new(&context, 2);
+        assert(r >= 0);
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst1);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst2);
+        assert(r >= 0);
+
+        r = b1_node_new(dst1, &node1);
+        assert(r >= 0);
+
+        r = b1_node_new(dst2, &node2);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node1), src, &handle1);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node2), src, &handle2);
+        assert(r >= 0);
+
+        r = b1_node_set_handler(node1, handler_context, &n_handled);
+        assert(r >= 0);
+
+        /* two components, sharing the threads of one context */
+        r = b1_context_add_peer(context, dst1, context_unhandled, &n_unhandled);
+        assert(r >= 0);
+
+        r = b1_context_add_peer(context, dst2, context_unhandled, &n_unhandled);
+        assert(r >= 0);
+
+        r = b1_context_add_peer(context, dst1, NULL, NULL);
+        assert(r == -EEXIST);
+
+        r = b1_timer_new(context, &timer, timer_count, &n_fired);
+        assert(r >= 0);
+
+        r = b1_timer_arm(timer, 1000 * 1000);
+        assert(r >= 0);
+
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        for (unsigned int i = 0; i < 16; i++) {
+                r = b1_message_send(message, &handle1, 1);
+                assert(r >= 0);
+        }
+
+        r = b1_message_send(message, &handle2, 1);
+        assert(r >= 0);
+
+        for (unsigned int i = 0; i < 1000; i++) {
+                if (__atomic_load_n(&n_handled, __ATOMIC_ACQUIRE) == 16 &&
+                    __atomic_load_n(&n_unhandled, __ATOMIC_ACQUIRE) == 1 &&
+                    __atomic_load_n(&n_fired, __ATOMIC_ACQUIRE) == 1)
+                        break;
+
+                usleep(1000);
+        }
+
+        assert(n_handled == 16);
+        assert(n_unhandled == 1);
+        assert(n_fired == 1);
+
+        /* detached peers are no longer dispatched */
+        r = b1_context_remove_peer(context, dst2);
+        assert(r >= 0);
+
+        r = b1_context_remove_peer(context, dst2);
+        assert(r == -ENOENT);
+
+        r = b1_message_send(message, &handle2, 1);
+        assert(r >= 0);
+
+        message = b1_message_unref(message);
+
+        r = b1_peer_recv(dst2, &message);
+        assert(r >= 0);
+        assert(n_unhandled == 1);
+
+        r = b1_context_remove_peer(context, dst1);
+        assert(r >= 0);
+}
+
+struct context_remove {
+        B1Context *context;
+        B1Peer *peer; /* the peer to remove */
+        unsigned int *n_handled;
+};
+
+static int handler_context_remove(B1Node *node, B1Message *message, void *userdata) {
+        struct context_remove *remove = userdata;
+        int r;
+
+        /* let the other peer be dispatched meanwhile */
+        usleep(10 * 1000);
+
+        r = b1_context_remove_peer(remove->context, remove->peer);
+        assert(r >= 0 || r == -ENOENT);
+
+        __atomic_add_fetch(remove->n_handled, 1, __ATOMIC_RELEASE);
+
+        return 0;
+}
+
+static void test_context_remove(void) {
+        _c_cleanup_(b1_context_freep) B1Context *context = NULL;
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst1 = NULL, *dst2 = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node1 = NULL, *node2 = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle1 = NULL, *handle2 = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        struct context_remove remove1 = {}, remove2 = {};
+        unsigned int n_handled = 0;
+        int r;
+
+        r = b1_context_new(&context, 2);
+        assert(r >= 0);
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst1);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst2);
+        assert(r >= 0);
+
+        r = b1_node_new(dst1, &node1);
+        assert(r >= 0);
+
+        r = b1_node_new(dst2, &node2);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node1), src, &handle1);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node2), src, &handle2);
+        assert(r >= 0);
+
+        /* the handlers of the two peers remove each other's peer */
+        remove1 = (struct context_remove){ context, dst2, &n_handled };
+        remove2 = (struct context_remove){ context, dst1, &n_handled };
+
+        r = b1_node_set_handler(node1, handler_context_remove, &remove1);
+        assert(r >= 0);
+
+        r = b1_node_set_handler(node2, handler_context_remove, &remove2);
+        assert(r >= 0);
+
+        r = b1_context_add_peer(context, dst1, NULL, NULL);
+        assert(r >= 0);
+
+        r = b1_context_add_peer(context, dst2, NULL, NULL);
+        assert(r >= 0);
+
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        r = b1_message_send(message, &handle1, 1);
+        assert(r >= 0);
+
+        r = b1_message_send(message, &handle2, 1);
+        assert(r >= 0);
+
+        for (unsigned int i = 0; i < 1000; i++) {
+                if (__atomic_load_n(&n_handled, __ATOMIC_ACQUIRE) == 2)
+                        break;
+
+                usleep(1000);
+        }
+
+        /* both ran concurrently, removed each other, and none waited */
+        assert(n_handled == 2);
+
+        r = b1_context_remove_peer(context, dst1);
+        assert(r == -ENOENT);
+
+        r = b1_context_remove_peer(context, dst2);
+        assert(r == -ENOENT);
+}
+
+struct watchdog_state {
+        unsigned int n_reports;
+        B1Node *node;
+        unsigned int type;
+        uint64_t n_ns;
+        size_t n_frames;
+};
+
+static int handler_stall(B1Node *node, B1Message *message, void *userdata) {
+        usleep(100 * 1000);
+
+        return 0;
+}
+
+static void watchdog_record(B1Peer *peer,
+                            B1Node *node,
+                            unsigned int type,
+                            uint64_t n_ns,
+                            void * const *frames,
+                            size_t n_frames,
+                            void *userdata) {
+        struct watchdog_state *state = userdata;
+
+        ++state->n_reports;
+        state->node = node;
+        state->type = type;
+        state->n_ns = n_ns;
+        state->n_frames = n_frames;
+}
+
+static void test_watchdog(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        struct watchdog_state state = {};
+        int r;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
+        assert(r >= 0);
+
+        r = b1_node_set_handler(node, handler_stall, NULL);
+        assert(r >= 0);
+
+        r = b1_peer_set_watchdog(dst, 10 * 1000 * 1000, watchdog_record, &state);
+        assert(r >= 0);
+
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        r = b1_message_send(message, &handle, 1);
+        assert(r >= 0);
+
+        message = b1_message_unref(message);
+
+        r = b1_peer_dispatch(dst, &message);
+        assert(r >= 0);
+        assert(!message);
+
+        /* stopping the watchdog waits for any report in progress */
+        r = b1_peer_set_watchdog(dst, 0, NULL, NULL);
+        assert(r >= 0);
+
+        assert(state.n_reports == 1);
+        assert(state.node == node);
+        assert(state.type == BUS1_MSG_DATA);
+        assert(state.n_ns >= 10 * 1000 * 1000);
+        assert(state.n_frames > 0);
+}
+
+static void test_handover(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL, *successor = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *node = NULL, *src_node = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *handle = NULL, *dst_handle = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *message = NULL;
+        B1Handle **handles;
+        B1Node **nodes;
+        size_t n_nodes, n_handles;
+        uint64_t node_id, handle_id;
+        int r, fds[2];
+
+        r = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds);
+        assert(r >= 0);
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        r = b1_node_new(dst, &node);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node), src, &handle);
+        assert(r >= 0);
+
+        r = b1_node_new(src, &src_node);
+        assert(r >= 0);
+
+        /* a handle held by @dst, that must survive the hand-over */
+        r = b1_handle_transfer(b1_node_get_handle(src_node), dst, &dst_handle);
+        assert(r >= 0);
+
+        node_id = b1_node_get_id(node);
+        assert(node_id != BUS1_HANDLE_INVALID);
+        handle_id = b1_handle_get_id(dst_handle);
+        assert(handle_id != BUS1_HANDLE_INVALID);
+
+        r = b1_peer_export(dst, fds[0]);
+        assert(r >= 0);
+
+        /* the old objects are disconnected, and can be released for free */
+        assert(b1_node_get_id(node) == BUS1_HANDLE_INVALID);
+        node = b1_node_free(node);
+        dst_handle = b1_handle_unref(dst_handle);
+        dst = b1_peer_unref(dst);
+
+        r = b1_peer_import(&successor, fds[1], &nodes, &n_nodes, &handles, &n_handles);
+        assert(r >= 0);
+        assert(n_nodes == 1);
+        assert(b1_node_get_id(nodes[0]) == node_id);
+        assert(n_handles == 1);
+        assert(b1_handle_get_id(handles[0]) == handle_id);
+
+        /* the node is still reachable through the handle held by @src */
+        r = b1_message_new(src, &message);
+        assert(r >= 0);
+
+        r = b1_message_send(message, &handle, 1);
+        assert(r >= 0);
+
+        message = b1_message_unref(message);
+
+        r = b1_peer_recv(successor, &message);
+        assert(r >= 0);
+        assert(b1_message_get_type(message) == BUS1_MSG_DATA);
+        assert(b1_message_get_destination_node(message) == nodes[0]);
+
+        message = b1_message_unref(message);
+
+        b1_handle_unref(handles[0]);
+        b1_node_free(nodes[0]);
+        free(handles);
+        free(nodes);
+        close(fds[1]);
+        close(fds[0]);
+}
+
+struct cache_state {
+        B1Peer *peer;
+        B1Node **nodes;
+        unsigned int n_refills;
+};
+
+static int cache_refill(B1HandleCache *cache, uint64_t key, B1Handle **handlep, void *userdata) {
+        struct cache_state *state = userdata;
+
+        ++state->n_refills;
+
+        return b1_handle_transfer(b1_node_get_handle(state->nodes[key]), state->peer, handlep);
+}
+
+static void test_handle_cache(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
+        _c_cleanup_(b1_handle_cache_freep) B1HandleCache *cache = NULL;
+        struct cache_state state = {};
+        B1Node *nodes[16];
+        B1Handle *handle;
+        size_t n_entries;
+        uint64_t n_hits, n_misses, n_evicted;
+        int r;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst);
+        assert(r >= 0);
+
+        for (unsigned int i = 0; i < C_ARRAY_SIZE(nodes); i++) {
+                r = b1_node_new(dst, &nodes[i]);
+                assert(r >= 0);
+        }
+
+        r = b1_handle_cache_new(src, &cache, 0, NULL, NULL);
+        assert(r == -EINVAL);
+
+        state.peer = src;
+        state.nodes = nodes;
+
+        r = b1_handle_cache_new(src, &cache, 8, cache_refill, &state);
+        assert(r >= 0);
+
+        /* misses are refilled by the callback */
+        for (unsigned int i = 0; i < 8; i++) {
+                r = b1_handle_cache_get(cache, i, &handle);
+                assert(r >= 0);
+                assert(b1_handle_get_id(handle) != BUS1_HANDLE_INVALID);
+                b1_handle_unref(handle);
+        }
+        assert(state.n_refills == 8);
+
+        /* touch key 0, so it is the most recently used */
+        r = b1_handle_cache_get(cache, 0, &handle);
+        assert(r >= 0);
+        b1_handle_unref(handle);
+        assert(state.n_refills == 8);
+
+        /* exceeding the bound evicts a batch of the least recently used */
+        r = b1_handle_cache_get(cache, 8, &handle);
+        assert(r >= 0);
+        b1_handle_unref(handle);
+
+        b1_handle_cache_get_stats(cache, &n_entries, &n_hits, &n_misses, &n_evicted);
+        assert(n_entries == 7);
+        assert(n_hits == 1);
+        assert(n_misses == 9);
+        assert(n_evicted == 2);
+
+        /* key 0 survived, key 1 was evicted and is refilled */
+        r = b1_handle_cache_get(cache, 0, &handle);
+        assert(r >= 0);
+        b1_handle_unref(handle);
+        assert(state.n_refills == 9);
+
+        r = b1_handle_cache_get(cache, 1, &handle);
+        assert(r >= 0);
+        b1_handle_unref(handle);
+        assert(state.n_refills == 10);
+
+        r = b1_handle_cache_remove(cache, 1);
+        assert(r >= 0);
+
+        r = b1_handle_cache_remove(cache, 1);
+        assert(r == -ENOENT);
+
+        cache = b1_handle_cache_free(cache);
+
+        /* without a callback, misses fail */
+        r = b1_handle_cache_new(src, &cache, 8, NULL, NULL);
+        assert(r >= 0);
+
+        r = b1_handle_cache_get(cache, 0, &handle);
+        assert(r == -ENOENT);
+
+        for (unsigned int i = 0; i < C_ARRAY_SIZE(nodes); i++)
+                b1_node_free(nodes[i]);
+}
+
+static void gather_reply(B1Peer *peer, char tag) {
+        B1Message *message, *reply;
+        B1Handle *handle;
+        struct iovec vec = { &tag, 1 };
+        struct pollfd pfd = {
+                .fd = b1_peer_get_fd(peer),
+                .events = POLLIN,
+        };
+        int r;
+
+        while ((r = b1_peer_recv(peer, &message)) == -EAGAIN)
+                assert(poll(&pfd, 1, -1) >= 0);
+        assert(r >= 0);
+
+        /* the reply handle is appended to the handles of the request */
+        r = b1_message_get_handle(message, 1, &handle);
+        assert(r >= 0);
+
+        r = b1_message_new(peer, &reply);
+        assert(r >= 0);
+
+        r = b1_message_set_payload(reply, &vec, 1);
+        assert(r >= 0);
+
+        r = b1_message_send(reply, &handle, 1);
+        assert(r >= 0);
+}
+
+static void test_gather(void) {
+        _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst1 = NULL, *dst2 = NULL;
+        _c_cleanup_(b1_node_freep) B1Node *other_node = NULL, *node1 = NULL, *node2 = NULL;
+        _c_cleanup_(b1_handle_unrefp) B1Handle *other_handle = NULL;
+        _c_cleanup_(b1_message_unrefp) B1Message *request = NULL, *message = NULL;
+        B1Handle *handles[2] = {}, *other;
+        B1Message *replies[2];
+        struct iovec *vecs;
+        size_t n_replies, n_vecs;
+        int timeouts[2] = { -1, 10 };
+        pid_t pid;
+        int r;
+
+        r = b1_peer_new(&src);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst1);
+        assert(r >= 0);
+
+        r = b1_peer_new(&dst2);
+        assert(r >= 0);
+
+        r = b1_node_new(src, &other_node);
+        assert(r >= 0);
+
+        r = b1_node_new(dst1, &node1);
+        assert(r >= 0);
+
+        r = b1_node_new(dst2, &node2);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node1), src, &handles[0]);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(node2), src, &handles[1]);
+        assert(r >= 0);
+
+        r = b1_handle_transfer(b1_node_get_handle(other_node), dst1, &other_handle);
+        assert(r >= 0);
+
+        /* queued before the gather, and must be set aside by it */
+        r = b1_message_new(dst1, &message);
+        assert(r >= 0);
+
+        r = b1_message_send(message, &other_handle, 1);
+        assert(r >= 0);
+
+        message = b1_message_unref(message);
+
+        r = b1_message_new(src, &request);
+        assert(r >= 0);
+
+        other = b1_node_get_handle(other_node);
+        r = b1_message_set_handles(request, &other, 1);
+        assert(r >= 0);
+
+        /* replies are attributed to their destination, whatever their order */
+        pid = fork();
+        assert(pid >= 0);
+        if (pid == 0) {
+                gather_reply(dst2, 2);
+                gather_reply(dst1, 1);
+                _exit(0);
+        }
+
+        r = b1_peer_gather(src, request, handles, 2, NULL, replies, &n_replies);
+        assert(r >= 0);
+        assert(n_replies == 2);
+
+        for (size_t i = 0; i < n_replies; i++) {
+                r = b1_message_get_payload(replies[i], &vecs, &n_vecs);
+                assert(r >= 0);
+                assert(n_vecs == 1);
+                assert(*(char *)vecs->iov_base == (char)(i + 1));
+                b1_message_unref(replies[i]);
+        }
+
+        assert(waitpid(pid, &r, 0) == pid);
+        assert(WIFEXITED(r) && !WEXITSTATUS(r));
+
+        /* only the first destination replies, the second one times out */
+        pid = fork();
+        assert(pid >= 0);
+        if (pid == 0) {
+                gather_reply(dst1, 1);
+                _exit(0);
+        }
+
+        r = b1_peer_gather(src, request, handles, 2, timeouts, replies, &n_replies);
+        assert(r >= 0);
+        assert(n_replies == 1);
+        assert(replies[0]);
+        assert(!replies[1]);
+        b1_message_unref(replies[0]);
+
+        assert(waitpid(pid, &r, 0) == pid);
+        assert(WIFEXITED(r) && !WEXITSTATUS(r));
+
+        r = b1_peer_recv(src, &message);
+        assert(r >= 0);
+        assert(b1_message_get_destination_node(message) == other_node);
+        message = b1_message_unref(message);
+
+        r = b1_peer_recv(src, &message);
+        assert(r == -EAGAIN);
+
+        b1_handle_unref(handles[1]);
+        b1_handle_unref(handles[0]);
+}
+
 static void test_transaction(void) {
         _c_cleanup_(b1_peer_unrefp) B1Peer *src = NULL, *dst = NULL;
         _c_cleanup_(b1_node_freep) B1Node *node = NULL;
@@ -204,6 +2224,9 @@ static void test_transaction(void) {
         r = b1_message_get_fd(message, 0, &fd);
         assert(r >= 0);
         assert(fd >= 0);
+        r = b1_peer_compact(dst);
+        assert(r >= 0);
+        assert(strcmp(vec_out->iov_base, "WOOF") == 0);
         message = b1_message_unref(message);
 
         r = b1_peer_recv(dst, &message);
@@ -421,6 +2444,29 @@ int main(int argc, char **argv) {
         test_node();
         test_handle();
         test_message();
+        test_clone();
+        test_write();
+        test_send_batch();
+        test_limits();
+        test_compact();
+        test_shutdown();
+        test_dump();
+        test_dump_thread();
+        test_hooks();
+        test_hooks_mutate();
+        test_region();
+        test_region_pool();
+        test_credentials();
+        test_policy();
+        test_notify();
+        test_dispatch();
+        test_objects();
+        test_context();
+        test_context_remove();
+        test_watchdog();
+        test_handover();
+        test_gather();
+        test_handle_cache();
         test_transaction();
         test_multicast();
 
@@ -0,0 +1,313 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+/*
+ * Dispatch Watchdog
+ *
+ * A watchdog is a thread that periodically checks whether the node handler
+ * currently run by b1_peer_dispatch() exceeded its time budget. The
+ * dispatching thread publishes the handler it is about to run with a
+ * sequence counter, so this costs two clock reads and a few plain stores per
+ * message, and no locking.
+ *
+ * Once a handler is found stalled, the dispatching thread is interrupted with
+ * SIGRTMIN, whose handler records a backtrace of the stalled thread. The
+ * report is then passed to the callback, on the watchdog thread, while the
+ * stalled handler continues to run. Each handler invocation is reported at
+ * most once.
+ *
+ * Signals may arrive late, after the watchdog gave up waiting for them, or
+ * after the stalled handler returned. Each capture is therefore tagged with
+ * a unique token, and the signal handler first claims the token of the
+ * pending capture, only on the thread it was requested for, and only while
+ * that thread still runs the handler invocation it was requested for. A
+ * signal that finds no pending capture does nothing, and a claimed capture is
+ * always waited for, so a signal handler never writes to the frames while
+ * they are read.
+ */
+
+#include <assert.h>
+#include <c-macro.h>
+#include <errno.h>
+#include <execinfo.h>
+#include "peer.h"
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "watchdog.h"
+
+typedef struct B1WatchdogCapture {
+        uint64_t token; /* even while pending, odd once claimed, 0 if idle */
+        B1Watchdog *watchdog;
+        uint64_t seq;
+        pthread_t dispatcher;
+
+        sem_t done;
+        void *frames[B1_WATCHDOG_N_FRAMES];
+        int n_frames;
+} B1WatchdogCapture;
+
+/* stack captures are rare, so all watchdogs take turns on a single capture */
+static pthread_once_t b1_watchdog_once = PTHREAD_ONCE_INIT;
+static int b1_watchdog_init_error;
+static pthread_mutex_t b1_watchdog_capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static B1WatchdogCapture b1_watchdog_capture;
+static uint64_t b1_watchdog_tokens;
+
+static uint64_t b1_watchdog_now(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void b1_watchdog_signal(int signo) {
+        B1WatchdogCapture *capture = &b1_watchdog_capture;
+        int saved_errno = errno;
+        uint64_t token;
+
+        token = __atomic_load_n(&capture->token, __ATOMIC_ACQUIRE);
+        if (!token || (token & 1) || !pthread_equal(capture->dispatcher, pthread_self()))
+                goto exit;
+
+        if (!__atomic_compare_exchange_n(&capture->token, &token, token | 1, false,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                goto exit;
+
+        /* this thread owns the seq, so this is exact */
+        if (__atomic_load_n(&capture->watchdog->seq, __ATOMIC_RELAXED) == capture->seq)
+                capture->n_frames = backtrace(capture->frames, B1_WATCHDOG_N_FRAMES);
+        else
+                capture->n_frames = 0;
+
+        sem_post(&capture->done);
+
+exit:
+        errno = saved_errno;
+}
+
+static void b1_watchdog_init(void) {
+        struct sigaction sa = {
+                .sa_handler = b1_watchdog_signal,
+                .sa_flags = SA_RESTART,
+        }, old;
+
+        /* never take over a signal the application handles itself */
+        if (sigaction(SIGRTMIN, NULL, &old) < 0) {
+                b1_watchdog_init_error = -errno;
+                return;
+        }
+
+        if ((old.sa_flags & SA_SIGINFO) || (old.sa_handler != SIG_DFL && old.sa_handler != SIG_IGN)) {
+                b1_watchdog_init_error = -EBUSY;
+                return;
+        }
+
+        /* backtrace() loads its unwinder on first use, which is not signal-safe */
+        backtrace(b1_watchdog_capture.frames, 1);
+
+        sem_init(&b1_watchdog_capture.done, 0, 0);
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(SIGRTMIN, &sa, NULL) < 0)
+                b1_watchdog_init_error = -errno;
+}
+
+static int b1_watchdog_capture_frames(B1Watchdog *watchdog,
+                                      uint64_t seq,
+                                      pthread_t dispatcher,
+                                      void **frames) {
+        B1WatchdogCapture *capture = &b1_watchdog_capture;
+        struct timespec deadline;
+        uint64_t token;
+        int r = -1, n_frames = 0;
+
+        pthread_mutex_lock(&b1_watchdog_capture_lock);
+
+        b1_watchdog_tokens += 2;
+        token = b1_watchdog_tokens;
+
+        capture->watchdog = watchdog;
+        capture->seq = seq;
+        capture->dispatcher = dispatcher;
+        __atomic_store_n(&capture->token, token, __ATOMIC_RELEASE);
+
+        /* the handler may have returned since, the thread is only signaled if not */
+        if (__atomic_load_n(&watchdog->seq, __ATOMIC_ACQUIRE) == seq &&
+            pthread_kill(dispatcher, SIGRTMIN) == 0) {
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_nsec += 100 * 1000 * 1000;
+                if (deadline.tv_nsec >= 1000000000) {
+                        ++deadline.tv_sec;
+                        deadline.tv_nsec -= 1000000000;
+                }
+
+                do {
+                        r = sem_timedwait(&capture->done, &deadline);
+                } while (r < 0 && errno == EINTR);
+        }
+
+        /* withdraw the capture, unless a signal handler claimed it already */
+        if (!__atomic_compare_exchange_n(&capture->token, &token, 0, false,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                assert(token == (b1_watchdog_tokens | 1));
+
+                /* the claiming handler posts once done, if not already */
+                if (r < 0)
+                        while (sem_wait(&capture->done) < 0 && errno == EINTR)
+                                ;
+
+                /* empty if the signal arrived after the handler invocation ended */
+                n_frames = capture->n_frames;
+                memcpy(frames, capture->frames, n_frames * sizeof(*frames));
+
+                __atomic_store_n(&capture->token, 0, __ATOMIC_RELEASE);
+        }
+
+        pthread_mutex_unlock(&b1_watchdog_capture_lock);
+
+        return n_frames;
+}
+
+static void b1_watchdog_check(B1Watchdog *watchdog) {
+        void *frames[B1_WATCHDOG_N_FRAMES];
+        uint64_t seq, start_ns, now_ns;
+        pthread_t dispatcher;
+        unsigned int type;
+        B1Node *node;
+        int n_frames;
+
+        seq = __atomic_load_n(&watchdog->seq, __ATOMIC_ACQUIRE);
+        if (!(seq & 1) || seq == watchdog->reported_seq)
+                return;
+
+        start_ns = __atomic_load_n(&watchdog->start_ns, __ATOMIC_RELAXED);
+        node = __atomic_load_n(&watchdog->node, __ATOMIC_RELAXED);
+        type = __atomic_load_n(&watchdog->type, __ATOMIC_RELAXED);
+        dispatcher = __atomic_load_n(&watchdog->dispatcher, __ATOMIC_RELAXED);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&watchdog->seq, __ATOMIC_RELAXED) != seq)
+                return;
+
+        now_ns = b1_watchdog_now();
+        if (now_ns - start_ns < watchdog->budget_ns)
+                return;
+
+        watchdog->reported_seq = seq;
+
+        n_frames = b1_watchdog_capture_frames(watchdog, seq, dispatcher, frames);
+
+        watchdog->fn(watchdog->peer, node, type, now_ns - start_ns, frames, n_frames, watchdog->userdata);
+}
+
+static void *b1_watchdog_thread(void *userdata) {
+        B1Watchdog *watchdog = userdata;
+        uint64_t interval_ns, deadline_ns;
+        struct timespec deadline;
+        sigset_t mask;
+
+        /* leave all signals to the other threads */
+        sigfillset(&mask);
+        pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+        /* check four times per budget, but not more often than every millisecond */
+        interval_ns = c_max(watchdog->budget_ns / 4, 1000000ULL);
+
+        pthread_mutex_lock(&watchdog->lock);
+
+        while (!watchdog->stop) {
+                deadline_ns = b1_watchdog_now() + interval_ns;
+                deadline.tv_sec = deadline_ns / 1000000000ULL;
+                deadline.tv_nsec = deadline_ns % 1000000000ULL;
+
+                pthread_cond_timedwait(&watchdog->cond, &watchdog->lock, &deadline);
+                if (watchdog->stop)
+                        break;
+
+                pthread_mutex_unlock(&watchdog->lock);
+                b1_watchdog_check(watchdog);
+                pthread_mutex_lock(&watchdog->lock);
+        }
+
+        pthread_mutex_unlock(&watchdog->lock);
+
+        return NULL;
+}
+
+int b1_watchdog_new(B1Peer *peer, B1Watchdog **watchdogp, uint64_t budget_ns, B1WatchdogFn fn, void *userdata) {
+        pthread_condattr_t attr;
+        B1Watchdog *watchdog;
+        int r;
+
+        pthread_once(&b1_watchdog_once, b1_watchdog_init);
+        if (b1_watchdog_init_error < 0)
+                return b1_watchdog_init_error;
+
+        watchdog = calloc(1, sizeof(*watchdog));
+        if (!watchdog)
+                return -ENOMEM;
+
+        watchdog->peer = peer;
+        watchdog->budget_ns = budget_ns;
+        watchdog->fn = fn;
+        watchdog->userdata = userdata;
+
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&watchdog->cond, &attr);
+        pthread_condattr_destroy(&attr);
+        pthread_mutex_init(&watchdog->lock, NULL);
+
+        r = pthread_create(&watchdog->thread, NULL, b1_watchdog_thread, watchdog);
+        if (r) {
+                pthread_mutex_destroy(&watchdog->lock);
+                pthread_cond_destroy(&watchdog->cond);
+                free(watchdog);
+                return -r;
+        }
+
+        *watchdogp = watchdog;
+        return 0;
+}
+
+B1Watchdog *b1_watchdog_free(B1Watchdog *watchdog) {
+        if (!watchdog)
+                return NULL;
+
+        pthread_mutex_lock(&watchdog->lock);
+        watchdog->stop = true;
+        pthread_cond_signal(&watchdog->cond);
+        pthread_mutex_unlock(&watchdog->lock);
+
+        pthread_join(watchdog->thread, NULL);
+
+        pthread_mutex_destroy(&watchdog->lock);
+        pthread_cond_destroy(&watchdog->cond);
+        free(watchdog);
+
+        return NULL;
+}
+
+void b1_watchdog_begin(B1Watchdog *watchdog, B1Node *node, unsigned int type) {
+        /* seq is even here, so readers ignore the fields while they change */
+        __atomic_store_n(&watchdog->start_ns, b1_watchdog_now(), __ATOMIC_RELAXED);
+        __atomic_store_n(&watchdog->node, node, __ATOMIC_RELAXED);
+        __atomic_store_n(&watchdog->type, type, __ATOMIC_RELAXED);
+        __atomic_store_n(&watchdog->dispatcher, pthread_self(), __ATOMIC_RELAXED);
+
+        __atomic_store_n(&watchdog->seq, watchdog->seq + 1, __ATOMIC_RELEASE);
+}
+
+void b1_watchdog_end(B1Watchdog *watchdog) {
+        __atomic_store_n(&watchdog->seq, watchdog->seq + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2013-2016 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <pthread.h>
+#include "org.bus1/b1-peer.h"
+
+#define B1_WATCHDOG_N_FRAMES (64)
+
+typedef struct B1Watchdog B1Watchdog;
+
+struct B1Watchdog {
+        B1Peer *peer;
+        uint64_t budget_ns;
+        B1WatchdogFn fn;
+        void *userdata;
+
+        pthread_t thread;
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        bool stop;
+
+        /*
+         * Published by the dispatching thread, read by the watchdog thread.
+         * @seq is odd while a handler runs, and protects the fields below it.
+         */
+        uint64_t seq;
+        uint64_t start_ns;
+        B1Node *node;
+        unsigned int type;
+        pthread_t dispatcher;
+
+        uint64_t reported_seq; /* only accessed by the watchdog thread */
+};
+
+int b1_watchdog_new(B1Peer *peer, B1Watchdog **watchdogp, uint64_t budget_ns, B1WatchdogFn fn, void *userdata);
+B1Watchdog *b1_watchdog_free(B1Watchdog *watchdog);
+
+void b1_watchdog_begin(B1Watchdog *watchdog, B1Node *node, unsigned int type);
+void b1_watchdog_end(B1Watchdog *watchdog);